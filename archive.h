@@ -0,0 +1,63 @@
+#ifndef __ARCHIVE_H__
+    #define __ARCHIVE_H__
+
+    #include <common.h>
+
+    // A pre-digested chain archive, as written by the exportArchive command.
+    //
+    // An archive is a directory holding the blocks of the longest chain, in chain
+    // order, plus one file per column. Columns are flat, little-endian, fixed-width
+    // arrays meant to be mmapped. Offsets point into blocks.dat.
+
+    enum { kArchiveVersion = 2 };     // 2: P2WPKH outputs keyed by hash160(witness program), apart from P2PKH
+    static const uint64_t kArchiveMagic = 0x48435241504b4c42ULL; // "BLKPARCH"
+
+    struct ArchiveMeta
+    {
+        uint64_t magic;
+        uint64_t version;
+        uint64_t nbBlocks;
+        uint64_t nbTX;
+        uint64_t nbOutputs;
+        uint64_t nbInputs;
+    };
+
+    #define ARCHIVE_COLUMNS                                                                                                  \
+        COLUMN(Meta,          "meta"           ) /* ArchiveMeta                                                           */ \
+        COLUMN(BlockData,     "blocks.dat"     ) /* raw blocks, each preceded by its 8 byte magic+size, as in blk files    */ \
+        COLUMN(BlockOffsets,  "block.offsets"  ) /* uint64_t[nbBlocks]   : offset of block header                          */ \
+        COLUMN(BlockFirstTX,  "block.firstTX"  ) /* uint64_t[nbBlocks+1] : index of first TX in block                      */ \
+        COLUMN(TXOffsets,     "tx.offsets"     ) /* uint64_t[nbTX]       : offset of TX                                    */ \
+        COLUMN(TXIds,         "tx.ids"         ) /* uint256_t[nbTX]      : txid                                            */ \
+        COLUMN(TXFirstOutput, "tx.firstOutput" ) /* uint64_t[nbTX+1]     : index of first output of TX                     */ \
+        COLUMN(TXFirstInput,  "tx.firstInput"  ) /* uint64_t[nbTX+1]     : index of first input of TX                      */ \
+        COLUMN(OutputOffsets, "output.offsets" ) /* uint64_t[nbOutputs]  : offset of output                                */ \
+        COLUMN(OutputValues,  "output.values"  ) /* uint64_t[nbOutputs]  : value in satoshis                               */ \
+        COLUMN(OutputTypes,   "output.types"   ) /* int8_t[nbOutputs]    : solveOutputScript result, <0 if unsolved        */ \
+        COLUMN(OutputHash160, "output.hash160" ) /* uint160_t[nbOutputs] : hash160 paid to, zero if unsolved              */ \
+        COLUMN(InputSpends,   "input.spends"   ) /* uint64_t[nbInputs]   : index of output spent, kArchiveNoSpend if none  */ \
+
+    enum ArchiveColumn
+    {
+        #define COLUMN(x, y) kArchive##x,
+            ARCHIVE_COLUMNS
+        #undef COLUMN
+        kArchiveNbColumns
+    };
+
+    static const uint64_t kArchiveNoSpend = (uint64_t)-1;
+
+    static inline const char *archiveColumnName(
+        int column
+    )
+    {
+        static const char *names[] = {
+            #define COLUMN(x, y) y,
+                ARCHIVE_COLUMNS
+            #undef COLUMN
+        };
+        return names[column];
+    }
+
+#endif // __ARCHIVE_H__
+
@@ -0,0 +1,110 @@
+
+#include <arena.h>
+#include <errlog.h>
+
+#include <sys/mman.h>
+
+static const size_t kHugePageSize = 2 * 1024 * 1024;
+static const size_t kPageSize = 4096;
+
+// Constant initialized, so arenas built during static init can register
+static ArenaBase *gArenas = 0;
+
+ArenaBase::ArenaBase(
+    const char *_name,
+    size_t     _objectSize,
+    size_t     _chunkSize
+)
+    :   name(_name),
+        objectSize(_objectSize),
+        nbObjects(0),
+        nbRecycled(0),
+        next(gArenas)
+{
+    if(_chunkSize<_objectSize) _chunkSize = _objectSize;
+    chunkSize = (_chunkSize + kPageSize - 1) & ~(kPageSize - 1);
+    gArenas = this;
+}
+
+ArenaBase::~ArenaBase()
+{
+    release();
+
+    ArenaBase **link = &gArenas;
+    while(this!=*link) link = &((*link)->next);
+    *link = next;
+}
+
+static uint8_t *mapChunk(
+    size_t     size,
+    const char *name
+)
+{
+    // Huge page sized chunks get mapped with enough slack to trim them to a huge page boundary
+    bool huge = (0==(size % kHugePageSize));
+    size_t mapSize = huge ? size + kHugePageSize : size;
+
+    void *p = mmap(0, mapSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(MAP_FAILED==p) sysErrFatal("failed to map %" PRIu64 " bytes for arena %s", (uint64_t)mapSize, name);
+    if(!huge) return (uint8_t*)p;
+
+    uint8_t *start = (uint8_t*)p;
+    uint8_t *aligned = (uint8_t*)((((uintptr_t)start) + kHugePageSize - 1) & ~(uintptr_t)(kHugePageSize - 1));
+    uint8_t *end = start + mapSize;
+    if(start<aligned) munmap(start, aligned - start);
+    if(aligned + size<end) munmap(aligned + size, end - (aligned + size));
+
+    #if defined(MADV_HUGEPAGE)
+        madvise(aligned, size, MADV_HUGEPAGE);
+    #endif
+
+    return aligned;
+}
+
+uint8_t *ArenaBase::chunk(
+    size_t index
+)
+{
+    if(index<chunks.size()) return chunks[index];
+    uint8_t *c = mapChunk(chunkSize, name);
+    chunks.push_back(c);
+    return c;
+}
+
+void ArenaBase::release()
+{
+    auto e = chunks.end();
+    auto i = chunks.begin();
+    while(i!=e) {
+        int r = munmap(*(i++), chunkSize);
+        if(r<0) sysErr("failed to unmap chunk of arena %s", name);
+    }
+    chunks.clear();
+    nbObjects = nbRecycled = 0;
+}
+
+void ByteArena::nextChunk(
+    size_t size
+)
+{
+    if(chunkSize<size) errFatal("%" PRIu64 " bytes won't fit a chunk of arena %s", (uint64_t)size, name);
+    pool = chunk(chunkIndex++);
+    poolEnd = pool + chunkSize;
+}
+
+void showArenaStats()
+{
+    for(const ArenaBase *a=gArenas; 0!=a; a=a->next) {
+        if(0==a->chunks.size()) continue;
+        info(
+            "arena %-10s: %10" PRIu64 " objects, %8.2f MB used, %8.2f MB reserved in %d chunks, %" PRIu64 " recycled",
+            a->name,
+            a->nbObjects,
+            a->usedBytes()*1e-6,
+            a->reservedBytes()*1e-6,
+            (int)a->chunks.size(),
+            a->nbRecycled
+        );
+    }
+}
+
@@ -0,0 +1,229 @@
+#ifndef __ARENA_H__
+    #define __ARENA_H__
+
+    #include <vector>
+    #include <string.h>
+    #include <common.h>
+
+    // Typed bump allocator for the small fixed-size objects the parser makes by
+    // the million (hashes, blocks, addresses).
+    //
+    // Objects are carved back to back out of large chunks, and are not constructed:
+    // callers fill them in, exactly as with malloc. Chunks come straight from mmap,
+    // aligned on and sized in 2MB units by default, so the kernel can back them
+    // with transparent huge pages.
+    //
+    // Nothing is ever freed individually. recycle() puts an object on a free list
+    // that the next alloc() pops first, reset() rewinds the arena over the chunks
+    // it already has, release() hands every chunk back to the OS.
+    //
+    // Every arena registers itself by name, so that showArenaStats() can account
+    // for all of them.
+
+    struct ArenaBase
+    {
+        enum { kDefaultChunkSize = 2 * 1024 * 1024 };
+
+        const char *name;
+        size_t     objectSize;
+        size_t     chunkSize;
+        uint64_t   nbObjects;               // live objects: allocated and not recycled
+        uint64_t   nbRecycled;              // objects waiting on the free list
+
+        ArenaBase(
+            const char *_name,
+            size_t     _objectSize,
+            size_t     _chunkSize
+        );
+
+        ~ArenaBase();
+
+        uint64_t usedBytes()     const { return nbObjects*objectSize;         }
+        uint64_t reservedBytes() const { return chunks.size()*(uint64_t)chunkSize; }
+
+    protected:
+        uint8_t *chunk(size_t index);       // index-th chunk, mapped on first use
+
+        // Unmaps every chunk. Only the subclass knows where it carves from next:
+        // its own release() rewinds that first, then calls this.
+        void release();
+
+    private:
+        ArenaBase(const ArenaBase &);
+        ArenaBase &operator=(const ArenaBase &);
+
+        std::vector<uint8_t*> chunks;
+        ArenaBase *next;
+
+        friend void showArenaStats();
+    };
+
+    // One info line per arena that has anything in it
+    void showArenaStats();
+
+    // Byte strings of any size up to a chunk, carved back to back the same way.
+    // Its objects are bytes: nbObjects counts them. Sizes are rounded up to
+    // kGrain, and recycle() keeps one free list per rounded size, so that a
+    // recycled string gets reused by the next one of about the same size.
+    struct ByteArena:public ArenaBase
+    {
+        enum { kDefaultByteChunkSize = 64 * 1024 * 1024 };
+        enum { kGrain = 16 };
+
+        ByteArena(
+            const char *_name,
+            size_t     _chunkSize = kDefaultByteChunkSize
+        )
+            :   ArenaBase(_name, 1, _chunkSize),
+                pool(0),
+                poolEnd(0),
+                chunkIndex(0)
+        {
+        }
+
+        uint8_t *alloc(
+            size_t size
+        )
+        {
+            size = roundUp(size);
+            nbObjects += size;
+
+            size_t c = size/kGrain;
+            if(unlikely(c<freeLists.size() && 0!=freeLists[c])) {
+                uint8_t *p = freeLists[c];
+                memcpy(&freeLists[c], p, sizeof(p));
+                nbRecycled -= size;
+                return p;
+            }
+
+            if(unlikely((size_t)(poolEnd - pool)<size)) nextChunk(size);
+            uint8_t *p = pool;
+            pool += size;
+            return p;
+        }
+
+        // p must come from alloc(size)
+        void recycle(
+            uint8_t *p,
+            size_t  size
+        )
+        {
+            size = roundUp(size);
+            size_t c = size/kGrain;
+            if(unlikely(freeLists.size()<=c)) freeLists.resize(c + 1, 0);
+            memcpy(p, &freeLists[c], sizeof(p));
+            freeLists[c] = p;
+            nbRecycled += size;
+            nbObjects -= size;
+        }
+
+        // Forget every byte string, keep the chunks for what gets allocated next
+        void reset()
+        {
+            pool = poolEnd = 0;
+            chunkIndex = 0;
+            freeLists.clear();
+            nbObjects = nbRecycled = 0;
+        }
+
+        void release()
+        {
+            reset();
+            ArenaBase::release();
+        }
+
+    private:
+        void nextChunk(size_t size);
+
+        static size_t roundUp(
+            size_t size
+        )
+        {
+            return (0==size) ? kGrain : (size + kGrain - 1) & ~(size_t)(kGrain - 1);
+        }
+
+        uint8_t *pool;
+        uint8_t *poolEnd;
+        size_t chunkIndex;
+        std::vector<uint8_t*> freeLists;    // by size/kGrain
+    };
+
+    template<
+        typename T
+    >
+    struct Arena:public ArenaBase
+    {
+        Arena(
+            const char *_name,
+            size_t     _chunkSize = kDefaultChunkSize
+        )
+            :   ArenaBase(_name, sizeof(T), _chunkSize),
+                pool(0),
+                poolEnd(0),
+                chunkIndex(0),
+                freeList(0)
+        {
+        }
+
+        T *alloc()
+        {
+            ++nbObjects;
+
+            if(unlikely(0!=freeList)) {
+                FreeNode *node = freeList;
+                freeList = node->next;
+                --nbRecycled;
+                return reinterpret_cast<T*>(node);
+            }
+
+            if(unlikely(poolEnd==pool)) nextChunk();
+            return pool++;
+        }
+
+        void recycle(
+            T *object
+        )
+        {
+            FreeNode *node = reinterpret_cast<FreeNode*>(object);
+            node->next = freeList;
+            freeList = node;
+            ++nbRecycled;
+            --nbObjects;
+        }
+
+        // Forget every object, keep the chunks for what gets allocated next
+        void reset()
+        {
+            pool = poolEnd = 0;
+            chunkIndex = 0;
+            freeList = 0;
+            nbObjects = nbRecycled = 0;
+        }
+
+        void release()
+        {
+            reset();
+            ArenaBase::release();
+        }
+
+    private:
+        struct FreeNode { FreeNode *next; };
+
+        void nextChunk()
+        {
+            // chunkIndex is the index of the next chunk to carve, pool==0 before the first one
+            uint8_t *c = chunk(chunkIndex++);
+            pool = reinterpret_cast<T*>(c);
+            poolEnd = pool + chunkSize/sizeof(T);
+        }
+
+        T *pool;
+        T *poolEnd;
+        size_t chunkIndex;
+        FreeNode *freeList;
+
+        static_assert(sizeof(FreeNode)<=sizeof(T), "arena objects must be able to hold a free list link");
+    };
+
+#endif // __ARENA_H__
+
@@ -31,6 +31,8 @@
         virtual void     endBlock(const uint8_t *p                     )       {               }  // Called when an end of block is encountered during first pass
 
         // Callback for second, deep parse -- only valid blocks are seen, and are parsed in details
+        // Raw data pointers are good for as long as plain blk files stay mapped. Blocks of obfuscated or compressed ones are
+        // parsed out of a reused buffer: pointers into those, and upstream output scripts coming from them, are good until endBlock
         virtual void        start(  const Block *s, const Block *e     )       {               }  // Called when the second parse of the full chain starts
         virtual void      startTX(const uint8_t *p, const uint8_t *hash)       {               }  // Called when a new TX is encountered
         virtual void        endTX(const uint8_t *p                     )       {               }  // Called when an end of TX is encountered
@@ -41,6 +43,8 @@
         virtual void startOutputs(const uint8_t *p                     )       {               }  // Called when the start of a TX's output array is encountered
         virtual void   endOutputs(const uint8_t *p                     )       {               }  // Called when the end of a TX's output array is encountered
         virtual void  startOutput(const uint8_t *p                     )       {               }  // Called when a TX output is encountered
+        virtual void startWitnesses(const uint8_t *p                   )       {               }  // Called when the start of a segwit TX's witness array is encountered
+        virtual void endWitnesses(const uint8_t *p                     )       {               }  // Called when the end of a segwit TX's witness array is encountered
         virtual void   startBlock(  const Block *b, uint64_t chainSize )       {               }  // Called when a new block is encountered
         virtual void     endBlock(  const Block *b                     )       {               }  // Called when an end of block is encountered
         virtual void       wrapup(                                     )       {               }  // Called when the whole chain has been parsed
@@ -57,6 +61,17 @@
         {
         }
 
+        // Called for each item on the witness stack of a segwit TX input
+        virtual void witnessItem(
+            const uint8_t *txHash,              // sha256 of the current transaction (txid, witness data excluded)
+            uint64_t      inputIndex,           // Index of the input this witness belongs to
+            uint64_t      itemIndex,            // Index of this item on the input's witness stack
+            const uint8_t *item,                // Raw bytes of the witness item
+            uint64_t      itemSize              // Byte size of the witness item
+        )
+        {
+        }
+
         // Called exactly like startInput, but with a much richer context
         virtual void edge(
             uint64_t      value,                // Number of satoshis coming in on this input from upstream transaction
@@ -5,72 +5,508 @@
 #include <common.h>
 #include <errlog.h>
 #include <option.h>
+#include <output.h>
 #include <rmd160.h>
 #include <sha256.h>
 #include <callback.h>
 
+#include <mutex>
+#include <queue>
+#include <atomic>
+#include <string>
+#include <thread>
 #include <vector>
+#include <errno.h>
+#include <stdlib.h>
 #include <string.h>
+#include <algorithm>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <condition_variable>
 
-struct Addr;
+typedef uint32_t AddrID;
 static uint8_t emptyKey[kSHA256ByteSize] = { 0x52 };
-typedef GoogMap<Hash160, Addr*, Hash160Hasher, Hash160Equal>::Map AddrMap;
-typedef GoogMap<Hash160, int, Hash160Hasher, Hash160Equal>::Map RestrictMap;
+typedef Hash160Map<AddrID>::Map AddrMap;
+typedef Hash160Map<int>::Map RestrictMap;
 
-struct Output {
-    int32_t time;
+// An output, as inputs name it: hash of the TX that made it, then its index
+struct OutPoint
+{
+    uint8_t v[kSHA256ByteSize + sizeof(uint32_t)];
+
+    uint32_t index() const
+    {
+        uint32_t i;
+        memcpy(&i, v + kSHA256ByteSize, sizeof(i));
+        return i;
+    }
+};
+
+struct OutPointHasher
+{
+    uint64_t operator()(const OutPoint &o) const
+    {
+        return Hash256Hasher()(o.v) ^ o.index();
+    }
+};
+
+struct OutPointEqual
+{
+    bool operator()(const OutPoint &a, const OutPoint &b) const
+    {
+        return 0==memcmp(a.v, b.v, sizeof(a.v));
+    }
+};
+
+// What --detailed keeps about an output until it gets spent
+struct Unspent
+{
     int64_t value;
-    uint64_t inputIndex;
-    uint64_t outputIndex;
-    const uint8_t *upTXHash;
-    const uint8_t *downTXHash;
+    AddrID id;
+    int32_t height;                     // of the block that made it
+};
+
+typedef GoogMap<OutPoint, Unspent, OutPointHasher, OutPointEqual>::Map UnspentMap;
+typedef UnspentMap::value_type UnspentEntry;
+
+// Order of the outputs listed under an address: oldest first
+struct CompareUnspent
+{
+    bool operator()(
+        const UnspentEntry *a,
+        const UnspentEntry *b
+    ) const
+    {
+        if(a->second.height!=b->second.height) return a->second.height<b->second.height;
+        return memcmp(a->first.v, b->first.v, sizeof(a->first.v))<0;
+    }
+};
+
+// Every address seen so far, stored column by column. An address is known by
+// its id, handed out in the order addresses are first seen, which indexes all
+// columns. A scan over balances only ever touches the sums.
+struct AddrColumns
+{
+    std::vector<uint160_t> hashes;
+    std::vector<int64_t> sums;
+    std::vector<uint32_t> nbIns;
+    std::vector<uint32_t> nbOuts;
+    std::vector<int32_t> lastIns;      // block heights, 0 when never
+    std::vector<int32_t> lastOuts;
+    std::vector<int8_t> types;         // script type the address shows as, see addressType
+    WitnessPrograms programs;           // of the segwit addresses, to show them
+
+    size_t size() const { return sums.size(); }
+};
+
+// asctime() of a UTC unix time, minus the newline, without going through
+// libc's locked gmtime: civil date from day count, as in
+// http://howardhinnant.github.io/date_algorithms.html
+static void formatAscTime(
+    char    *dst,                       // 24 bytes
+    int64_t t
+)
+{
+    static const char days[] = "SunMonTueWedThuFriSat";
+    static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+
+    int64_t d = t / 86400;
+    int64_t secs = t % 86400;
+    if(secs<0) {
+        secs += 86400;
+        --d;
+    }
+
+    int64_t weekDay = (d + 4) % 7;       // 1970-01-01 was a thursday
+    if(weekDay<0) weekDay += 7;
+
+    int64_t z = d + 719468;
+    int64_t era = (0<=z ? z : z - 146096) / 146097;
+    int64_t dayOfEra = z - era*146097;
+    int64_t yearOfEra = (dayOfEra - dayOfEra/1460 + dayOfEra/36524 - dayOfEra/146096) / 365;
+    int64_t dayOfYear = dayOfEra - (365*yearOfEra + yearOfEra/4 - yearOfEra/100);
+    int64_t mp = (5*dayOfYear + 2)/153;
+    int64_t day = dayOfYear - (153*mp + 2)/5 + 1;
+    int64_t month = mp<10 ? mp + 3 : mp - 9;
+    int64_t year = yearOfEra + era*400 + (month<=2);
+
+    auto two = [](char *p, int64_t v) { p[0] = '0' + v/10; p[1] = '0' + v%10; };
+
+    memcpy(dst + 0, days + 3*weekDay, 3);
+    dst[3] = ' ';
+    memcpy(dst + 4, months + 3*(month - 1), 3);
+    dst[7] = ' ';
+    two(dst + 8, day);
+    if('0'==dst[8]) dst[8] = ' ';
+    dst[10] = ' ';
+    two(dst + 11, secs/3600);
+    dst[13] = ':';
+    two(dst + 14, (secs/60)%60);
+    dst[16] = ':';
+    two(dst + 17, secs%60);
+    dst[19] = ' ';
+    two(dst + 20, year/100);
+    two(dst + 22, year%100);
+}
+
+// asctime() strings of block times, indexed by block height. Each is made the
+// first time a row needs it, rather than twice per row: rows only ever refer
+// to the few hundred thousand distinct blocks.
+struct BlockTimeStrings
+{
+    enum { kSize = 24 };                // "Sat Jan  3 18:15:05 2009"
+
+    const std::vector<int32_t> &times;
+    std::vector<char> strings;          // kSize bytes per block, 0 until made
+
+    BlockTimeStrings(
+        const std::vector<int32_t> &_times
+    )
+        :   times(_times),
+            strings(kSize*_times.size(), 0)
+    {
+    }
+
+    const char *get(
+        int32_t height
+    )
+    {
+        char *s = &strings[kSize*height];
+        if(unlikely(0==s[0])) formatAscTime(s, times[height]);
+        return s;
+    }
 };
-typedef std::vector<Output> OutputVec;
 
-struct Addr
+// --binary row: fixed width, little endian, in report order
+struct BalanceRecord
+{
+    int64_t  sum;                       // satoshis
+    uint8_t  hash160[kRIPEMD160ByteSize];
+    uint32_t nbIn;
+    uint32_t nbOut;
+    int32_t  lastIn;                    // unix time of the last block that paid the address, 0 if none
+    int32_t  lastOut;                   // same, for the last spend
+    int8_t   type;                      // script type the address shows as, codes of OUTPUT_SCRIPT_TYPES
+    uint8_t  reserved[3];               // zero
+};
+static_assert(48==sizeof(BalanceRecord), "--binary records are 48 bytes");
+
+// The columns, plus the hash160 -> id map that grows them
+struct AddrTable:public AddrColumns
+{
+    AddrMap ids;
+
+    void init(
+        size_t expected
+    )
+    {
+        ids.setEmptyKey(emptyKey);
+        ids.resize(expected);
+        hashes.reserve(expected);
+        sums.reserve(expected);
+        nbIns.reserve(expected);
+        nbOuts.reserve(expected);
+        lastIns.reserve(expected);
+        lastOuts.reserve(expected);
+        types.reserve(expected);
+    }
+
+    // Id of address hash, added with a zero balance if never seen before
+    AddrID get(
+        const uint8_t        *hash,
+        int                  type,
+        const WitnessProgram &program
+    )
+    {
+        auto i = ids.find(hash);
+        if(likely(ids.end()!=i)) return i->second;
+
+        size_t id = size();
+        if(unlikely(UINT32_MAX==id)) errFatal("too many addresses, ids are 32 bits");
+        ids[hash] = (AddrID)id;
+
+        hashes.push_back(uint160_t());
+        memcpy(hashes.back().v, hash, kRIPEMD160ByteSize);
+        sums.push_back(0);
+        nbIns.push_back(0);
+        nbOuts.push_back(0);
+        lastIns.push_back(0);
+        lastOuts.push_back(0);
+        types.push_back(addressType(type));
+        programs.add((uint32_t)id, program);
+        return (AddrID)id;
+    }
+};
+
+// What move() hands over to the shard that owns the address
+struct Move
 {
-    int64_t sum;
-    uint64_t nbIn;
-    uint64_t nbOut;
     uint160_t hash;
-    int32_t lastIn;
-    int32_t lastOut;
-    OutputVec *outputVec;
+    int32_t height;
+    int64_t value;
+    uint64_t seq;                       // parse order, see Shard::firstSeen
+    int8_t type;
+    WitnessProgram program;             // segwit outputs only
+    OutPoint outPoint;                  // --detailed only
+    bool spend;
 };
 
-template<> Addr *PagedAllocator<Addr>::pool = 0;
-template<> Addr *PagedAllocator<Addr>::poolEnd = 0;
-static inline Addr *allocAddr() { return PagedAllocator<Addr>::alloc(); }
+// Single producer, single consumer ring of moves, without locks on the way
+// in or out. The producer only makes its position visible every kPublish
+// moves, or on publish(), so the consumer's cache line isn't pulled back and
+// forth on every push. A consumer that runs dry spins a little, then parks on
+// a condition variable until the next publish().
+struct MoveQueue
+{
+    enum { kCapacity = 16 * 1024 };     // moves, a power of 2
+    enum { kPublish = 256 };
+
+    Move *ring;
+    std::atomic<uint64_t> head;         // moves published by the producer
+    std::atomic<uint64_t> tail;         // moves applied by the consumer
+    std::atomic<bool> parked;
+    std::mutex mutex;
+    std::condition_variable wakeup;
+
+    uint64_t localHead;                 // producer only
+    uint64_t cachedTail;                // producer only
 
-struct CompareAddr
+    MoveQueue()
+        :   ring(new Move[kCapacity]),
+            head(0),
+            tail(0),
+            parked(false),
+            localHead(0),
+            cachedTail(0)
+    {
+    }
+
+    void push(
+        const Move &m
+    )
+    {
+        if(unlikely(kCapacity==localHead - cachedTail)) {
+            publish();
+            while(kCapacity==localHead - (cachedTail = tail.load(std::memory_order_acquire))) {
+                std::this_thread::yield();
+            }
+        }
+
+        ring[localHead % kCapacity] = m;
+        ++localHead;
+        if(unlikely(0==(localHead % kPublish))) publish();
+    }
+
+    void publish()
+    {
+        head.store(localHead, std::memory_order_seq_cst);
+        if(parked.load(std::memory_order_seq_cst)) {
+            std::lock_guard<std::mutex> lock(mutex);
+            wakeup.notify_one();
+        }
+    }
+
+    // Producer: wait until every move pushed so far has been applied
+    void drain()
+    {
+        publish();
+        while(localHead!=tail.load(std::memory_order_acquire)) {
+            std::this_thread::yield();
+        }
+    }
+
+    // Consumer: wait for moves past t, returns the new head
+    uint64_t wait(
+        uint64_t t
+    )
+    {
+        for(int spin=0; spin<64; ++spin) {
+            uint64_t h = head.load(std::memory_order_acquire);
+            if(h!=t) return h;
+            std::this_thread::yield();
+        }
+
+        uint64_t h = t;
+        std::unique_lock<std::mutex> lock(mutex);
+        parked.store(true, std::memory_order_seq_cst);
+        wakeup.wait(lock, [&] { h = head.load(std::memory_order_seq_cst); return h!=t; });
+        parked.store(false, std::memory_order_relaxed);
+        return h;
+    }
+};
+
+// Addresses are spread over shards by hash. A shard owns the addresses that
+// hash to it, their unspent outputs in --detailed mode, and, when there is
+// more than one shard, a worker thread that applies the moves queued to it.
+struct Shard
+{
+    AddrTable addrs;
+    UnspentMap unspent;
+    std::vector<uint64_t> firstSeen;    // by id: seq of the move that added the address
+    std::atomic<uint64_t> nbAddrs;      // for progress reports, read while the worker runs
+    MoveQueue queue;
+
+    Shard()
+        :   unspent(kMapRoleTX),
+            nbAddrs(0)
+    {
+    }
+};
+
+// Balances as of some height, waiting to be written out
+struct Snapshot
+{
+    AddrColumns cols;
+    std::vector<int32_t> blockTimes;
+    std::string fileName;
+    int64_t nonZeroCnt;
+};
+
+// Sort record for wrapup: ascending key is descending balance, index is the
+// address id, i.e. the order addresses were first seen, which breaks ties
+struct Ranked
+{
+    uint64_t key;
+    uint64_t index;
+};
+
+static inline uint64_t rankKey(
+    int64_t sum
+)
+{
+    return ~(static_cast<uint64_t>(sum) ^ (1ULL<<63));
+}
+
+struct CompareRanked
 {
     bool operator()(
-        const Addr *const &a,
-        const Addr *const &b
+        const Ranked &a,
+        const Ranked &b
     ) const
     {
-        return (b->sum) < (a->sum);
+        if(a.key!=b.key) return a.key<b.key;
+        return a.index<b.index;
+    }
+};
+
+// One thread's share of a radix pass: count, then scatter, its slice
+struct RadixSlice
+{
+    const Ranked *src;
+    Ranked       *dst;
+    size_t       start;
+    size_t       end;
+    int          shift;
+    uint64_t     counts[256];
+
+    void count()
+    {
+        memset(counts, 0, sizeof(counts));
+        for(size_t i=start; i<end; ++i) ++counts[0xFF & (src[i].key>>shift)];
+    }
+
+    void scatter()
+    {
+        for(size_t i=start; i<end; ++i) dst[counts[0xFF & (src[i].key>>shift)]++] = src[i];
     }
 };
 
+template<typename F> static void runSlices(
+    std::vector<RadixSlice> &slices,
+    F                       f
+)
+{
+    std::vector<std::thread> threads;
+    for(size_t i=1; i<slices.size(); ++i) threads.push_back(std::thread(f, &slices[i]));
+    f(&slices[0]);
+    for(auto &t:threads) t.join();
+}
+
+// Stable LSD radix sort on key, 8 bits per pass. Every pass is split across
+// cores; passes where all keys share the same byte are skipped, which on
+// balances is most of the high bytes. Input in index order comes out in
+// CompareRanked order.
+static void radixSortRanked(
+    std::vector<Ranked> &v
+)
+{
+    size_t n = v.size();
+    std::vector<Ranked> tmp(n);
+
+    // At least 1M records per thread
+    size_t nbSlices = 1 + (n>>20);
+    size_t nbCores = std::thread::hardware_concurrency();
+    if(0==nbCores) nbCores = 1;
+    if(nbCores<nbSlices) nbSlices = nbCores;
+
+    std::vector<RadixSlice> slices(nbSlices);
+    for(size_t i=0; i<nbSlices; ++i) {
+        slices[i].start = (n*i)/nbSlices;
+        slices[i].end = (n*(i+1))/nbSlices;
+    }
+
+    for(int shift=0; shift<64; shift+=8) {
+
+        for(auto &slice:slices) {
+            slice.src = v.data();
+            slice.dst = tmp.data();
+            slice.shift = shift;
+        }
+        runSlices(slices, [](RadixSlice *slice) { slice->count(); });
+
+        // Turn per-slice counts into per-slice output cursors
+        uint64_t offset = 0;
+        bool trivial = false;
+        for(int b=0; b<256; ++b) {
+            uint64_t bucketSize = 0;
+            for(auto &slice:slices) {
+                uint64_t c = slice.counts[b];
+                slice.counts[b] = offset;
+                offset += c;
+                bucketSize += c;
+            }
+            if(n==bucketSize) trivial = true;
+        }
+        if(trivial) continue;
+
+        runSlices(slices, [](RadixSlice *slice) { slice->scatter(); });
+        v.swap(tmp);
+    }
+}
+
 struct AllBalances:public Callback
 {
+    bool binary;
     bool detailed;
     int64_t limit;
     uint64_t offset;
     int64_t showAddr;
     int64_t cutoffBlock;
+    int64_t every;
+    std::string outputDir;
+    std::vector<int64_t> cutoffs;
+    size_t nextCutoff;
+    struct Snapshot *snapshot;
+    std::thread snapshotWriter;
     optparse::OptionParser parser;
 
-    AddrMap addrMap;
-    int32_t blockTime;
+    int64_t nbShards;
+    uint64_t nbMoves;
+    std::vector<Shard*> shards;
+    AddrColumns merged;                 // all shards in one, when there are several
+    std::vector<std::vector<AddrID>> remap;
+    int32_t blockHeight;
+    std::vector<int32_t> blockTimes;   // by height
     const Block *curBlock;
     const Block *lastBlock;
     const Block *firstBlock;
     RestrictMap restrictMap;
-    std::vector<Addr*> allAddrs;
     std::vector<uint160_t> restricts;
 
+    // --detailed: unspent outputs of address id are byAddr[firsts[id]] up to byAddr[firsts[id+1]]
+    std::vector<uint64_t> firsts;
+    std::vector<const UnspentEntry*> byAddr;
+
     AllBalances()
     {
         parser
@@ -86,6 +522,25 @@ struct AllBalances:public Callback
             .set_default(-1)
             .help("only take into account transactions in blocks strictly older than <block> (default: all)")
         ;
+        parser
+            .add_option("-b", "--atBlocks")
+            .action("store")
+            .set_default("")
+            .help("write balances as of each of the comma separated <blocks> to a file, in a single pass")
+        ;
+        parser
+            .add_option("-e", "--every")
+            .action("store")
+            .type("int")
+            .set_default(0)
+            .help("write balances to a file every N blocks, and at the end of the chain (default: off)")
+        ;
+        parser
+            .add_option("-o", "--output")
+            .action("store")
+            .set_default("balances")
+            .help("directory --atBlocks and --every write their files to (default: %default)")
+        ;
         parser
             .add_option("-l", "--limit")
             .action("store")
@@ -106,6 +561,25 @@ struct AllBalances:public Callback
             .set_default(false)
             .help("also show all unspent outputs")
         ;
+        parser
+            .add_option("-s", "--shards")
+            .action("store")
+            .type("int")
+            .set_default(1)
+            .help("split the address table in N shards, each updated by a thread of its own (default: %default)")
+        ;
+        parser
+            .add_option("-B", "--binary")
+            .action("store_true")
+            .set_default(false)
+            .help("write 48 byte little endian records instead of text: sum:i64, hash160:20 bytes, nbIn:u32, nbOut:u32, lastTimeIn:i32, lastTimeOut:i32, type:i8 (0 P2PKH, 3 P2SH, 4 P2WPKH, 5 P2WSH, 6 P2TR, 7 multisig), zero:3 bytes")
+        ;
+    }
+
+    ~AllBalances()
+    {
+        // Only ever still running when something died with errFatal
+        if(snapshotWriter.joinable()) snapshotWriter.detach();
     }
 
     virtual const char                   *name() const         { return "allBalances"; }
@@ -129,15 +603,53 @@ struct AllBalances:public Callback
         lastBlock = 0;
         firstBlock = 0;
 
-        addrMap.setEmptyKey(emptyKey);
-        addrMap.resize(15 * 1000 * 1000);
-        allAddrs.reserve(15 * 1000 * 1000);
-
         optparse::Values &values = parser.parse_args(argc, argv);
         cutoffBlock = values.get("atBlock");
         showAddr = values.get("withAddr");
         detailed = values.get("detailed");
+        binary = values.get("binary");
         limit = values.get("limit");
+        nbShards = values.get("shards");
+        every = values.get("every");
+        outputDir = (const char *)values.get("output");
+        parseCutoffs((const char *)values.get("atBlocks"));
+
+        if(binary && detailed) errFatal("--detailed has no --binary form");
+        if(nbShards<1 || 256<nbShards) errFatal("--shards must be between 1 and 256");
+
+        if(snapshotMode()) {
+            if(0<=cutoffBlock) errFatal("--atBlock can't be combined with --atBlocks or --every");
+            if(detailed)       errFatal("--detailed can't be combined with --atBlocks or --every");
+            if(every<0)        errFatal("--every must be positive");
+
+            int r = mkdir(outputDir.c_str(), 0755);
+            if(r<0 && EEXIST!=errno) sysErrFatal("couldn't create directory %s", outputDir.c_str());
+        }
+
+        blockTimes.reserve(1000 * 1000);
+        blockTimes.push_back(0);        // height 0 stands for "never"
+
+        nbMoves = 0;
+        for(int64_t i=0; i<nbShards; ++i) {
+
+            Shard *shard = new Shard;
+            shard->addrs.init((15 * 1000 * 1000)/nbShards);
+            if(detailed) {
+                OutPoint empty, deleted;
+                memset(empty.v, 0, sizeof(empty.v));
+                memset(deleted.v, 0, sizeof(deleted.v));
+                empty.v[0] = 0x52;
+                deleted.v[0] = 0x53;
+                shard->unspent.setEmptyKey(empty);
+                shard->unspent.setDeletedKey(deleted);
+            }
+            shards.push_back(shard);
+
+            // Like the output flusher, workers are never stopped: callbacks
+            // exit() from wrapup while they are parked
+            if(1<nbShards) std::thread(&AllBalances::work, this, shard).detach();
+        }
+        if(1<nbShards) info("updating balances from %" PRIu64 " worker threads", nbShards);
 
         auto args = parser.args();
         for(size_t i=1; i<args.size(); ++i) {
@@ -164,8 +676,7 @@ struct AllBalances:public Callback
             }
         } else {
             if(detailed) {
-                warning("asking for --detailed for *all* addresses in the blockchain will be *very* slow");
-                warning("as a matter of fact, it likely won't ever finish unless you have *lots* of RAM");
+                warning("--detailed for *all* addresses keeps the whole UTXO set in RAM");
             }
         }
 
@@ -179,8 +690,7 @@ struct AllBalances:public Callback
         const uint8_t *upTXHash,
         uint64_t       outputIndex,
         int64_t       value,
-        const uint8_t *downTXHash = 0,
-        uint64_t      inputIndex = static_cast<uint64_t>(-1)
+        const uint8_t *downTXHash = 0       // set on spends only
     )
     {
         uint8_t addrType[3];
@@ -195,47 +705,154 @@ struct AllBalances:public Callback
             }
         }
 
-        Addr *addr;
-        auto i = addrMap.find(pubKeyHash.v);
-        if(unlikely(addrMap.end()!=i)) {
-            addr = i->second;
-        } else {
-
-            addr = allocAddr();
+        Move m;
+        m.hash = pubKeyHash;
+        m.height = blockHeight;
+        m.value = value;
+        m.seq = nbMoves++;
+        m.type = type;
+        witnessProgram(m.program, type, script, scriptSize);
+        if(detailed) {
+            uint32_t index = (uint32_t)outputIndex;
+            memcpy(m.outPoint.v, upTXHash, kSHA256ByteSize);
+            memcpy(m.outPoint.v + kSHA256ByteSize, &index, sizeof(index));
+            m.spend = (0!=downTXHash);
+        }
 
-            memcpy(addr->hash.v, pubKeyHash.v, kRIPEMD160ByteSize);
-            addr->outputVec = 0;
-            addr->nbOut = 0;
-            addr->nbIn = 0;
-            addr->sum = 0;
+        if(1==nbShards) apply(*shards[0], m);
+        else            shards[shardOf(pubKeyHash.v)]->queue.push(m);
+    }
 
-            if(detailed) {
-                addr->outputVec = new OutputVec;
-            }
+    size_t shardOf(
+        const uint8_t *hash
+    ) const
+    {
+        // Not the bytes the maps hash on, so every shard's maps still see random keys
+        uint32_t h = (hash[kRIPEMD160ByteSize - 2]<<8) | hash[kRIPEMD160ByteSize - 1];
+        return h % nbShards;
+    }
 
-            addrMap[addr->hash.v] = addr;
-            allAddrs.push_back(addr);
+    void apply(
+        Shard      &shard,
+        const Move &m
+    )
+    {
+        AddrTable &addrs = shard.addrs;
+        AddrID id = addrs.get(m.hash.v, m.type, m.program);
+        if(unlikely(id==shard.nbAddrs.load(std::memory_order_relaxed))) {
+            if(1<nbShards) shard.firstSeen.push_back(m.seq);
+            shard.nbAddrs.store(id + 1, std::memory_order_relaxed);
         }
 
-        if(0<value) {
-            addr->lastIn = blockTime;
-            ++(addr->nbIn);
+        if(0<m.value) {
+            addrs.lastIns[id] = m.height;
+            ++(addrs.nbIns[id]);
         } else {
-            addr->lastOut = blockTime;
-            ++(addr->nbOut);
+            addrs.lastOuts[id] = m.height;
+            ++(addrs.nbOuts[id]);
         }
-        addr->sum += value;
+        addrs.sums[id] += m.value;
 
+        // Only live outputs are kept: added when made, dropped when spent
         if(detailed) {
-            struct Output output;
-            output.value = value;
-            output.time = blockTime;
-            output.upTXHash = upTXHash;
-            output.downTXHash = downTXHash;
-            output.inputIndex = inputIndex;
-            output.outputIndex = outputIndex;
-            addr->outputVec->push_back(output);
+            if(!m.spend) {
+                Unspent &u = shard.unspent[m.outPoint];
+                u.value = m.value;
+                u.id = id;
+                u.height = m.height;
+            } else {
+                auto i = shard.unspent.find(m.outPoint);
+                if(shard.unspent.end()!=i) shard.unspent.erase(i);
+            }
+        }
+    }
+
+    // Worker thread of a shard: apply moves as they come
+    void work(
+        Shard *shard
+    )
+    {
+        MoveQueue &q = shard->queue;
+        uint64_t t = 0;
+        while(1) {
+            uint64_t h = q.wait(t);
+            while(t<h) {
+                apply(*shard, q.ring[t % MoveQueue::kCapacity]);
+                if(0==(++t % MoveQueue::kPublish)) q.tail.store(t, std::memory_order_release);
+            }
+            q.tail.store(t, std::memory_order_release);
+        }
+    }
+
+    // Once this returns, workers are parked and shards can be read
+    void drainShards()
+    {
+        if(1<nbShards) {
+            for(auto shard:shards) shard->queue.drain();
+        }
+    }
+
+    uint64_t nbAddrs() const
+    {
+        uint64_t n = 0;
+        for(auto shard:shards) n += shard->nbAddrs.load(std::memory_order_relaxed);
+        return n;
+    }
+
+    // All shards in one set of columns, in the order addresses were first
+    // seen, i.e. with the ids a single shard would have given them, which
+    // keeps the tie order of the report the same. When asked for, remap gets
+    // each shard's ids -> merged ids.
+    void mergeShards(
+        AddrColumns                      &cols,
+        std::vector<std::vector<AddrID>> *remap
+    )
+    {
+        size_t n = nbAddrs();
+        cols.hashes.resize(n);
+        cols.sums.resize(n);
+        cols.nbIns.resize(n);
+        cols.nbOuts.resize(n);
+        cols.lastIns.resize(n);
+        cols.lastOuts.resize(n);
+        cols.types.resize(n);
+        cols.programs = WitnessPrograms();
+        if(remap) remap->resize(nbShards);
+
+        typedef std::pair<uint64_t, size_t> Next;                  // seq, shard
+        std::priority_queue<Next, std::vector<Next>, std::greater<Next>> next;
+        std::vector<size_t> cursors(nbShards, 0);
+        for(int64_t k=0; k<nbShards; ++k) {
+            if(remap) (*remap)[k].resize(shards[k]->addrs.size());
+            if(0<shards[k]->addrs.size()) next.push(Next(shards[k]->firstSeen[0], k));
         }
+
+        for(size_t j=0; j<n; ++j) {
+            size_t k = next.top().second;
+            next.pop();
+
+            const AddrColumns &src = shards[k]->addrs;
+            size_t id = cursors[k]++;
+            cols.hashes[j] = src.hashes[id];
+            cols.sums[j] = src.sums[id];
+            cols.nbIns[j] = src.nbIns[id];
+            cols.nbOuts[j] = src.nbOuts[id];
+            cols.lastIns[j] = src.lastIns[id];
+            cols.lastOuts[j] = src.lastOuts[id];
+            cols.types[j] = src.types[id];
+            if(isSegwitType(src.types[id])) cols.programs.add((uint32_t)j, *src.programs.find((uint32_t)id));
+            if(remap) (*remap)[k][id] = (AddrID)j;
+
+            if(cursors[k]<src.size()) next.push(Next(shards[k]->firstSeen[cursors[k]], k));
+        }
+    }
+
+    // Every address, as one set of columns
+    const AddrColumns &allAddrs()
+    {
+        if(1==nbShards) return shards[0]->addrs;
+        mergeShards(merged, detailed ? &remap : 0);
+        return merged;
     }
 
     virtual void endOutput(
@@ -256,19 +873,6 @@ struct AllBalances:public Callback
         );
     }
 
-    static void gmTime(
-        char *timeBuf,
-        const time_t &last
-    )
-    {
-        struct tm gmTime;
-        gmtime_r(&last, &gmTime);
-        asctime_r(&gmTime, timeBuf);
-
-        size_t sz =strlen(timeBuf);
-        if(0<sz) timeBuf[sz-1] = 0;
-    }
-
     virtual void edge(
         uint64_t      value,
         const uint8_t *upTXHash,
@@ -287,92 +891,349 @@ struct AllBalances:public Callback
             upTXHash,
             outputIndex,
             -static_cast<int64_t>(value),
-            downTXHash,
-            inputIndex
+            downTXHash
         );
     }
 
-    virtual void wrapup()
+    bool snapshotMode() const
     {
-        info("done\n");
+        return 0!=every || 0!=cutoffs.size();
+    }
 
-        info("sorting by balance ...");
+    void parseCutoffs(
+        const char *list
+    )
+    {
+        const char *all = list;
+        while(*list) {
+            char *end = 0;
+            int64_t height = strtoll(list, &end, 10);
+            if(end==list || height<0 || (*end && ','!=*end)) errFatal("bad block height list %s", all);
+            cutoffs.push_back(height);
+            list = *end ? end + 1 : end;
+        }
 
-            CompareAddr compare;
-            auto e = allAddrs.end();
-            auto s = allAddrs.begin();
-            std::sort(s, e, compare);
+        std::sort(cutoffs.begin(), cutoffs.end());
+        cutoffs.erase(std::unique(cutoffs.begin(), cutoffs.end()), cutoffs.end());
+        nextCutoff = 0;
+        snapshot = 0;
+    }
 
-        info("done\n");
+    // Order addresses for output: compact (balance, id) records, built from
+    // one scan of the sums
+    std::vector<Ranked> rank(
+        const AddrColumns &cols
+    ) const
+    {
+        size_t nbAddrs = cols.size();
+        std::vector<Ranked> ranked(nbAddrs);
+        for(size_t j=0; j<nbAddrs; ++j) {
+            ranked[j].key = rankKey(cols.sums[j]);
+            ranked[j].index = j;
+        }
 
+        // Only the top limit entries will be shown, no need to order the rest
+        if(0<=limit && (uint64_t)limit<nbAddrs) {
+            auto top = ranked.begin() + limit;
+            std::partial_sort(ranked.begin(), top, ranked.end(), CompareRanked());
+            ranked.resize(limit);
+        } else {
+            radixSortRanked(ranked);
+        }
+        return ranked;
+    }
+
+    // Group unspent outputs by address, see firsts and byAddr. Ids are
+    // those of allAddrs(), which must have been called first.
+    void groupUnspent()
+    {
+        auto id = [&](size_t k, AddrID local) { return 1==nbShards ? local : remap[k][local]; };
+
+        size_t n = nbAddrs();
+        uint64_t nbUnspent = 0;
+        firsts.resize(n + 1, 0);
+        for(int64_t k=0; k<nbShards; ++k) {
+            for(auto &u:shards[k]->unspent) ++firsts[id(k, u.second.id) + 1];
+            nbUnspent += shards[k]->unspent.size();
+        }
+        for(size_t j=0; j<n; ++j) firsts[j+1] += firsts[j];
+
+        std::vector<uint64_t> cursors(firsts.begin(), firsts.end() - 1);
+        byAddr.resize(nbUnspent);
+        for(int64_t k=0; k<nbShards; ++k) {
+            for(auto &u:shards[k]->unspent) byAddr[cursors[id(k, u.second.id)]++] = &u;
+        }
+    }
+
+    // Rows come in balance order, i.e. at random ids. They are gathered a
+    // batch at a time by a loop short enough for the CPU to overlap the cache
+    // misses of many rows, then formatted from the batch.
+    enum { kRowBatch = 256 };
+
+    struct Row
+    {
+        AddrID id;
+        int64_t sum;
+        uint160_t hash;
+        uint32_t nbIn;
+        uint32_t nbOut;
+        int32_t lastIn;
+        int32_t lastOut;
+        int8_t type;
+    };
+
+    static void gatherRows(
+              Row               *rows,
+        const AddrColumns       &cols,
+        const Ranked            *ranked,
+        size_t                  nbRows
+    )
+    {
+        for(size_t j=0; j<nbRows; ++j) {
+            Row &r = rows[j];
+            AddrID id = (AddrID)ranked[j].index;
+            r.id = id;
+            r.sum = cols.sums[id];
+            r.hash = cols.hashes[id];
+            r.nbIn = cols.nbIns[id];
+            r.nbOut = cols.nbOuts[id];
+            r.lastIn = cols.lastIns[id];
+            r.lastOut = cols.lastOuts[id];
+            r.type = cols.types[id];
+        }
+    }
+
+    // Print ranked addresses. Only reads its arguments and the options, so
+    // that snapshots can be printed by a thread of their own.
+    void print(
+        OutputStream               &out,
+        const AddrColumns          &cols,
+        const std::vector<int32_t> &times,
+        const std::vector<Ranked>  &ranked,
+        int64_t                    &shown,
+        int64_t                    &nonZeroCnt
+    )
+    {
+        size_t n = ranked.size();
+        if(0<=limit && (uint64_t)limit<n) n = limit;
+
+        if(binary) {
+            printBinary(out, cols, times, ranked.data(), n, nonZeroCnt);
+            shown = n;
+            return;
+        }
+
+        BlockTimeStrings timeStrings(times);
+
+        // When restricting, only the restricted addresses ever make it to the table
         uint64_t nbRestricts = restrictMap.size();
-        if(0==nbRestricts) info("dumping all balances ...");
-        else               info("dumping balances for %" PRIu64 " addresses ...", nbRestricts);
 
-        printf(
-            "---------------------------------------------------------------------------------------------------------------------------------------------------------------------\n"
-            "                 Balance                                  Hash160                             Base58   nbIn lastTimeIn                 nbOut lastTimeOut\n"
-            "---------------------------------------------------------------------------------------------------------------------------------------------------------------------\n"
+        out.put(
+            "------------------------------------------------------------------------------------------------------------------------------------------------------------------------------\n"
+            "                 Balance                                  Hash160     Type                            Address   nbIn lastTimeIn                 nbOut lastTimeOut\n"
+            "------------------------------------------------------------------------------------------------------------------------------------------------------------------------------\n"
         );
 
-        int64_t i = 0;
-        int64_t nonZeroCnt = 0;
-        while(likely(s<e)) {
+        Row rows[kRowBatch];
+        const char *inTimes[kRowBatch];
+        const char *outTimes[kRowBatch];
 
-            if(0<=limit && limit<=i)
-                break;
+        nonZeroCnt = 0;
+        for(size_t first=0; first<n; first+=kRowBatch) {
 
-            Addr *addr = *(s++);
-            if(0!=nbRestricts) {
-                auto r = restrictMap.find(addr->hash.v);
-                if(restrictMap.end()==r) continue;
+            size_t nbRows = std::min<size_t>(kRowBatch, n - first);
+            gatherRows(rows, cols, ranked.data() + first, nbRows);
+            for(size_t j=0; j<nbRows; ++j) {
+                inTimes[j] = timeStrings.get(rows[j].lastIn);
+                outTimes[j] = timeStrings.get(rows[j].lastOut);
             }
 
-            printf("%24.8f ", (1e-8)*addr->sum);
-            showHex(addr->hash.v, kRIPEMD160ByteSize, false);
-            if(0<addr->sum) ++nonZeroCnt;
+            for(size_t j=0; j<nbRows; ++j) {
 
-            if(i<showAddr || 0!=nbRestricts) {
-                uint8_t buf[64];
-                hash160ToAddr(buf, addr->hash.v);
-                printf(" %s", buf);
-            } else {
-                printf(" XXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXX");
-            }
+                const Row &r = rows[j];
+                out.putAmount(r.sum, 24);
+                out.put(' ');
+                out.putHex(r.hash.v, kRIPEMD160ByteSize, false);
+                if(0<r.sum) ++nonZeroCnt;
 
-            char timeBuf[256];
-            gmTime(timeBuf, addr->lastIn);
-            printf(" %6" PRIu64 " %s ", addr->nbIn, timeBuf);
+                const char *tag = outputScriptTypeTag(r.type);
+                out.put(' ');
+                out.put("        ", 8 - strlen(tag));
+                out.put(tag);
 
-            gmTime(timeBuf, addr->lastOut);
-            printf(" %6" PRIu64 " %s\n", addr->nbOut, timeBuf);
+                if((int64_t)(first + j)<showAddr || 0!=nbRestricts) {
+                    uint8_t buf[kAddrSize];
+                    keyToAddr(buf, r.type, r.hash.v, cols.programs.find(r.id));
+                    out.put(' ');
+                    out.put((const char*)buf);
+                } else {
+                    out.put(" XXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXX");
+                }
 
-            if(detailed) {
-                auto end = addr->outputVec->end();
-                auto start = addr->outputVec->begin();
-                while(start!=end) {
-                    printf("    %24.8f ", 1e-8*start->value);
-                    gmTime(timeBuf, start->time);
-                    showHex(start->upTXHash);
-                    printf("%4" PRIu64 " %s", start->outputIndex, timeBuf);
-                    if(start->downTXHash) {
-                        printf(" -> %4" PRIu64 " ", start->inputIndex);
-                        showHex(start->upTXHash);
+                out.put(' ');
+                out.putU64(r.nbIn, 6);
+                out.put(' ');
+                out.put(inTimes[j], BlockTimeStrings::kSize);
+                out.put(' ');
+
+                out.put(' ');
+                out.putU64(r.nbOut, 6);
+                out.put(' ');
+                out.put(outTimes[j], BlockTimeStrings::kSize);
+                out.put('\n');
+
+                if(detailed) {
+                    auto end = byAddr.begin() + firsts[r.id + 1];
+                    auto start = byAddr.begin() + firsts[r.id];
+                    std::sort(start, end, CompareUnspent());
+                    while(start!=end) {
+                        const UnspentEntry *u = *(start++);
+                        out.put("    ");
+                        out.putAmount(u->second.value, 24);
+                        out.put(' ');
+                        out.putHex(u->first.v);
+                        out.putU64(u->first.index(), 4);
+                        out.put(' ');
+                        out.put(timeStrings.get(u->second.height), BlockTimeStrings::kSize);
+                        out.put('\n');
                     }
-                    printf("\n");
-                    ++s;
+                    out.put('\n');
                 }
-                printf("\n");
             }
+        }
+        shown = n;
+    }
+
+    void printBinary(
+        OutputStream               &out,
+        const AddrColumns          &cols,
+        const std::vector<int32_t> &times,
+        const Ranked               *ranked,
+        size_t                     n,
+        int64_t                    &nonZeroCnt
+    )
+    {
+        Row rows[kRowBatch];
+        BalanceRecord records[kRowBatch];
+
+        nonZeroCnt = 0;
+        for(size_t first=0; first<n; first+=kRowBatch) {
+
+            size_t nbRows = std::min<size_t>(kRowBatch, n - first);
+            gatherRows(rows, cols, ranked + first, nbRows);
 
-            ++i;
+            for(size_t j=0; j<nbRows; ++j) {
+                const Row &r = rows[j];
+                BalanceRecord &b = records[j];
+                b.sum = r.sum;
+                memcpy(b.hash160, r.hash.v, kRIPEMD160ByteSize);
+                b.nbIn = r.nbIn;
+                b.nbOut = r.nbOut;
+                b.lastIn = times[r.lastIn];
+                b.lastOut = times[r.lastOut];
+                b.type = r.type;
+                memset(b.reserved, 0, sizeof(b.reserved));
+                if(0<r.sum) ++nonZeroCnt;
+            }
+            out.put(records, nbRows*sizeof(BalanceRecord));
         }
+    }
+
+    // Logs from here rather than from the writer, so lines don't interleave
+    void waitForSnapshot()
+    {
+        if(!snapshotWriter.joinable()) return;
+        snapshotWriter.join();
+
+        info(
+            "wrote %s: %" PRIu64 " addresses, %" PRIu64 " with non zero balance",
+            snapshot->fileName.c_str(),
+            (uint64_t)snapshot->cols.size(),
+            snapshot->nonZeroCnt
+        );
+        delete snapshot;
+        snapshot = 0;
+    }
+
+    // Balances as of right before block height. The columns are copied here,
+    // sorting and printing happen on a background thread while parsing goes
+    // on. Only one snapshot is ever in flight, which bounds the extra memory
+    // to one copy of the columns.
+    void takeSnapshot(
+        int64_t height
+    )
+    {
+        waitForSnapshot();
+
+        drainShards();
+
+        snapshot = new Snapshot;
+        if(1==nbShards) snapshot->cols = shards[0]->addrs;
+        else            mergeShards(snapshot->cols, 0);
+        snapshot->blockTimes = blockTimes;
+        snapshot->fileName = outputDir + "/balances-" + std::to_string(height) + (binary ? ".bin" : ".txt");
+
+        Snapshot *s = snapshot;
+        snapshotWriter = std::thread(
+            [this, s]() {
+                OutputStream out;
+                out.open(s->fileName.c_str());
+
+                int64_t shown;
+                print(out, s->cols, s->blockTimes, rank(s->cols), shown, s->nonZeroCnt);
+                out.close();
+            }
+        );
+    }
+
+    // Snapshot at the end of the chain, then wait for the writer. Cutoffs
+    // still pending are all at or past the end of the chain.
+    void finishSnapshots()
+    {
+        int64_t tip = curBlock ? 1 + curBlock->height : 0;
+        bool atTip = (0!=every);
+        for(size_t j=nextCutoff; j<cutoffs.size(); ++j) {
+            if(tip==cutoffs[j]) atTip = true;
+            else warning("chain ends before block %" PRIu64 ", no balances written for it", cutoffs[j]);
+        }
+
+        if(atTip) takeSnapshot(tip);
+        waitForSnapshot();
+        info("done\n");
+        exit(0);
+    }
+
+    virtual void wrapup()
+    {
+        drainShards();
+        info("done\n");
+
+        if(snapshotMode()) {
+            finishSnapshots();
+        }
+
+        info("sorting by balance ...");
+            const AddrColumns &addrs = allAddrs();
+            std::vector<Ranked> ranked = rank(addrs);
+            if(detailed) groupUnspent();
+        info("done\n");
+
+        uint64_t nbRestricts = restrictMap.size();
+        if(0==nbRestricts) info("dumping all balances ...");
+        else               info("dumping balances for %" PRIu64 " addresses ...", nbRestricts);
+
+        OutputStream out;
+        out.attach(1, "stdout");
+
+        int64_t shown, nonZeroCnt;
+        print(out, addrs, blockTimes, ranked, shown, nonZeroCnt);
+        out.close();
 
         info("done\n");
         info("found %" PRIu64 " addresses with non zero balance", nonZeroCnt);
-        info("found %" PRIu64 " addresses in total", allAddrs.size());
-        info("shown:%" PRIu64 " addresses", i);
-        printf("\n");
+        info("found %" PRIu64 " addresses in total", (uint64_t)addrs.size());
+        info("shown:%" PRIu64 " addresses", shown);
+        if(!binary) printf("\n");
         exit(0);
     }
 
@@ -420,7 +1281,7 @@ struct AllBalances:public Callback
                 "eta = %5.2fs , "
                 ,
                 curBlock->height,
-                addrMap.size()*1e-6,
+                nbAddrs()*1e-6,
                 100.0*progress,
                 elasedSinceStart,
                 (1.0/speed) - elasedSinceStart
@@ -433,11 +1294,37 @@ struct AllBalances:public Callback
         SKIP(uint256_t, prevBlkHash, p);
         SKIP(uint256_t, blkMerkleRoot, p);
         LOAD(int32_t, bTime, p);
-        blockTime = bTime;
+        blockHeight = (int32_t)curBlock->height;
+        if(blockTimes.size()<=(size_t)blockHeight) blockTimes.resize(1 + blockHeight, 0);
+        blockTimes[blockHeight] = bTime;
 
         if(0<=cutoffBlock && cutoffBlock<=curBlock->height) {
             wrapup();
         }
+
+        if(unlikely(snapshotMode())) {
+            // Cutoffs below the first block: nothing parsed yet
+            int64_t height = curBlock->height;
+            while(nextCutoff<cutoffs.size() && cutoffs[nextCutoff]<height) {
+                takeSnapshot(cutoffs[nextCutoff++]);
+            }
+
+            bool atCutoff = (0<every && 0==(height % every));
+            if(nextCutoff<cutoffs.size() && cutoffs[nextCutoff]==height) {
+                atCutoff = true;
+                ++nextCutoff;
+            }
+            if(atCutoff) {
+                takeSnapshot(height);
+            }
+
+            // Nothing left to write, no point parsing the rest of the chain
+            if(0==every && nextCutoff==cutoffs.size()) {
+                waitForSnapshot();
+                info("done\n");
+                exit(0);
+            }
+        }
     }
 
 };
@@ -0,0 +1,614 @@
+// Write a per-block balance delta log of all addresses, and query it
+
+#include <time.h>
+#include <util.h>
+#include <common.h>
+#include <errlog.h>
+#include <option.h>
+#include <output.h>
+#include <rmd160.h>
+#include <callback.h>
+
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <algorithm>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+typedef uint32_t AddrID;
+static uint8_t emptyKey[kRIPEMD160ByteSize] = { 0x52 };
+typedef Hash160Map<AddrID>::Map AddrMap;
+
+// Log file layout, little endian, every section 8 byte aligned:
+//
+//      LogHeader
+//      int32_t  blockTimes[nbBlocks]       by height, [0] unused
+//      LogAddr  addrs[nbAddrs]             sorted by hash160
+//      uint8_t  sparse[nbSparse][20]       hash160 of addrs[0], addrs[kStride], ...
+//      int8_t   types[nbAddrs]             script type each address shows as, same order as addrs
+//      LogProgram programs[nbPrograms]     witness programs of the segwit addresses, by index in addrs
+//      int32_t  heights[nbRecords]         per address, oldest first
+//      int64_t  deltas[nbRecords]          same order
+//
+// An address has one record per block that paid it or spent from it, with
+// the net change of its balance in that block.
+static const char kLogMagic[8] = { 'B', 'P', 'D', 'E', 'L', 'T', 'A', '2' };
+
+struct LogHeader
+{
+    char     magic[8];
+    uint64_t nbBlocks;
+    uint64_t nbAddrs;
+    uint64_t nbSparse;
+    uint64_t nbRecords;
+    uint32_t stride;
+    uint32_t reserved;
+    uint64_t nbPrograms;
+};
+
+struct LogAddr
+{
+    uint8_t  hash160[kRIPEMD160ByteSize];
+    uint32_t nbRecords;
+    uint64_t firstRecord;
+};
+static_assert(32==sizeof(LogAddr), "log address entries are 32 bytes");
+
+struct LogProgram
+{
+    uint32_t       addr;
+    WitnessProgram program;
+};
+static_assert(40==sizeof(LogProgram), "log witness programs are 40 bytes");
+
+// What gets spilled to disk while parsing, in block order
+struct SpillRecord
+{
+    AddrID  id;
+    int32_t height;
+    int64_t delta;
+};
+
+static inline uint64_t align8(
+    uint64_t n
+)
+{
+    return (n + 7) & ~(uint64_t)7;
+}
+
+// Where each section of a log starts
+struct LogLayout
+{
+    uint64_t blockTimes;
+    uint64_t addrs;
+    uint64_t sparse;
+    uint64_t types;
+    uint64_t programs;
+    uint64_t heights;
+    uint64_t deltas;
+    uint64_t size;
+
+    LogLayout(
+        const LogHeader &h
+    )
+    {
+        blockTimes = sizeof(LogHeader);
+        addrs = blockTimes + align8(h.nbBlocks*sizeof(int32_t));
+        sparse = addrs + h.nbAddrs*sizeof(LogAddr);
+        types = sparse + align8(h.nbSparse*kRIPEMD160ByteSize);
+        programs = types + align8(h.nbAddrs*sizeof(int8_t));
+        heights = programs + h.nbPrograms*sizeof(LogProgram);
+        deltas = heights + align8(h.nbRecords*sizeof(int32_t));
+        size = deltas + h.nbRecords*sizeof(int64_t);
+    }
+};
+
+// A log file, mapped read-only
+struct DeltaLog
+{
+    const uint8_t   *base;
+    const LogHeader *header;
+    const int32_t   *blockTimes;
+    const LogAddr   *addrs;
+    const uint8_t   *sparse;
+    const int8_t    *types;
+    const LogProgram *programs;
+    const int32_t   *heights;
+    const int64_t   *deltas;
+
+    void open(
+        const char *fileName
+    )
+    {
+        int fd = ::open(fileName, O_RDONLY);
+        if(fd<0) sysErrFatal("failed to open balance log %s", fileName);
+
+        struct stat statBuf;
+        int r = fstat(fd, &statBuf);
+        if(r<0) sysErrFatal("failed to fstat balance log %s", fileName);
+
+        uint64_t size = statBuf.st_size;
+        if(size<sizeof(LogHeader)) errFatal("%s is not a balance log", fileName);
+
+        void *p = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(MAP_FAILED==p) sysErrFatal("failed to mmap balance log %s", fileName);
+        close(fd);
+
+        base = (const uint8_t*)p;
+        header = (const LogHeader*)base;
+        if(0!=memcmp(header->magic, kLogMagic, sizeof(kLogMagic))) errFatal("%s is not a balance log", fileName);
+
+        LogLayout layout(*header);
+        if(size!=layout.size) errFatal("balance log %s is truncated", fileName);
+
+        blockTimes = (const int32_t*)(base + layout.blockTimes);
+        addrs = (const LogAddr*)(base + layout.addrs);
+        sparse = base + layout.sparse;
+        types = (const int8_t*)(base + layout.types);
+        programs = (const LogProgram*)(base + layout.programs);
+        heights = (const int32_t*)(base + layout.heights);
+        deltas = (const int64_t*)(base + layout.deltas);
+    }
+
+    // Witness program of addrs[index], 0 for addresses of other types
+    const WitnessProgram *program(
+        uint64_t index
+    ) const
+    {
+        const LogProgram *end = programs + header->nbPrograms;
+        const LogProgram *i = std::lower_bound(
+            programs,
+            end,
+            index,
+            [](const LogProgram &p, uint64_t n) { return p.addr<n; }
+        );
+        if(end==i || index!=i->addr) return 0;
+        return &i->program;
+    }
+
+    // Binary search of the sparse index, then a short scan of the addresses it points to
+    const LogAddr *find(
+        const uint8_t *hash160
+    ) const
+    {
+        uint64_t lo = 0;
+        uint64_t hi = header->nbSparse;
+        while(lo<hi) {
+            uint64_t mid = (lo + hi)/2;
+            if(memcmp(sparse + mid*kRIPEMD160ByteSize, hash160, kRIPEMD160ByteSize)<=0) lo = mid + 1;
+            else                                                                         hi = mid;
+        }
+        if(0==lo) return 0;
+
+        uint64_t start = (lo - 1)*header->stride;
+        uint64_t end = std::min(start + header->stride, header->nbAddrs);
+        for(uint64_t i=start; i<end; ++i) {
+            int c = memcmp(addrs[i].hash160, hash160, kRIPEMD160ByteSize);
+            if(0==c) return addrs + i;
+            if(0<c) break;
+        }
+        return 0;
+    }
+};
+
+struct BalanceLog:public Callback
+{
+    enum { kStride = 64 };
+
+    int64_t cutoffBlock;
+    std::string fileName;
+    std::string spillName;
+    optparse::OptionParser parser;
+
+    AddrMap ids;
+    std::vector<uint160_t> hashes;
+    std::vector<int8_t> types;          // by id: script type the address shows as
+    WitnessPrograms programs;           // by id, segwit addresses only
+    std::vector<uint32_t> nbRecords;    // by id
+    std::vector<int32_t> lastHeights;   // by id: last block the address showed up in
+    std::vector<int64_t> pending;       // by id: net change in the current block
+    std::vector<AddrID> touched;        // ids seen in the current block
+    std::vector<int32_t> blockTimes;    // by height
+    int32_t blockHeight;
+    uint64_t nbSpilled;
+    OutputStream spill;
+
+    BalanceLog()
+    {
+        parser
+            .usage("[options] [list of addresses to query]")
+            .version("")
+            .description(
+                "write the net balance change of every address in every block to a log file, "
+                "or, with --query, look addresses up in such a log"
+            )
+            .epilog("")
+        ;
+        parser
+            .add_option("-o", "--output")
+            .action("store")
+            .set_default("balances.log")
+            .help("log file to write (default: %default)")
+        ;
+        parser
+            .add_option("-q", "--query")
+            .action("store")
+            .set_default("")
+            .help("don't parse the chain, look the addresses up in this log file instead")
+        ;
+        parser
+            .add_option("-a", "--atBlock")
+            .action("store")
+            .type("int")
+            .set_default(-1)
+            .help("with --query, only show the balance from blocks strictly older than <block> (default: show the whole history)")
+        ;
+    }
+
+    virtual const char                   *name() const         { return "balanceLog"; }
+    virtual const optparse::OptionParser *optionParser() const { return &parser;      }
+    virtual bool                         needTXHash() const    { return true;         }
+
+    virtual void aliases(
+        std::vector<const char*> &v
+    ) const
+    {
+        v.push_back("deltaLog");
+        v.push_back("history");
+    }
+
+    virtual int init(
+        int argc,
+        const char *argv[]
+    )
+    {
+        optparse::Values &values = parser.parse_args(argc, argv);
+        cutoffBlock = values.get("atBlock");
+        fileName = (const char *)values.get("output");
+
+        std::string queryName = (const char *)values.get("query");
+        if(0!=queryName.size()) {
+            std::vector<uint160_t> queries;
+            auto args = parser.args();
+            for(size_t i=1; i<args.size(); ++i) {
+                loadKeyList(queries, args[i].c_str());
+            }
+            if(0==queries.size()) errFatal("no addresses to query");
+            query(queryName.c_str(), queries);
+            exit(0);
+        }
+        if(0<=cutoffBlock) errFatal("--atBlock only applies to --query");
+
+        ids.setEmptyKey(emptyKey);
+        ids.resize(15 * 1000 * 1000);
+        blockTimes.push_back(0);
+        blockHeight = 0;
+        nbSpilled = 0;
+
+        spillName = fileName + ".tmp";
+        spill.open(spillName.c_str());
+
+        info("analyzing blockchain ...");
+        return 0;
+    }
+
+    void query(
+        const char                   *logName,
+        const std::vector<uint160_t> &queries
+    )
+    {
+        DeltaLog log;
+        log.open(logName);
+
+        OutputStream out;
+        out.attach(1, "stdout");
+
+        double start = usecs();
+        for(const auto &q:queries) {
+
+            const LogAddr *a = log.find(q.v);
+            if(0==a) {
+                // Without a type, there's no telling which address the key would show as
+                out.putHex(q.v, kRIPEMD160ByteSize, false);
+                out.put(" never shows up in the log\n");
+                continue;
+            }
+
+            uint64_t index = a - log.addrs;
+            int type = log.types[index];
+            uint8_t b58[kAddrSize];
+            keyToAddr(b58, type, q.v, log.program(index));
+
+            const int32_t *heights = log.heights + a->firstRecord;
+            const int64_t *deltas = log.deltas + a->firstRecord;
+            uint32_t n = a->nbRecords;
+
+            if(0<=cutoffBlock) {
+                // Records strictly older than the cutoff, as allBalances --atBlock counts them
+                uint32_t end = std::lower_bound(heights, heights + n, cutoffBlock) - heights;
+                int64_t balance = 0;
+                for(uint32_t i=0; i<end; ++i) balance += deltas[i];
+
+                out.put((const char*)b58);
+                out.put(' ');
+                out.put(outputScriptTypeTag(type));
+                out.put(' ');
+                out.putAmount(balance, 24);
+                out.put(" before block ");
+                out.putI64(cutoffBlock);
+                out.put('\n');
+                continue;
+            }
+
+            out.put("    ");
+            out.put((const char*)b58);
+            out.put(' ');
+            out.put(outputScriptTypeTag(type));
+            out.put("\n");
+            out.put("    Height  Time (GMT)                                  Delta                  Balance\n");
+
+            int64_t balance = 0;
+            for(uint32_t i=0; i<n; ++i) {
+
+                struct tm gmTime;
+                time_t blockTime = log.blockTimes[heights[i]];
+                gmtime_r(&blockTime, &gmTime);
+
+                char timeBuf[256];
+                asctime_r(&gmTime, timeBuf);
+
+                size_t sz = strlen(timeBuf);
+                if(0<sz) timeBuf[sz-1] = 0;
+
+                balance += deltas[i];
+                out.putI64(heights[i], 10);
+                out.put("  ");
+                out.put(timeBuf);
+                out.put(" ");
+                out.putAmount(deltas[i], 24);
+                out.put(" ");
+                out.putAmount(balance, 24);
+                out.put('\n');
+            }
+            out.put('\n');
+        }
+        double elapsed = usecs() - start;
+        out.close();
+
+        info(
+            "looked up %" PRIu64 " address(es) among %" PRIu64 " in %.1f usecs",
+            (uint64_t)queries.size(),
+            log.header->nbAddrs,
+            elapsed
+        );
+    }
+
+    void move(
+        const uint8_t *script,
+        uint64_t      scriptSize,
+        int64_t       value
+    )
+    {
+        uint8_t addrType[3];
+        uint160_t pubKeyHash;
+        int type = solveOutputScript(pubKeyHash.v, script, scriptSize, addrType);
+        if(unlikely(type<0)) return;
+
+        AddrID id;
+        auto i = ids.find(pubKeyHash.v);
+        if(likely(ids.end()!=i)) {
+            id = i->second;
+        } else {
+            size_t n = hashes.size();
+            if(unlikely(UINT32_MAX==n)) errFatal("too many addresses, ids are 32 bits");
+            id = (AddrID)n;
+            ids[pubKeyHash.v] = id;
+            hashes.push_back(pubKeyHash);
+            types.push_back(addressType(type));
+            if(isSegwitType(type)) {
+                WitnessProgram program;
+                witnessProgram(program, type, script, scriptSize);
+                programs.add(id, program);
+            }
+            nbRecords.push_back(0);
+            lastHeights.push_back(0);
+            pending.push_back(0);
+        }
+
+        if(lastHeights[id]!=blockHeight) {
+            lastHeights[id] = blockHeight;
+            pending[id] = 0;
+            touched.push_back(id);
+        }
+        pending[id] += value;
+    }
+
+    // One record per address the block touched
+    void flushBlock()
+    {
+        for(auto id:touched) {
+            SpillRecord r;
+            r.id = id;
+            r.height = blockHeight;
+            r.delta = pending[id];
+            spill.put(&r, sizeof(r));
+            ++nbRecords[id];
+        }
+        nbSpilled += touched.size();
+        touched.clear();
+    }
+
+    virtual void endOutput(
+        const uint8_t *p,
+        int64_t       value,
+        const uint8_t *txHash,
+        uint64_t      outputIndex,
+        const uint8_t *outputScript,
+        uint64_t      outputScriptSize
+    )
+    {
+        move(outputScript, outputScriptSize, value);
+    }
+
+    virtual void edge(
+        uint64_t      value,
+        const uint8_t *upTXHash,
+        uint64_t      outputIndex,
+        const uint8_t *outputScript,
+        uint64_t      outputScriptSize,
+        const uint8_t *downTXHash,
+        uint64_t      inputIndex,
+        const uint8_t *inputScript,
+        uint64_t      inputScriptSize
+    )
+    {
+        move(outputScript, outputScriptSize, -static_cast<int64_t>(value));
+    }
+
+    virtual void startBlock(
+        const Block *b,
+        uint64_t
+    )
+    {
+        const uint8_t *p = b->data;
+        SKIP(uint32_t, version, p);
+        SKIP(uint256_t, prevBlkHash, p);
+        SKIP(uint256_t, blkMerkleRoot, p);
+        LOAD(int32_t, bTime, p);
+
+        blockHeight = (int32_t)b->height;
+        if(blockTimes.size()<=(size_t)blockHeight) blockTimes.resize(1 + blockHeight, 0);
+        blockTimes[blockHeight] = bTime;
+    }
+
+    virtual void endBlock(
+        const Block *
+    )
+    {
+        flushBlock();
+    }
+
+    virtual void wrapup()
+    {
+        flushBlock();
+        spill.close();
+        info("done\n");
+
+        info("sorting %" PRIu64 " addresses ...", (uint64_t)hashes.size());
+
+            // Addresses in hash160 order, each one's records starting where the previous one's end
+            uint64_t nbAddrs = hashes.size();
+            std::vector<AddrID> order(nbAddrs);
+            for(uint64_t j=0; j<nbAddrs; ++j) order[j] = (AddrID)j;
+            std::sort(
+                order.begin(),
+                order.end(),
+                [&](AddrID a, AddrID b) { return memcmp(hashes[a].v, hashes[b].v, kRIPEMD160ByteSize)<0; }
+            );
+
+            std::vector<uint64_t> cursors(nbAddrs);
+            uint64_t total = 0;
+            for(auto id:order) {
+                cursors[id] = total;
+                total += nbRecords[id];
+            }
+
+        info("done\n");
+
+        LogHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, kLogMagic, sizeof(kLogMagic));
+        header.nbBlocks = blockTimes.size();
+        header.nbAddrs = nbAddrs;
+        header.nbSparse = (nbAddrs + kStride - 1)/kStride;
+        header.nbRecords = nbSpilled;
+        header.stride = kStride;
+        header.nbPrograms = programs.rows.size();
+        LogLayout layout(header);
+
+        info("writing %" PRIu64 " records to %s ...", nbSpilled, fileName.c_str());
+
+            int fd = open(fileName.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+            if(fd<0) sysErrFatal("failed to create balance log %s", fileName.c_str());
+
+            int r = ftruncate(fd, layout.size);
+            if(r<0) sysErrFatal("failed to size balance log %s", fileName.c_str());
+
+            void *p = mmap(0, layout.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if(MAP_FAILED==p) sysErrFatal("failed to mmap balance log %s", fileName.c_str());
+            uint8_t *base = (uint8_t*)p;
+
+            memcpy(base, &header, sizeof(header));
+            memcpy(base + layout.blockTimes, blockTimes.data(), blockTimes.size()*sizeof(int32_t));
+
+            LogAddr *addrs = (LogAddr*)(base + layout.addrs);
+            uint8_t *sparse = base + layout.sparse;
+            int8_t *addrTypes = (int8_t*)(base + layout.types);
+            LogProgram *addrPrograms = (LogProgram*)(base + layout.programs);
+            for(uint64_t j=0; j<nbAddrs; ++j) {
+                AddrID id = order[j];
+                memcpy(addrs[j].hash160, hashes[id].v, kRIPEMD160ByteSize);
+                addrTypes[j] = types[id];
+                if(isSegwitType(types[id])) {
+                    addrPrograms->addr = (uint32_t)j;
+                    addrPrograms->program = *programs.find(id);
+                    ++addrPrograms;
+                }
+                addrs[j].nbRecords = nbRecords[id];
+                addrs[j].firstRecord = cursors[id];
+                if(0==(j % kStride)) memcpy(sparse + (j/kStride)*kRIPEMD160ByteSize, hashes[id].v, kRIPEMD160ByteSize);
+            }
+
+            // Spilled records are in block order, so each address's come out oldest first
+            scatter(
+                (int32_t*)(base + layout.heights),
+                (int64_t*)(base + layout.deltas),
+                cursors
+            );
+
+            r = munmap(p, layout.size);
+            if(r<0) sysErr("failed to unmap balance log %s", fileName.c_str());
+            close(fd);
+            unlink(spillName.c_str());
+
+        info("done\n");
+        info("found %" PRIu64 " addresses in %" PRIu64 " blocks", nbAddrs, (uint64_t)blockTimes.size() - 1);
+        exit(0);
+    }
+
+    void scatter(
+        int32_t               *heights,
+        int64_t               *deltas,
+        std::vector<uint64_t> &cursors
+    )
+    {
+        if(0==nbSpilled) return;
+
+        int fd = open(spillName.c_str(), O_RDONLY);
+        if(fd<0) sysErrFatal("failed to open %s", spillName.c_str());
+
+        size_t size = nbSpilled*sizeof(SpillRecord);
+        void *p = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(MAP_FAILED==p) sysErrFatal("failed to mmap %s", spillName.c_str());
+        close(fd);
+
+        #if defined(MADV_SEQUENTIAL)
+            madvise(p, size, MADV_SEQUENTIAL);
+        #endif
+
+        const SpillRecord *records = (const SpillRecord*)p;
+        for(uint64_t i=0; i<nbSpilled; ++i) {
+            const SpillRecord &s = records[i];
+            uint64_t k = cursors[s.id]++;
+            heights[k] = s.height;
+            deltas[k] = s.delta;
+        }
+        munmap(p, size);
+    }
+};
+
+static BalanceLog balanceLog;
+
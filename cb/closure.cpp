@@ -9,24 +9,79 @@
 #include <callback.h>
 
 #include <vector>
+#include <utility>
 #include <string.h>
-#include <boost/graph/adjacency_list.hpp>
-#include <boost/graph/connected_components.hpp>
 
-typedef uint160_t Addr;
+typedef uint32_t AddrID;
 static uint8_t gEmptyKey[kRIPEMD160ByteSize] = { 0x52 };
-typedef GoogMap<Hash160, uint64_t, Hash160Hasher, Hash160Equal >::Map AddrMap;
-typedef boost::adjacency_list<boost::vecS, boost::vecS, boost::undirectedS> Graph;
+typedef Hash160Map<AddrID>::Map AddrMap;
+
+// Disjoint sets of address ids, merged as co-spending TXs show up: union by
+// rank, path halving on find. 5 bytes per address, no edges kept, and the
+// clusters are final as soon as the last TX has been parsed.
+struct UnionFind
+{
+    std::vector<AddrID> parents;
+    std::vector<uint8_t> ranks;         // log2 of set size at most, fits a byte
+
+    void reserve(
+        size_t n
+    )
+    {
+        parents.reserve(n);
+        ranks.reserve(n);
+    }
+
+    size_t size() const { return parents.size(); }
+
+    // New singleton set, with id size()
+    void add()
+    {
+        parents.push_back((AddrID)parents.size());
+        ranks.push_back(0);
+    }
+
+    AddrID find(
+        AddrID a
+    )
+    {
+        while(parents[a]!=a) {
+            AddrID grandParent = parents[parents[a]];
+            parents[a] = grandParent;
+            a = grandParent;
+        }
+        return a;
+    }
+
+    // Merge the sets of a and b, returns false when they already were one
+    bool unite(
+        AddrID a,
+        AddrID b
+    )
+    {
+        a = find(a);
+        b = find(b);
+        if(a==b) return false;
+
+        if(ranks[a]<ranks[b]) std::swap(a, b);
+        parents[b] = a;
+        if(ranks[a]==ranks[b]) ++ranks[a];
+        return true;
+    }
+};
 
 struct Closure:public Callback
 {
     optparse::OptionParser parser;
 
-    Graph graph;
+    UnionFind sets;
     AddrMap addrMap;
+    uint64_t nbMerges;
     double startTime;
-    std::vector<Addr*> allAddrs;
-    std::vector<uint64_t> vertices;
+    std::vector<uint160_t> hashes;      // by id
+    std::vector<int8_t> addrTypes;      // by id, what each address shows as
+    WitnessPrograms programs;           // by id, for segwit addresses
+    std::vector<AddrID> vertices;
     std::vector<uint160_t> rootHashes;
 
     Closure()
@@ -71,7 +126,10 @@ struct Closure:public Callback
 
         addrMap.setEmptyKey(gEmptyKey);
         addrMap.resize(15 * 1000 * 1000);
-        allAddrs.reserve(15 * 1000 * 1000);
+        hashes.reserve(15 * 1000 * 1000);
+        addrTypes.reserve(15 * 1000 * 1000);
+        sets.reserve(15 * 1000 * 1000);
+        nbMerges = 0;
         info("Building address equivalence graph ...");
         startTime = usecs();
 
@@ -95,15 +153,23 @@ struct Closure:public Callback
         int type = solveOutputScript(pubKeyHash.v, outputScript, outputScriptSize, addrType);
         if(unlikely(type<0)) return;
 
-        uint64_t a;
+        AddrID a;
         auto i = addrMap.find(pubKeyHash.v);
         if(unlikely(addrMap.end()!=i))
             a = i->second;
         else {
-            Addr *addr = (Addr*)allocHash160();
-            memcpy(addr->v, pubKeyHash.v, kRIPEMD160ByteSize);
-            addrMap[addr->v] = a = allAddrs.size();
-            allAddrs.push_back(addr);
+            size_t n = hashes.size();
+            if(unlikely(UINT32_MAX==n)) errFatal("too many addresses, ids are 32 bits");
+
+            a = (AddrID)n;
+            addrMap[pubKeyHash.v] = a;
+            hashes.push_back(pubKeyHash);
+            addrTypes.push_back(addressType(type));
+            sets.add();
+
+            WitnessProgram program;
+            witnessProgram(program, type, outputScript, outputScriptSize);
+            programs.add(a, program);
         }
 
         vertices.push_back(a);
@@ -111,22 +177,13 @@ struct Closure:public Callback
 
     virtual void wrapup()
     {
-        size_t size = boost::num_vertices(graph);
-        info(
-            "done, %.2f secs, found %" PRIu64 " address(es) \n",
-            1e-6*(usecs() - startTime),
-            size
-        );
-
-        info("Clustering ... ");
-        startTime = usecs();
-
-        std::vector<uint64_t> cc(size);
-        uint64_t nbCC = boost::connected_components(graph, &cc[0]);
+        // Every address starts out as a cluster of its own, every merge removes one
+        size_t size = sets.size();
         info(
-            "done, %.2f secs, found %" PRIu64 " clusters.\n",
+            "done, %.2f secs, found %" PRIu64 " address(es) in %" PRIu64 " clusters.\n",
             1e-6*(usecs() - startTime),
-            nbCC
+            (uint64_t)size,
+            (uint64_t)(size - nbMerges)
         );
 
         auto e = rootHashes.end();
@@ -136,25 +193,28 @@ struct Closure:public Callback
             uint64_t count = 0;
             const uint8_t *keyHash = (i++)->v;
 
-            uint8_t b58[128];
-            hash160ToAddr(b58, keyHash);
-            info("Address cluster for address %s:", b58);
-
             auto j = addrMap.find(keyHash);
             if(unlikely(addrMap.end()==j)) {
+
+                // Never seen, so no type to tell which address the key would show as
+                uint8_t hex[2*kRIPEMD160ByteSize + 1];
+                toHex(hex, keyHash, kRIPEMD160ByteSize, false);
+                info("Address cluster for key %s:", hex);
                 warning("specified key was never used to spend coins");
-                showFullAddr(keyHash);
-                printf("\n");
+                printf("%s\n", hex);
                 count = 1;
             } else {
-                uint64_t addrIndex = j->second;
-                uint64_t homeComponentIndex = cc[addrIndex];
-                for(size_t k=0; likely(k<cc.size()); ++k) {
-                    uint64_t componentIndex = cc[k];
-                    if(unlikely(homeComponentIndex==componentIndex)) {
-                        Addr *addr = allAddrs[k];
-                        showFullAddr(addr->v);
-                        printf("\n");
+                uint8_t b58[kAddrSize];
+                AddrID root = j->second;
+                keyToAddr(b58, addrTypes[root], keyHash, programs.find(root));
+                info("Address cluster for address %s:", b58);
+
+                AddrID home = sets.find(root);
+                for(size_t k=0; likely(k<size); ++k) {
+                    if(unlikely(home==sets.find((AddrID)k))) {
+                        int type = addrTypes[k];
+                        showFullAddr(hashes[k].v, false, type, programs.find((AddrID)k));
+                        printf(" %s\n", outputScriptTypeTag(type));
                         ++count;
                     }
                 }
@@ -178,9 +238,7 @@ struct Closure:public Callback
         size_t size = vertices.size();
         if(likely(1<size)) {
             for(size_t i=1; unlikely(i<size); ++i) {
-                uint64_t a = vertices[i-1];
-                uint64_t b = vertices[i-0];
-                boost::add_edge(a, b, graph);
+                nbMerges += sets.unite(vertices[i-1], vertices[i-0]);
             }
         }
     }
@@ -0,0 +1,551 @@
+
+// Columnar binary dump of the blockchain
+
+#include <util.h>
+#include <stdio.h>
+#include <common.h>
+#include <errlog.h>
+#include <option.h>
+#include <callback.h>
+
+#include <string>
+#include <vector>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/*
+    Each column of each table goes to its own file, <table>.<column>, as a flat
+    array of little-endian, fixed-width values. Scripts are variable-sized: they
+    go to <table>.<column>.data, indexed by nbRows+1 uint64_t offsets stored in
+    <table>.<column>.offsets.
+
+    Rows are grouped in row groups. For each numeric column, <table>.<column>.stats
+    holds one ColumnStats record per row group.
+
+    schema.txt lists every column with its type.
+*/
+
+struct ColumnStats
+{
+    uint64_t firstRow;
+    uint64_t nbRows;
+    uint64_t min;
+    uint64_t max;
+};
+
+static FILE *openColumnFile(
+    const std::string &fileName
+)
+{
+    FILE *f = fopen(fileName.c_str(), "w");
+    if(!f) sysErrFatal("couldn't open file %s for writing", fileName.c_str());
+    setvbuf(f, 0, _IOFBF, 1024 * 1024);
+    return f;
+}
+
+static void writeColumnFile(
+    FILE       *f,
+    const void *p,
+    size_t     size
+)
+{
+    size_t r = fwrite(p, size, 1, f);
+    if(1!=r) sysErrFatal("failed to write column file");
+}
+
+struct Column
+{
+    FILE *file;
+    FILE *offsetFile;
+    FILE *statsFile;
+    size_t width;
+    uint64_t min;
+    uint64_t max;
+    uint64_t blobSize;
+
+    void open(
+        FILE              *schema,
+        const std::string &dir,
+        const char        *table,
+        const char        *name,
+        const char        *type,
+        size_t            w,            // byte width of a value, 0 for blobs
+        bool              withStats
+    )
+    {
+        std::string base = dir + "/" + table + "." + name;
+        fprintf(schema, "%s.%s %s\n", table, name, type);
+
+        width = w;
+        blobSize = 0;
+        offsetFile = 0;
+        statsFile = 0;
+        resetStats();
+
+        if(0==width) {
+            file = openColumnFile(base + ".data");
+            offsetFile = openColumnFile(base + ".offsets");
+            writeColumnFile(offsetFile, &blobSize, sizeof(blobSize));
+        } else {
+            file = openColumnFile(base);
+            if(withStats) statsFile = openColumnFile(base + ".stats");
+        }
+    }
+
+    void resetStats()
+    {
+        min = (uint64_t)-1;
+        max = 0;
+    }
+
+    void put(
+        uint64_t v
+    )
+    {
+        writeColumnFile(file, &v, width);
+        if(v<min) min = v;
+        if(max<v) max = v;
+    }
+
+    void putBytes(
+        const uint8_t *p
+    )
+    {
+        writeColumnFile(file, p, width);
+    }
+
+    void putBlob(
+        const uint8_t *p,
+        size_t        size
+    )
+    {
+        if(0<size) writeColumnFile(file, p, size);
+        blobSize += size;
+        writeColumnFile(offsetFile, &blobSize, sizeof(blobSize));
+    }
+
+    void endGroup(
+        uint64_t firstRow,
+        uint64_t nbRows
+    )
+    {
+        if(0==statsFile || 0==nbRows) return;
+
+        ColumnStats stats;
+        stats.firstRow = firstRow;
+        stats.nbRows = nbRows;
+        stats.min = min;
+        stats.max = max;
+        writeColumnFile(statsFile, &stats, sizeof(stats));
+        resetStats();
+    }
+
+    void close()
+    {
+        if(file) fclose(file);
+        if(offsetFile) fclose(offsetFile);
+        if(statsFile) fclose(statsFile);
+    }
+};
+
+struct Table
+{
+    uint64_t nbRows;
+    uint64_t groupSize;
+    uint64_t groupStart;
+    std::vector<Column*> columns;
+
+    void init(
+        uint64_t size
+    )
+    {
+        nbRows = 0;
+        groupStart = 0;
+        groupSize = size;
+    }
+
+    void add(
+        Column &c
+    )
+    {
+        columns.push_back(&c);
+    }
+
+    void endGroup()
+    {
+        for(auto c : columns) c->endGroup(groupStart, nbRows - groupStart);
+        groupStart = nbRows;
+    }
+
+    void endRow()
+    {
+        ++nbRows;
+        if(unlikely(groupSize<=(nbRows - groupStart))) endGroup();
+    }
+
+    void close()
+    {
+        endGroup();
+        for(auto c : columns) c->close();
+    }
+};
+
+struct ColumnDump:public Callback
+{
+    optparse::OptionParser parser;
+    int64_t cutoffBlock;
+
+    Table blocks;
+    Column blkId;
+    Column blkHash;
+    Column blkVersion;
+    Column blkTime;
+    Column blkNonce;
+    Column blkBits;
+    Column blkMerkle;
+    Column blkNbTX;
+    Column blkOutputValue;
+    Column blkFees;
+    Column blkSize;
+
+    Table txs;
+    Column txId;
+    Column txHash;
+    Column txVersion;
+    Column txBlockId;
+    Column txNbInputs;
+    Column txNbOutputs;
+    Column txOutputValue;
+    Column txFees;
+    Column txLockTime;
+    Column txSize;
+
+    Table outputs;
+    Column outTXId;
+    Column outIndex;
+    Column outValue;
+    Column outScript;
+    Column outType;
+    Column outHash160;
+
+    Table inputs;
+    Column inTXId;
+    Column inIndex;
+    Column inScript;
+    Column inUpTXHash;
+    Column inUpOutputIndex;
+    Column inValue;
+
+    uint64_t blkID;
+    uint64_t blkTXs;
+    uint64_t blkFeeSum;
+    uint64_t blkOutputSum;
+
+    uint64_t txID;
+    bool isGenTX;
+    const uint8_t *txStart;
+    uint64_t txNbIn;
+    uint64_t txNbOut;
+    uint64_t txInputSum;
+    uint64_t txOutputSum;
+
+    ColumnDump()
+    {
+        parser
+            .usage("[options]")
+            .version("")
+            .description("create a columnar binary dump of the blockchain")
+            .epilog("")
+        ;
+        parser
+            .add_option("-o", "--output")
+            .action("store")
+            .set_default("columns")
+            .help("directory the column files are written to (default: %default)")
+        ;
+        parser
+            .add_option("-g", "--rowGroup")
+            .action("store")
+            .type("int")
+            .set_default(65536)
+            .help("number of rows per row group (default: %default)")
+        ;
+        parser
+            .add_option("-a", "--atBlock")
+            .action("store")
+            .type("int")
+            .set_default(-1)
+            .help("stop dump at block <block> (default: all)")
+        ;
+    }
+
+    virtual const char                   *name() const         { return "columndump"; }
+    virtual const optparse::OptionParser *optionParser() const { return &parser;      }
+    virtual bool                         needTXHash() const    { return true;         }
+
+    virtual void aliases(
+        std::vector<const char*> &v
+    ) const
+    {
+        v.push_back("columns");
+        v.push_back("coldump");
+    }
+
+    virtual int init(
+        int argc,
+        const char *argv[]
+    )
+    {
+        optparse::Values &values = parser.parse_args(argc, argv);
+        std::string dir = (const char *)values.get("output");
+        cutoffBlock = values.get("atBlock");
+        int64_t groupSize = values.get("rowGroup");
+        if(groupSize<=0) errFatal("row group size must be positive");
+
+        int r = mkdir(dir.c_str(), 0755);
+        if(r<0 && EEXIST!=errno) sysErrFatal("couldn't create directory %s", dir.c_str());
+
+        std::string schemaName = dir + "/schema.txt";
+        FILE *schema = fopen(schemaName.c_str(), "w");
+        if(!schema) sysErrFatal("couldn't open file %s for writing", schemaName.c_str());
+
+        #define COL(table, c, name, type, width, stats) \
+            c.open(schema, dir, #table, name, type, width, stats); \
+            table.add(c);
+
+            blocks.init(groupSize);
+            COL(blocks,  blkId,           "id",            "u64",     8,                  true );
+            COL(blocks,  blkHash,         "hash",          "bytes32", kSHA256ByteSize,    false);
+            COL(blocks,  blkVersion,      "version",       "u32",     4,                  true );
+            COL(blocks,  blkTime,         "time",          "u32",     4,                  true );
+            COL(blocks,  blkNonce,        "nonce",         "u32",     4,                  false);
+            COL(blocks,  blkBits,         "bits",          "u32",     4,                  true );
+            COL(blocks,  blkMerkle,       "merkle",        "bytes32", kSHA256ByteSize,    false);
+            COL(blocks,  blkNbTX,         "nbTX",          "u64",     8,                  true );
+            COL(blocks,  blkOutputValue,  "outputValue",   "u64",     8,                  true );
+            COL(blocks,  blkFees,         "fees",          "u64",     8,                  true );
+            COL(blocks,  blkSize,         "size",          "u64",     8,                  true );
+
+            txs.init(groupSize);
+            COL(txs,     txId,            "id",            "u64",     8,                  true );
+            COL(txs,     txHash,          "hash",          "bytes32", kSHA256ByteSize,    false);
+            COL(txs,     txVersion,       "version",       "u32",     4,                  true );
+            COL(txs,     txBlockId,       "blockId",       "u64",     8,                  true );
+            COL(txs,     txNbInputs,      "nbInputs",      "u64",     8,                  true );
+            COL(txs,     txNbOutputs,     "nbOutputs",     "u64",     8,                  true );
+            COL(txs,     txOutputValue,   "outputValue",   "u64",     8,                  true );
+            COL(txs,     txFees,          "fees",          "u64",     8,                  true );
+            COL(txs,     txLockTime,      "lockTime",      "u32",     4,                  true );
+            COL(txs,     txSize,          "size",          "u64",     8,                  true );
+
+            outputs.init(groupSize);
+            COL(outputs, outTXId,         "txId",          "u64",     8,                  true );
+            COL(outputs, outIndex,        "index",         "u64",     8,                  true );
+            COL(outputs, outValue,        "value",         "u64",     8,                  true );
+            COL(outputs, outScript,       "script",        "blob",    0,                  false);
+            COL(outputs, outType,         "type",          "i8",      1,                  false);
+            COL(outputs, outHash160,      "hash160",       "bytes20", kRIPEMD160ByteSize, false);
+
+            inputs.init(groupSize);
+            COL(inputs,  inTXId,          "txId",          "u64",     8,                  true );
+            COL(inputs,  inIndex,         "index",         "u64",     8,                  true );
+            COL(inputs,  inScript,        "script",        "blob",    0,                  false);
+            COL(inputs,  inUpTXHash,      "upTXHash",      "bytes32", kSHA256ByteSize,    false);
+            COL(inputs,  inUpOutputIndex, "upOutputIndex", "u64",     8,                  true );
+            COL(inputs,  inValue,         "value",         "u64",     8,                  true );
+
+        #undef COL
+        fclose(schema);
+
+        txID = 0;
+        blkID = 0;
+        info("dumping the blockchain to column files in %s ...", dir.c_str());
+        return 0;
+    }
+
+    virtual void startBlock(
+        const Block *b,
+        uint64_t
+    )
+    {
+        if(0<=cutoffBlock && cutoffBlock<b->height) wrapup();
+
+        uint8_t blockHash[kSHA256ByteSize];
+        sha256Twice(blockHash, b->data, 80);
+
+        const uint8_t *p = b->data;
+        LOAD(uint32_t, version, p);
+        SKIP(uint256_t, prevBlkHash, p);
+        LOAD(uint256_t, blkMerkleRoot, p);
+        LOAD(uint32_t, time, p);
+        LOAD(uint32_t, bits, p);
+        LOAD(uint32_t, nonce, p);
+
+        const uint8_t *sz = -4 + b->data;
+        LOAD(uint32_t, size, sz);
+
+        blkID = b->height - 1;
+        blkId.put(blkID);
+        blkHash.putBytes(blockHash);
+        blkVersion.put(version);
+        blkTime.put(time);
+        blkNonce.put(nonce);
+        blkBits.put(bits);
+        blkMerkle.putBytes(blkMerkleRoot.v);
+        blkSize.put(size);
+
+        blkTXs = 0;
+        blkFeeSum = 0;
+        blkOutputSum = 0;
+    }
+
+    virtual void endBlock(
+        const Block *b
+    )
+    {
+        blkNbTX.put(blkTXs);
+        blkOutputValue.put(blkOutputSum);
+        blkFees.put(blkFeeSum);
+        blocks.endRow();
+    }
+
+    virtual void startTX(
+        const uint8_t *p,
+        const uint8_t *hash
+    )
+    {
+        LOAD(uint32_t, version, p);
+        txId.put(txID);
+        txHash.putBytes(hash);
+        txVersion.put(version);
+        txBlockId.put(blkID);
+
+        txStart = -4 + p;
+        isGenTX = false;
+        txNbIn = 0;
+        txNbOut = 0;
+        txInputSum = 0;
+        txOutputSum = 0;
+        ++blkTXs;
+    }
+
+    virtual void endTX(
+        const uint8_t *p
+    )
+    {
+        const uint8_t *lt = -4 + p;
+        LOAD(uint32_t, lockTime, lt);
+
+        uint64_t fees = isGenTX ? 0 : txInputSum - txOutputSum;
+        txNbInputs.put(txNbIn);
+        txNbOutputs.put(txNbOut);
+        txOutputValue.put(txOutputSum);
+        txFees.put(fees);
+        txLockTime.put(lockTime);
+        txSize.put(p - txStart);
+        txs.endRow();
+
+        blkFeeSum += fees;
+        blkOutputSum += txOutputSum;
+        ++txID;
+    }
+
+    virtual void startInput(
+        const uint8_t *p
+    )
+    {
+        static uint256_t gNullHash;
+        if(0==memcmp(gNullHash.v, p, sizeof(gNullHash))) {
+            isGenTX = true;
+
+            // Coinbase inputs have no upstream output, and hence no edge
+            LOAD(uint256_t, upTXHash, p);
+            LOAD(uint32_t, upOutputIndex, p);
+            LOAD_VARINT(inputScriptSize, p);
+            putInput(txNbIn, p, inputScriptSize, upTXHash.v, upOutputIndex, 0);
+        }
+    }
+
+    void putInput(
+        uint64_t      inputIndex,
+        const uint8_t *inputScript,
+        uint64_t      inputScriptSize,
+        const uint8_t *upTXHash,
+        uint64_t      upOutputIndex,
+        uint64_t      value
+    )
+    {
+        inTXId.put(txID);
+        inIndex.put(inputIndex);
+        inScript.putBlob(inputScript, inputScriptSize);
+        inUpTXHash.putBytes(upTXHash);
+        inUpOutputIndex.put(upOutputIndex);
+        inValue.put(value);
+        inputs.endRow();
+
+        ++txNbIn;
+    }
+
+    virtual void edge(
+        uint64_t      value,
+        const uint8_t *upTXHash,
+        uint64_t      outputIndex,
+        const uint8_t *outputScript,
+        uint64_t      outputScriptSize,
+        const uint8_t *downTXHash,
+        uint64_t      inputIndex,
+        const uint8_t *inputScript,
+        uint64_t      inputScriptSize
+    )
+    {
+        putInput(inputIndex, inputScript, inputScriptSize, upTXHash, outputIndex, value);
+        txInputSum += value;
+    }
+
+    virtual void endOutput(
+        const uint8_t *p,
+        int64_t       value,
+        const uint8_t *txHash,
+        uint64_t      outputIndex,
+        const uint8_t *outputScript,
+        uint64_t      outputScriptSize
+    )
+    {
+        uint8_t addrType[3];
+        uint160_t pubKeyHash;
+        int type = solveOutputScript(pubKeyHash.v, outputScript, outputScriptSize, addrType);
+        if(type<0) memset(pubKeyHash.v, 0, kRIPEMD160ByteSize);
+
+        outTXId.put(txID);
+        outIndex.put(outputIndex);
+        outValue.put(value);
+        outScript.putBlob(outputScript, outputScriptSize);
+        outType.put((uint8_t)(int8_t)type);
+        outHash160.putBytes(pubKeyHash.v);
+        outputs.endRow();
+
+        ++txNbOut;
+        txOutputSum += value;
+    }
+
+    virtual void wrapup()
+    {
+        blocks.close();
+        txs.close();
+        outputs.close();
+        inputs.close();
+
+        info(
+            "done, dumped %" PRIu64 " blocks, %" PRIu64 " transactions, %" PRIu64 " outputs, %" PRIu64 " inputs\n",
+            blocks.nbRows,
+            txs.nbRows,
+            outputs.nbRows,
+            inputs.nbRows
+        );
+        exit(0);
+    }
+};
+
+static ColumnDump columnDump;
+
@@ -6,16 +6,17 @@
 #include <common.h>
 #include <errlog.h>
 #include <option.h>
+#include <output.h>
 #include <callback.h>
 
-typedef GoogMap<Hash256, uint64_t, Hash256Hasher, Hash256Equal>::Map OutputMap;
+typedef Hash256Map<uint64_t>::Map OutputMap;
 
 struct CSVDump:public Callback
 {
-    FILE *txFile;
-    FILE *blockFile;
-    FILE *inputFile;
-    FILE *outputFile;
+    OutputStream txFile;
+    OutputStream blockFile;
+    OutputStream inputFile;
+    OutputStream outputFile;
 
     optparse::OptionParser parser;
     int64_t firstBlock;
@@ -88,21 +89,17 @@ struct CSVDump:public Callback
 
         info("Dumping the blockchain...");
 
-        blockFile = fopen("blocks.csv", "w");
-        if(!blockFile) sysErrFatal("couldn't open file blocks.csv for writing\n");
-        fprintf(blockFile, "ID,Hash,Version,Timestamp,Nonce,Difficulty,Merkle,NumTransactions,OutputValue,FeesValue,Size\n");
+        blockFile.open("blocks.csv");
+        blockFile.put("ID,Hash,Version,Timestamp,Nonce,Difficulty,Merkle,NumTransactions,OutputValue,FeesValue,Size\n");
 
-        txFile = fopen("transactions.csv", "w");
-        if(!txFile) sysErrFatal("couldn't open file txs.csv for writing\n");
-        fprintf(txFile, "ID,Hash,Version,BlockId,NumInputs,NumOutputs,OutputValue,FeesValue,LockTime,Size\n");
+        txFile.open("transactions.csv");
+        txFile.put("ID,Hash,Version,BlockId,NumInputs,NumOutputs,OutputValue,FeesValue,LockTime,Size\n");
 
-        outputFile = fopen("outputs.csv", "w");
-        if(!outputFile) sysErrFatal("couldn't open file outputs.csv for writing\n");
-        fprintf(outputFile, "TransactionId,Index,Value,Script,ReceivingAddress,InputTxHash,InputTxIndex\n");
+        outputFile.open("outputs.csv");
+        outputFile.put("TransactionId,Index,Value,Script,ReceivingAddress,ReceivingAddressType,InputTxHash,InputTxIndex\n");
 
-        inputFile = fopen("inputs.csv", "w");
-        if(!inputFile) sysErrFatal("couldn't open file inputs.csv for writing\n");
-        fprintf(inputFile, "TransactionId,Index,Script,OutputTxHash,OutputTxIndex\n");
+        inputFile.open("inputs.csv");
+        inputFile.put("TransactionId,Index,Script,OutputTxHash,OutputTxIndex\n");
 
         return 0;
     }
@@ -136,35 +133,38 @@ struct CSVDump:public Callback
             LOAD(uint32_t, nonce, p);
 
             // ID
-            fprintf(blockFile, "%" PRIu64 ",", blkID);
+            blockFile.putU64(blkID);
+            blockFile.put(',');
 
             // Hash
-            uint8_t buf[1 + 2*kSHA256ByteSize];
-            toHex(buf, blockHash);
-            fprintf(blockFile, "\"%s\",", buf);
+            blockFile.put('"');
+            blockFile.putHex(blockHash);
+            blockFile.put("\",");
 
             // Version
-            fprintf(blockFile, "%" PRIu32 ",", version);
+            blockFile.putU64(version);
+            blockFile.put(',');
 
             // Timestamp
             time_t blockTime = blkTime;
             char tbuf[23];
             strftime(tbuf, sizeof tbuf, "%FT%TZ", gmtime(&blockTime));
 
-            fprintf(blockFile, "\"%s\",", tbuf);
+            blockFile.put('"');
+            blockFile.put(tbuf);
+            blockFile.put("\",");
 
             // Nonce
-            fprintf(blockFile, "%" PRIu32 ",", nonce);
+            blockFile.putU64(nonce);
+            blockFile.put(',');
 
             // Difficulty
-            fprintf(blockFile, "%f,", difficulty(difficultyBits));
+            blockFile.format("%f,", difficulty(difficultyBits));
 
             // Merkle root
-            uint8_t buf2[kSHA256ByteSize];
-            uint8_t buf3[1 + 2*kSHA256ByteSize];
-            memcpy(buf2, &blkMerkleRoot, kSHA256ByteSize);
-            toHex(buf3, buf2);
-            fprintf(blockFile, "\"%s\",", buf3);
+            blockFile.put('"');
+            blockFile.putHex(blkMerkleRoot.v);
+            blockFile.put("\",");
         }
     }
 
@@ -175,13 +175,16 @@ struct CSVDump:public Callback
         if (active)
         {
             // Number of transactions
-            fprintf(blockFile, "%" PRIu64 ",", numBlkTxs);
+            blockFile.putU64(numBlkTxs);
+            blockFile.put(',');
 
             // Value of output transactions
-            fprintf(blockFile, "%" PRIu64 ",", totalBlkOutput);
+            blockFile.putU64(totalBlkOutput);
+            blockFile.put(',');
 
             // Value of fees
-            fprintf(blockFile, "%" PRIu64 ",", totalBlkFees);
+            blockFile.putU64(totalBlkFees);
+            blockFile.put(',');
 
             // Size; depends on number of transactions
             if (numBlkTxs < 253)
@@ -200,7 +203,8 @@ struct CSVDump:public Callback
             {
                 blkSize += 8;
             }
-            fprintf(blockFile, "%" PRIu64 "\n", blkSize);
+            blockFile.putU64(blkSize);
+            blockFile.put('\n');
         }
 
         blkID++;
@@ -221,19 +225,22 @@ struct CSVDump:public Callback
             totalTxOutput = 0;
 
             // ID
-            fprintf(txFile, "%" PRIu64 ",", txID);
+            txFile.putU64(txID);
+            txFile.put(',');
 
             // Hash
-            uint8_t buf[1 + 2*kSHA256ByteSize];
-            toHex(buf, hash);
-            fprintf(txFile, "\"%s\",", buf);
+            txFile.put('"');
+            txFile.putHex(hash);
+            txFile.put("\",");
 
             // Version
             LOAD(uint32_t, version, p);
-            fprintf(txFile, "%" PRIu32 ",", version);
+            txFile.putU64(version);
+            txFile.put(',');
 
             // Block ID
-            fprintf(txFile, "%" PRIu64 ",", blkID);
+            txFile.putU64(blkID);
+            txFile.put(',');
         }
     }
 
@@ -244,34 +251,40 @@ struct CSVDump:public Callback
         if (active)
         {
             // Number of inputs
-            fprintf(txFile, "%" PRIu64 ",", numTxInputs);
+            txFile.putU64(numTxInputs);
+            txFile.put(',');
 
             // Number of outputs
-            fprintf(txFile, "%" PRIu64 ",", numTxOutputs);
+            txFile.putU64(numTxOutputs);
+            txFile.put(',');
 
             // Value of outputs
-            fprintf(txFile, "%" PRIu64 ",", totalTxOutput);
+            txFile.putU64(totalTxOutput);
+            txFile.put(',');
 
             // Value of fees
             if (genTx)
             {
-                fprintf(txFile, "0,");
+                txFile.put("0,");
             }
             else
             {
-                fprintf(txFile, "%" PRIu64 ",", totalTxInput - totalTxOutput);
+                txFile.putU64(totalTxInput - totalTxOutput);
+                txFile.put(',');
                 totalBlkFees += totalTxInput - totalTxOutput;
             }
 
             // Lock time
             LOAD(uint32_t, lockTime, p);
-            fprintf(txFile, "%" PRIu32 ",", lockTime);
+            txFile.putU64(lockTime);
+            txFile.put(',');
 
             // Size
             // p is 4 bigger than it should be due to above lock time load
             uint64_t txSize = p - 4 - txStart;
             blkSize += txSize;
-            fprintf(txFile, "%" PRIu64 "\n", txSize);
+            txFile.putU64(txSize);
+            txFile.put('\n');
 
             totalBlkOutput += totalTxOutput;
         }
@@ -280,7 +293,7 @@ struct CSVDump:public Callback
 
     virtual void endOutput(
         const uint8_t *p,
-        uint64_t      value,
+        int64_t       value,
         const uint8_t *txHash,
         uint64_t      outputIndex,
         const uint8_t *outputScript,
@@ -292,21 +305,27 @@ struct CSVDump:public Callback
             numTxOutputs++;
             totalTxOutput += value;
 
-            // Script
-            uint8_t script[1 + 2*outputScriptSize];
-            toHex(script, outputScript, outputScriptSize);
-
             // Receiving address
-            uint8_t address[40];
-            address[0] = 'X';
-            address[1] = 0;
-            uint8_t addrType[3];
-            uint160_t pubKeyHash;
-            int type = solveOutputScript(pubKeyHash.v, outputScript, outputScriptSize, addrType);
-            if(likely(0<=type)) hash160ToAddr(address, pubKeyHash.v);
+            uint8_t address[kAddrSize];
+            int type = scriptToAddr(address, outputScript, outputScriptSize);
+            if(unlikely(type<0)) {
+                address[0] = 'X';
+                address[1] = 0;
+            }
 
             // N.B. Input hash and index are NULL at this stage
-            fprintf(outputFile, "%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",\"%s\",\"%s\",,\n", txID, outputIndex, value, script, address);
+            outputFile.putU64(txID);
+            outputFile.put(',');
+            outputFile.putU64(outputIndex);
+            outputFile.put(',');
+            outputFile.putU64(value);
+            outputFile.put(",\"");
+            outputFile.putHex(outputScript, outputScriptSize);
+            outputFile.put("\",\"");
+            outputFile.put((const char*)address);
+            outputFile.put("\",\"");
+            outputFile.put(outputScriptTypeTag(type));
+            outputFile.put("\",,\n");
         }
     }
 
@@ -348,24 +367,25 @@ struct CSVDump:public Callback
             numTxInputs++;
             totalTxInput += value;
 
-            // outputTxHash
-            uint8_t outputTxHash[1 + 2*kSHA256ByteSize];
-            toHex(outputTxHash, upTXHash);
-
-            // Script
-            uint8_t script[1 + 2*inputScriptSize];
-            toHex(script, inputScript, inputScriptSize);
-
-            fprintf(inputFile, "%" PRIu64 ",%" PRIu64 ",\"%s\",\"%s\",%" PRIu64 "\n", txID, inputIndex, script, outputTxHash, outputIndex);
+            inputFile.putU64(txID);
+            inputFile.put(',');
+            inputFile.putU64(inputIndex);
+            inputFile.put(",\"");
+            inputFile.putHex(inputScript, inputScriptSize);
+            inputFile.put("\",\"");
+            inputFile.putHex(upTXHash);
+            inputFile.put("\",");
+            inputFile.putU64(outputIndex);
+            inputFile.put('\n');
         }
     }
 
     virtual void wrapup()
     {
-        fclose(outputFile);
-        fclose(inputFile);
-        fclose(blockFile);
-        fclose(txFile);
+        outputFile.close();
+        inputFile.close();
+        blockFile.close();
+        txFile.close();
         info("Done\n");
         exit(0);
     }
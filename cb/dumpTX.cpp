@@ -7,7 +7,7 @@
 #include <string.h>
 #include <callback.h>
 
-typedef GoogMap<Hash256, int, Hash256Hasher, Hash256Equal >::Map TxMap;
+typedef Hash256Map<int>::Map TxMap;
 
 struct DumpTX:public Callback
 {
@@ -213,45 +213,15 @@ struct DumpTX:public Callback
     )
     {
         uint8_t type[128];
-        const char *typeName = "unknown";
         uint8_t pubKeyHash[kSHA256ByteSize];
         int r = solveOutputScript(pubKeyHash, outputScript, outputScriptSize, type);
-        switch(r) {
-            case 0: {
-                typeName = "pays to hash160(pubKey)";
-                break;
-            }
-            case 1: {
-                typeName = "pays to explicit uncompressed pubKey";
-                break;
-            }
-            case 2: {
-                typeName = "pays to explicit compressed pubKey";
-                break;
-            }
-            case 3: {
-                typeName = "pays to hash160(script)";
-                break;
-            }
-            case 4: {
-                typeName = "pays to hash160(script)";
-                break;
-            }
-            case -2: {
-                typeName = "broken script generated by p2pool - coins lost";
-                break;
-            }
-            case -1: {
-                typeName = "couldn't parse script";
-                break;
-            }
-        }
+        const char *typeName = outputScriptTypeName(r);
         printf("\n");
         printf("        script type = %s\n", typeName);
 
         if(0<=r) {
-            uint8_t btcAddr[64];
-            hash160ToAddr(btcAddr, pubKeyHash);
+            uint8_t btcAddr[kAddrSize];
+            scriptToAddr(btcAddr, outputScript, outputScriptSize);
             printf("        script pays to address %s\n", btcAddr);
         }
     }
@@ -322,7 +292,7 @@ struct DumpTX:public Callback
 
     virtual void endOutput(
         const uint8_t *p,                   // Pointer to TX output raw data
-        uint64_t      value,                // Number of satoshis on this output
+        int64_t       value,                // Number of satoshis on this output
         const uint8_t *txHash,              // sha256 of the current transaction
         uint64_t      outputIndex,          // Index of this output in the current transaction
         const uint8_t *outputScript,        // Raw script (challenge to would-be spender) carried by this output
@@ -0,0 +1,228 @@
+
+// Export the longest chain into a pre-digested archive that can be parsed again at memory speed
+
+#include <util.h>
+#include <stdio.h>
+#include <common.h>
+#include <errlog.h>
+#include <option.h>
+#include <archive.h>
+#include <callback.h>
+
+#include <string>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+typedef Hash256Map<uint64_t>::Map FirstOutputMap;
+
+struct ExportArchive:public Callback
+{
+    optparse::OptionParser parser;
+
+    std::string dir;
+    ArchiveMeta meta;
+    FILE *files[kArchiveNbColumns];
+    FirstOutputMap firstOutputMap;
+
+    uint64_t dataOffset;
+    uint64_t blockOffset;
+    uint64_t inputSpend;
+    const uint8_t *blockData;
+
+    ExportArchive()
+    {
+        parser
+            .usage("[options]")
+            .version("")
+            .description(
+                "write the longest chain into a pre-digested archive (txids, resolved spends, "
+                "classified outputs). Parse it again with BLOCKPARSER_SOURCE=<archive directory>"
+            )
+            .epilog("")
+        ;
+        parser
+            .add_option("-o", "--output")
+            .action("store")
+            .set_default("chain.archive")
+            .help("directory the archive is written to (default: %default)")
+        ;
+    }
+
+    virtual const char                   *name() const         { return "exportArchive"; }
+    virtual const optparse::OptionParser *optionParser() const { return &parser;         }
+    virtual bool                         needTXHash() const    { return true;            }
+
+    virtual void aliases(
+        std::vector<const char*> &v
+    ) const
+    {
+        v.push_back("export-archive");
+        v.push_back("archive");
+    }
+
+    void write(
+        int        column,
+        const void *p,
+        size_t     size
+    )
+    {
+        size_t r = fwrite(p, size, 1, files[column]);
+        if(1!=r) sysErrFatal("failed to write to archive file %s/%s", dir.c_str(), archiveColumnName(column));
+    }
+
+    void write64(
+        int      column,
+        uint64_t v
+    )
+    {
+        write(column, &v, sizeof(v));
+    }
+
+    virtual int init(
+        int argc,
+        const char *argv[]
+    )
+    {
+        optparse::Values &values = parser.parse_args(argc, argv);
+        dir = (const char *)values.get("output");
+
+        int r = mkdir(dir.c_str(), 0755);
+        if(r<0 && EEXIST!=errno) sysErrFatal("couldn't create archive directory %s", dir.c_str());
+
+        for(int i=0; i<kArchiveNbColumns; ++i) {
+            std::string fileName = dir + "/" + archiveColumnName(i);
+            files[i] = fopen(fileName.c_str(), "w");
+            if(!files[i]) sysErrFatal("couldn't open file %s for writing", fileName.c_str());
+            setvbuf(files[i], 0, _IOFBF, 1024 * 1024);
+        }
+
+        memset(&meta, 0, sizeof(meta));
+        meta.magic = kArchiveMagic;
+        meta.version = kArchiveVersion;
+        dataOffset = 0;
+
+        static uint8_t empty[kSHA256ByteSize] = { 0x42 };
+        firstOutputMap.setEmptyKey(empty);
+        firstOutputMap.resize(15 * 1000 * 1000);
+
+        info("exporting the longest chain to archive %s ...", dir.c_str());
+        return 0;
+    }
+
+    virtual void startBlock(
+        const Block *b,
+        uint64_t
+    )
+    {
+        // Keep the magic+size preamble, so the archive's blocks look exactly like the ones in a blk file
+        const uint8_t *p = -4 + b->data;
+        LOAD(uint32_t, size, p);
+        write(kArchiveBlockData, -8 + b->data, 8 + size);
+
+        blockData = b->data;
+        blockOffset = 8 + dataOffset;
+        dataOffset += 8 + size;
+
+        write64(kArchiveBlockOffsets, blockOffset);
+        write64(kArchiveBlockFirstTX, meta.nbTX);
+        ++meta.nbBlocks;
+    }
+
+    virtual void startTX(
+        const uint8_t *p,
+        const uint8_t *hash
+    )
+    {
+        write64(kArchiveTXOffsets, blockOffset + (p - blockData));
+        write(kArchiveTXIds, hash, kSHA256ByteSize);
+        write64(kArchiveTXFirstOutput, meta.nbOutputs);
+        write64(kArchiveTXFirstInput, meta.nbInputs);
+        firstOutputMap[hash] = meta.nbOutputs;
+        ++meta.nbTX;
+    }
+
+    virtual void startInput(
+        const uint8_t *p
+    )
+    {
+        inputSpend = kArchiveNoSpend;
+    }
+
+    virtual void edge(
+        uint64_t      value,
+        const uint8_t *upTXHash,
+        uint64_t      outputIndex,
+        const uint8_t *outputScript,
+        uint64_t      outputScriptSize,
+        const uint8_t *downTXHash,
+        uint64_t      inputIndex,
+        const uint8_t *inputScript,
+        uint64_t      inputScriptSize
+    )
+    {
+        auto i = firstOutputMap.find(upTXHash);
+        if(unlikely(firstOutputMap.end()==i)) errFatal("failed to locate upstream TX");
+        inputSpend = i->second + outputIndex;
+    }
+
+    virtual void endInput(
+        const uint8_t *p
+    )
+    {
+        write64(kArchiveInputSpends, inputSpend);
+        ++meta.nbInputs;
+    }
+
+    virtual void startOutput(
+        const uint8_t *p
+    )
+    {
+        write64(kArchiveOutputOffsets, blockOffset + (p - blockData));
+    }
+
+    virtual void endOutput(
+        const uint8_t *p,
+        int64_t       value,
+        const uint8_t *txHash,
+        uint64_t      outputIndex,
+        const uint8_t *outputScript,
+        uint64_t      outputScriptSize
+    )
+    {
+        uint8_t addrType[3];
+        uint160_t pubKeyHash;
+        int type = solveOutputScript(pubKeyHash.v, outputScript, outputScriptSize, addrType);
+        if(type<0) memset(pubKeyHash.v, 0, kRIPEMD160ByteSize);
+
+        int8_t typeCode = type;
+        write64(kArchiveOutputValues, value);
+        write(kArchiveOutputTypes, &typeCode, sizeof(typeCode));
+        write(kArchiveOutputHash160, pubKeyHash.v, kRIPEMD160ByteSize);
+        ++meta.nbOutputs;
+    }
+
+    virtual void wrapup()
+    {
+        write64(kArchiveBlockFirstTX, meta.nbTX);
+        write64(kArchiveTXFirstOutput, meta.nbOutputs);
+        write64(kArchiveTXFirstInput, meta.nbInputs);
+        write(kArchiveMeta, &meta, sizeof(meta));
+
+        for(int i=0; i<kArchiveNbColumns; ++i) {
+            int r = fclose(files[i]);
+            if(r<0) sysErrFatal("failed to close archive file %s/%s", dir.c_str(), archiveColumnName(i));
+        }
+
+        info(
+            "done, archived %" PRIu64 " blocks, %" PRIu64 " transactions, %" PRIu64 " outputs, %" PRIu64 " inputs\n",
+            meta.nbBlocks,
+            meta.nbTX,
+            meta.nbOutputs,
+            meta.nbInputs
+        );
+    }
+};
+
+static ExportArchive exportArchive;
+
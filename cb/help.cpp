@@ -91,6 +91,10 @@ struct Help:public Callback
         printf("    NOTE: whenever specifying a list file, you can use \"file:-\" and blockparser\n");
         printf("          will read the list directly from stdin.\n");
         printf("\n");
+        printf("    NOTE: the blockchain is read from ~/.bitcoin/blocks, where blk files may also be\n");
+        printf("          zstd-compressed (blkNNNNN.dat.zst). Set BLOCKPARSER_SOURCE to a colon-separated\n");
+        printf("          list of blk files or .zst files to read it from there.\n");
+        printf("\n");
         printf("\n");
 
         if(longHelp) {
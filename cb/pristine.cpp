@@ -8,7 +8,7 @@
 #include <option.h>
 #include <callback.h>
 
-typedef GoogMap<Hash256, uint64_t, Hash256Hasher, Hash256Equal >::Map TxMap;
+typedef Hash256Map<uint64_t>::Map TxMap;
 
 struct Pristine:public Callback
 {
@@ -146,7 +146,7 @@ struct Pristine:public Callback
                     cTime
                 );
         
-                showHex(i->first);
+                showHex(i->first.v);
                 putchar('\n');
             }
             ++i;
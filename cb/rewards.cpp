@@ -96,7 +96,7 @@ struct Rewards:public Callback
 
     virtual void endOutput(
         const uint8_t *p,
-        uint64_t      value,
+        int64_t       value,
         const uint8_t *txHash,
         uint64_t      outputIndex,
         const uint8_t *outputScript,
@@ -139,7 +139,9 @@ struct Rewards:public Callback
             return;
         } else {
 
-            showFullAddr(pubKeyHash.v, true);
+            WitnessProgram program;
+            witnessProgram(program, type, outputScript, outputScriptSize);
+            showFullAddr(pubKeyHash.v, true, type, &program);
             printf(" %2d ", type);
 
             // pay to hash160(pubKey)
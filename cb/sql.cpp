@@ -6,35 +6,39 @@
 #include <common.h>
 #include <errlog.h>
 #include <option.h>
+#include <output.h>
 #include <callback.h>
 
 static uint8_t empty[kSHA256ByteSize] = { 0x42 };
-typedef GoogMap<Hash256, uint64_t, Hash256Hasher, Hash256Equal>::Map OutputMap;
+typedef Hash256Map<uint64_t>::Map OutputMap;
 
 static void writeEscapedBinaryBuffer(
-    FILE          *f,
+    OutputStream  &f,
     const uint8_t *p,
     size_t        n
 )
 {
+    // Worst case, every byte gets escaped
+    char *dst = f.reserve(2*n);
     p += n;
 
     while(n--) {
         uint8_t c = *(--p);
-             if(unlikely(0==c))  { fputc('\\', f); c = '0'; }
-        else if(unlikely('\n'==c)) fputc('\\', f);
-        else if(unlikely('\t'==c)) fputc('\\', f);
-        else if(unlikely('\\'==c)) fputc('\\', f);
-        fputc(c, f);
+             if(unlikely(0==c))  { *(dst++) = '\\'; c = '0'; }
+        else if(unlikely('\n'==c)) *(dst++) = '\\';
+        else if(unlikely('\t'==c)) *(dst++) = '\\';
+        else if(unlikely('\\'==c)) *(dst++) = '\\';
+        *(dst++) = c;
     }
+    f.commit(dst);
 }
 
 struct SQLDump:public Callback
 {
-    FILE *txFile;
-    FILE *blockFile;
-    FILE *inputFile;
-    FILE *outputFile;
+    OutputStream txFile;
+    OutputStream blockFile;
+    OutputStream inputFile;
+    OutputStream outputFile;
 
     uint64_t txID;
     uint64_t blkID;
@@ -91,17 +95,10 @@ struct SQLDump:public Callback
 
         info("dumping the blockchain ...");
 
-        txFile = fopen("transactions.txt", "w");
-        if(!txFile) sysErrFatal("couldn't open file txs.txt for writing\n");
-
-        blockFile = fopen("blocks.txt", "w");
-        if(!blockFile) sysErrFatal("couldn't open file blocks.txt for writing\n");
-
-        inputFile = fopen("inputs.txt", "w");
-        if(!inputFile) sysErrFatal("couldn't open file inputs.txt for writing\n");
-
-        outputFile = fopen("outputs.txt", "w");
-        if(!outputFile) sysErrFatal("couldn't open file outputs.txt for writing\n");
+        txFile.open("transactions.txt");
+        blockFile.open("blocks.txt");
+        inputFile.open("inputs.txt");
+        outputFile.open("outputs.txt");
 
         FILE *sqlFile = fopen("blockChain.sql", "w");
         if(!sqlFile) sysErrFatal("couldn't open file blockChain.sql for writing\n");
@@ -132,7 +129,8 @@ struct SQLDump:public Callback
             "\n"
             "CREATE TABLE outputs(\n"
             "    id BIGINT PRIMARY KEY,\n"
-            "    dstAddress CHAR(36),\n"
+            "    dstAddress VARCHAR(64),\n"
+            "    dstType VARCHAR(16),\n"
             "    value BIGINT,\n"
             "    txID BIGINT,\n"
             "    offset INT\n"
@@ -196,12 +194,14 @@ struct SQLDump:public Callback
         // id BIGINT PRIMARY KEY
         // hash BINARY(32)
         // time BIGINT
-        fprintf(blockFile, "%" PRIu64 "\t", (blkID = b->height-1));
+        blockFile.putU64(blkID = b->height-1);
+        blockFile.put('\t');
 
         writeEscapedBinaryBuffer(blockFile, blockHash, kSHA256ByteSize);
-        fputc('\t', blockFile);
+        blockFile.put('\t');
 
-        fprintf(blockFile, "%" PRIu64 "\n", (uint64_t)blkTime);
+        blockFile.putU64(blkTime);
+        blockFile.put('\n');
         if(0==(b->height)%500) {
             fprintf(
                 stderr,
@@ -221,61 +221,60 @@ struct SQLDump:public Callback
         // id BIGINT PRIMARY KEY
         // hash BINARY(32)
         // blockID BIGINT
-        fprintf(txFile, "%" PRIu64 "\t", txID++);
+        txFile.putU64(txID++);
+        txFile.put('\t');
 
         writeEscapedBinaryBuffer(txFile, hash, kSHA256ByteSize);
-        fputc('\t', txFile);
+        txFile.put('\t');
 
-        fprintf(txFile, "%" PRIu64 "\n", blkID);
+        txFile.putU64(blkID);
+        txFile.put('\n');
     }
 
     virtual void endOutput(
         const uint8_t *p,
-        uint64_t      value,
+        int64_t       value,
         const uint8_t *txHash,
         uint64_t      outputIndex,
         const uint8_t *outputScript,
         uint64_t      outputScriptSize
     )
     {
-        uint8_t address[40];
-        address[0] = 'X';
-        address[1] = 0;
-
-        uint8_t addrType[3];
-        uint160_t pubKeyHash;
-        int type = solveOutputScript(pubKeyHash.v, outputScript, outputScriptSize, addrType);
-        if(likely(0<=type)) hash160ToAddr(address, pubKeyHash.v);
+        uint8_t address[kAddrSize];
+        int type = scriptToAddr(address, outputScript, outputScriptSize);
+        if(unlikely(type<0)) {
+            address[0] = 'X';
+            address[1] = 0;
+        }
 
         // id BIGINT PRIMARY KEY
-        // dstAddress CHAR(36)
+        // dstAddress VARCHAR(64)
+        // dstType VARCHAR(16)
         // value BIGINT
         // txID BIGINT
         // offset INT
-        fprintf(
-            outputFile,
-            "%" PRIu64 "\t"
-            "%s\t"
-            "%" PRIu64 "\t"
-            "%" PRIu64 "\t"
-            "%" PRIu32 "\n"
-            ,
-            outputID,
-            address,
-            value,
-            txID,
-            (uint32_t)outputIndex
-        );
+        outputFile.putU64(outputID);
+        outputFile.put('\t');
+        outputFile.put((const char*)address);
+        outputFile.put('\t');
+        outputFile.put(outputScriptTypeTag(type));
+        outputFile.put('\t');
+        outputFile.putU64(value);
+        outputFile.put('\t');
+        outputFile.putU64(txID);
+        outputFile.put('\t');
+        outputFile.putU64((uint32_t)outputIndex);
+        outputFile.put('\n');
 
+        uint256_t h;
         uint32_t oi = outputIndex;
-        uint8_t *h = allocHash256();
-        memcpy(h, txHash, kSHA256ByteSize);
+        memcpy(h.v, txHash, kSHA256ByteSize);
 
-        uintptr_t ih = reinterpret_cast<uintptr_t>(h);
+        uintptr_t ih = reinterpret_cast<uintptr_t>(h.v);
         uint32_t *h32 = reinterpret_cast<uint32_t*>(ih);
         h32[0] ^= oi;
 
-        outputMap[h] = outputID++;
+        outputMap[h.v] = outputID++;
     }
 
     virtual void edge(
@@ -305,26 +304,22 @@ struct SQLDump:public Callback
         // outputID BIGINT
         // txID BIGINT
         // offset INT
-        fprintf(
-            inputFile,
-            "%" PRIu64 "\t"
-            "%" PRIu64 "\t"
-            "%" PRIu64 "\t"
-            "%" PRIu32 "\n"
-            ,
-            inputID++,
-            src->second,
-            txID,
-            (uint32_t)outputIndex
-        );
+        inputFile.putU64(inputID++);
+        inputFile.put('\t');
+        inputFile.putU64(src->second);
+        inputFile.put('\t');
+        inputFile.putU64(txID);
+        inputFile.put('\t');
+        inputFile.putU64((uint32_t)outputIndex);
+        inputFile.put('\n');
     }
 
     virtual void wrapup()
     {
-        fclose(outputFile);
-        fclose(inputFile);
-        fclose(blockFile);
-        fclose(txFile);
+        outputFile.close();
+        inputFile.close();
+        blockFile.close();
+        txFile.close();
         info("done\n");
         exit(0);
     }
@@ -25,18 +25,20 @@
 #include <util.h>
 #include <common.h>
 #include <errlog.h>
+#include <output.h>
 #include <string.h>
 #include <callback.h>
 
 typedef long double Number;
-typedef GoogMap<Hash256, int, Hash256Hasher, Hash256Equal >::Map TxMap;
-typedef GoogMap<Hash256, Number, Hash256Hasher, Hash256Equal >::Map TaintMap;
+typedef Hash256Map<int>::Map TxMap;
+typedef Hash256Map<Number>::Map TaintMap;
 
 static inline void printNumber(
+    OutputStream &out,
     const Number &x
 )
 {
-    printf("%.32Lf ", x);
+    out.format("%.32Lf ", x);
 }
 
 struct Taint:public Callback
@@ -50,6 +52,7 @@ struct Taint:public Callback
     TaintMap taintMap;
     const uint8_t *txHash;
     std::vector<uint256_t> rootHashes;
+    OutputStream out;
 
     Taint()
     {
@@ -113,11 +116,13 @@ struct Taint:public Callback
             srcTxMap[txHash.v] = 1;
         }
 
+        out.attach(1, "stdout");
         return 0;
     }
 
     virtual void wrapup()
     {
+        out.close();
         info("found %" PRIu64 " tainted transactions.\n", (uint64_t)taintMap.size());
     }
 
@@ -143,9 +148,9 @@ struct Taint:public Callback
         else if(0<txTotal && 0<txBad) taintMap[txHash] = taint = txBad/txTotal;
 
         if(threshold<taint) {
-            printNumber(taint);
-            showHex(txHash);
-            putchar('\n');
+            printNumber(out, taint);
+            out.putHex(txHash);
+            out.put('\n');
         }
     }
 
@@ -7,12 +7,13 @@
 #include <common.h>
 #include <errlog.h>
 #include <option.h>
+#include <output.h>
 #include <rmd160.h>
 #include <string.h>
 #include <callback.h>
 
 static uint8_t emptyKey[kRIPEMD160ByteSize] = { 0x52 };
-typedef GoogMap<Hash160, int, Hash160Hasher, Hash160Equal>::Map AddrMap;
+typedef Hash160Map<int>::Map AddrMap;
 
 struct Transactions:public Callback
 {
@@ -25,6 +26,7 @@ struct Transactions:public Callback
     uint64_t nbTX;
     uint64_t bTime;
     AddrMap addrMap;
+    OutputStream out;
     std::vector<uint160_t> rootHashes;
 
     Transactions()
@@ -115,15 +117,16 @@ struct Transactions:public Callback
             int64_t newSum = sum + value*(add ? 1 : -1);
 
             if(csv) {
-                printf("%6" PRIu64 ", \"", bTime/86400 + 25569);
-                showHex(pubKeyHash.v, kRIPEMD160ByteSize, false);
-                printf("\", \"");
-                showHex(downTXHash ? downTXHash : txHash);
-                printf(
-                    "\",%17.08f,%17.08f\n",
-                    (add ? 1e-8 : -1e-8)*value,
-                    newSum*1e-8
-                );
+                out.putU64(bTime/86400 + 25569, 6);
+                out.put(", \"");
+                out.putHex(pubKeyHash.v, kRIPEMD160ByteSize, false);
+                out.put("\", \"");
+                out.putHex(downTXHash ? downTXHash : txHash);
+                out.put("\",");
+                out.putAmount(value, !add, 17);
+                out.put(',');
+                out.putAmount(newSum, 17);
+                out.put('\n');
             } else {
 
                 struct tm gmTime;
@@ -136,19 +139,21 @@ struct Transactions:public Callback
                 size_t sz =strlen(timeBuf);
                 if(0<sz) timeBuf[sz-1] = 0;
 
-                printf("    %s    ", timeBuf);
-                showHex(pubKeyHash.v, kRIPEMD160ByteSize, false);
-
-                printf("    ");
-                showHex(downTXHash ? downTXHash : txHash);
-
-                printf(
-                    " %24.08f %c %24.08f = %24.08f\n",
-                    sum*1e-8,
-                    add ? '+' : '-',
-                    value*1e-8,
-                    newSum*1e-8
-                );
+                out.put("    ");
+                out.put(timeBuf);
+                out.put("    ");
+                out.putHex(pubKeyHash.v, kRIPEMD160ByteSize, false);
+
+                out.put("    ");
+                out.putHex(downTXHash ? downTXHash : txHash);
+
+                out.put(' ');
+                out.putAmount((int64_t)sum, 24);
+                out.put(add ? " + " : " - ");
+                out.putAmount(value, false, 24);
+                out.put(" = ");
+                out.putAmount(newSum, 24);
+                out.put('\n');
             }
 
             (add ? adds : subs) += value;
@@ -215,8 +220,9 @@ struct Transactions:public Callback
         const Block *
     )
     {
+        out.attach(1, "stdout");
         if(csv) {
-            printf(
+            out.put(
                 "\"Time\","
                 " \"Address\","
                 "                                  \"TXId\","
@@ -227,18 +233,21 @@ struct Transactions:public Callback
         }
         else {
             info("Dumping all transactions for %d address(es)\n", (int)addrMap.size());
-            printf("    Time (GMT)                  Address                                     Transaction                                                                    OldBalance                     Amount                 NewBalance\n");
-            printf("    =======================================================================================================================================================================================================================\n");
+            out.put("    Time (GMT)                  Address                                     Transaction                                                                    OldBalance                     Amount                 NewBalance\n");
+            out.put("    =======================================================================================================================================================================================================================\n");
         }
     }
 
     virtual void wrapup()
     {
         if(false==csv) {
-            printf(
+            out.put(
                 "    =======================================================================================================================================================================================================================\n"
             );
+        }
+        out.close();
 
+        if(false==csv) {
             info(
                 "\n"
                 "    transactions  = %" PRIu64 "\n"
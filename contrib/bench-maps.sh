@@ -0,0 +1,62 @@
+#!/bin/bash
+
+# Time and peak RSS of the parser with each hash map backend.
+#
+#   contrib/bench-maps.sh                       simpleStats, allBalances and pristine
+#   contrib/bench-maps.sh "closure 1Dky..."     any other set of commands
+#
+# Reads the chain the parser normally would: $HOME/.bitcoin or BLOCKPARSER_SOURCE.
+# PARSER overrides the binary, BACKENDS the list of BLOCKPARSER_MAPS values to try.
+
+PARSER=${PARSER:-./parser}
+BACKENDS=${BACKENDS:-"sparse dense swiss"}
+
+COMMANDS=("$@")
+if test ${#COMMANDS[@]} -eq 0
+then
+    COMMANDS=("simpleStats" "allBalances" "pristine")
+fi
+
+function run()
+{
+    MAPS=$1
+    CMD=$2
+
+    START=`date +%s.%N`
+    BLOCKPARSER_MAPS=$MAPS $PARSER $CMD >/dev/null 2>&1 &
+    PID=$!
+
+    # VmHWM only ever grows, so the last sample before exit is the peak
+    HWM=0
+    while kill -0 $PID 2>/dev/null
+    do
+        V=`awk '/^VmHWM/ {print $2}' /proc/$PID/status 2>/dev/null`
+        if test "$V" != ""
+        then
+            HWM=$V
+        fi
+        sleep 0.05
+    done
+    wait $PID
+    STATUS=$?
+    END=`date +%s.%N`
+
+    awk -v c="$CMD" -v m="$MAPS" -v s=$START -v e=$END -v k=$HWM \
+        'BEGIN { printf "%-24s %-8s %10.2f s %10.1f MB", c, m, e-s, k/1024 }'
+    if test $STATUS -ne 0
+    then
+        printf "   (exit status %d)" $STATUS
+    fi
+    echo
+}
+
+printf "%-24s %-8s %12s %13s\n" "command" "maps" "time" "peak RSS"
+echo "======================================================================"
+for CMD in "${COMMANDS[@]}"
+do
+    for MAPS in $BACKENDS
+    do
+        run "$MAPS" "$CMD"
+    done
+done
+
@@ -0,0 +1,60 @@
+#!/bin/bash
+
+# Check that allBalances --atBlock still gives the same output however it is
+# spelled, and, when BASELINE names an older parser binary, the same output
+# as that binary.
+#
+#   contrib/check-atblock.sh                    heights 1000, 100000 and 300000
+#   contrib/check-atblock.sh 170 5000           any other heights
+#   BASELINE=/tmp/parser.old contrib/check-atblock.sh
+#
+# Reads the chain the parser normally would: $HOME/.bitcoin or BLOCKPARSER_SOURCE.
+# PARSER overrides the binary under test.
+
+PARSER=${PARSER:-./parser}
+
+HEIGHTS=("$@")
+if test ${#HEIGHTS[@]} -eq 0
+then
+    HEIGHTS=(1000 100000 300000)
+fi
+
+function digest()
+{
+    BIN=$1
+    shift
+    $BIN allBalances "$@" 2>/dev/null | md5sum | cut -d' ' -f1
+}
+
+STATUS=0
+for H in "${HEIGHTS[@]}"
+do
+    REF=`digest $PARSER -a $H`
+    for SPELLING in "--atBlock $H" "--atBlock=$H"
+    do
+        GOT=`digest $PARSER $SPELLING`
+        if test "$GOT" != "$REF"
+        then
+            echo "FAIL: $SPELLING differs from -a $H"
+            STATUS=1
+        fi
+    done
+
+    if test "$BASELINE" != ""
+    then
+        GOT=`digest $BASELINE --atBlock $H`
+        if test "$GOT" != "$REF"
+        then
+            echo "FAIL: --atBlock $H differs from $BASELINE"
+            STATUS=1
+        fi
+    fi
+    echo "height $H: $REF"
+done
+
+if test $STATUS -eq 0
+then
+    echo "ok"
+fi
+exit $STATUS
+
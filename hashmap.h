@@ -0,0 +1,350 @@
+#ifndef __HASHMAP_H__
+    #define __HASHMAP_H__
+
+    #include <new>
+    #include <utility>
+    #include <stdlib.h>
+    #include <string.h>
+    #include <common.h>
+    #include <errlog.h>
+
+    #if defined(__SSE2__)
+        #include <emmintrin.h>
+    #endif
+
+    // Which implementation backs a GoogMap. Chosen at runtime, per map role,
+    // from the BLOCKPARSER_MAPS environment variable, e.g.
+    //
+    //      BLOCKPARSER_MAPS=swiss                      every map is a Swiss table
+    //      BLOCKPARSER_MAPS=tx=dense,addr=swiss        per role, the rest keep the default
+    //
+    // The default is sparse (or dense when built with WANT_DENSE).
+
+    #define MAP_BACKENDS                                                            \
+        MAP_BACKEND(Sparse, sparse, "google::sparse_hash_map: slow, smallest"     ) \
+        MAP_BACKEND(Dense,  dense,  "google::dense_hash_map: fast, largest"       ) \
+        MAP_BACKEND(Swiss,  swiss,  "in-tree Swiss table: inline slots"           ) \
+
+    #define MAP_ROLES                                                               \
+        MAP_ROLE(TX,    tx,    "transaction hash maps"                            ) \
+        MAP_ROLE(Block, block, "the block index"                                  ) \
+        MAP_ROLE(Addr,  addr,  "address (hash160) maps"                           ) \
+
+    enum MapBackend {
+        #define MAP_BACKEND(x, name, desc) kMap##x,
+            MAP_BACKENDS
+        #undef MAP_BACKEND
+        kNbMapBackends
+    };
+
+    enum MapRole {
+        #define MAP_ROLE(x, name, desc) kMapRole##x,
+            MAP_ROLES
+        #undef MAP_ROLE
+        kNbMapRoles
+    };
+
+    int mapBackend(int role);                   // parses BLOCKPARSER_MAPS on first call
+    const char *mapBackendName(int backend);
+
+    // Open addressing hash map in the style of absl::flat_hash_map.
+    //
+    // Slots hold the (key, value) pairs inline, in one flat array. A parallel
+    // array has one control byte per slot: 0x80 when empty, 0xFE when erased,
+    // otherwise the low 7 bits of the key's hash. A lookup hashes once, then
+    // scans groups of 16 control bytes with a single SSE2 compare, and only
+    // touches slots whose control byte matches. Groups are probed triangularly;
+    // the table grows at 7/8 full, so every probe sequence ends on an empty byte.
+    //
+    // Erasing leaves a tombstone that later inserts reuse. When tombstones are
+    // what fills the table, it is rebuilt at the same size rather than grown.
+    // Iterators are invalidated by any insert that rebuilds the table.
+
+    template<
+        typename Key,
+        typename Value,
+        typename Hasher,
+        typename Equal
+    >
+    struct SwissMap
+    {
+        typedef std::pair<const Key, Value> value_type;
+
+        enum { kGroupSize = 16 };
+        enum { kEmpty = -128 };
+        enum { kDeleted = -2 };
+
+        struct iterator
+        {
+            int8_t     *ctrl;
+            int8_t     *ctrlEnd;
+            value_type *slot;
+
+            iterator()
+                :   ctrl(0),
+                    ctrlEnd(0),
+                    slot(0)
+            {
+            }
+
+            iterator(
+                int8_t     *_ctrl,
+                int8_t     *_ctrlEnd,
+                value_type *_slot
+            )
+                :   ctrl(_ctrl),
+                    ctrlEnd(_ctrlEnd),
+                    slot(_slot)
+            {
+            }
+
+            // Full slots have a control byte in 0..127
+            void skipEmpty()
+            {
+                while(ctrl<ctrlEnd && *ctrl<0) {
+                    ++ctrl;
+                    ++slot;
+                }
+            }
+
+            value_type &operator*()  const { return *slot; }
+            value_type *operator->() const { return  slot; }
+
+            iterator &operator++()
+            {
+                ++ctrl;
+                ++slot;
+                skipEmpty();
+                return *this;
+            }
+
+            iterator operator++(int)
+            {
+                iterator old = *this;
+                ++(*this);
+                return old;
+            }
+
+            bool operator==(const iterator &o) const { return ctrl==o.ctrl; }
+            bool operator!=(const iterator &o) const { return ctrl!=o.ctrl; }
+        };
+
+        SwissMap()
+            :   ctrl(0),
+                slots(0),
+                nbGroups(0),
+                nbEntries(0),
+                growthLeft(0)
+        {
+        }
+
+        ~SwissMap()
+        {
+            clear();
+        }
+
+        size_t size() const { return nbEntries; }
+
+        iterator begin()
+        {
+            iterator i(ctrl, ctrl + capacity(), slots);
+            i.skipEmpty();
+            return i;
+        }
+
+        iterator end()
+        {
+            int8_t *e = ctrl + capacity();
+            return iterator(e, e, slots + capacity());
+        }
+
+        iterator find(
+            const Key &key
+        )
+        {
+            size_t i = findIndex(key, hashOf(key));
+            if(kNotFound==i) return end();
+            return iterator(ctrl + i, ctrl + capacity(), slots + i);
+        }
+
+        Value &operator[](
+            const Key &key
+        )
+        {
+            uint64_t h = hashOf(key);
+            size_t i = findIndex(key, h);
+            if(likely(kNotFound!=i)) return slots[i].second;
+
+            if(unlikely(0==growthLeft)) {
+                // Mostly tombstones: sweep them, else grow
+                bool sweep = (0<nbGroups && nbEntries<=(capacity()*7)/16);
+                rehash(sweep ? nbGroups : (nbGroups ? 2*nbGroups : 1));
+            }
+
+            i = findFree(h);
+            if(kEmpty==ctrl[i]) --growthLeft;
+            ctrl[i] = (int8_t)(h & 0x7F);
+            new(slots + i) value_type(key, Value());
+            ++nbEntries;
+            return slots[i].second;
+        }
+
+        void erase(
+            iterator i
+        )
+        {
+            i.slot->~value_type();
+            *i.ctrl = kDeleted;
+            --nbEntries;
+        }
+
+        // Make room for n entries without growing
+        void resize(
+            size_t n
+        )
+        {
+            size_t needed = (8*n + 7*kGroupSize - 1) / (7*kGroupSize);
+            size_t groups = 1;
+            while(groups<needed) groups *= 2;
+            if(nbGroups<groups) rehash(groups);
+        }
+
+        void clear()
+        {
+            size_t n = capacity();
+            for(size_t i=0; i<n; ++i) {
+                if(0<=ctrl[i]) slots[i].~value_type();
+            }
+            free(ctrl);
+            free(slots);
+            ctrl = 0;
+            slots = 0;
+            nbGroups = nbEntries = growthLeft = 0;
+        }
+
+    private:
+        SwissMap(const SwissMap &);
+        SwissMap &operator=(const SwissMap &);
+
+        enum { kNotFound = ~(size_t)0 };
+
+        size_t capacity() const { return nbGroups*kGroupSize; }
+
+        static uint64_t hashOf(
+            const Key &key
+        )
+        {
+            // Hashers here return raw hash bytes, which are already random; the
+            // multiply just keeps simpler keys from clustering
+            uint64_t h = Hasher()(key) * 0x9E3779B97F4A7C15ULL;
+            return h ^ (h>>32);
+        }
+
+        // Bit i set when byte i of the group equals b
+        static uint32_t match(
+            const int8_t *group,
+            int8_t       b
+        )
+        {
+            #if defined(__SSE2__)
+                __m128i g = _mm_loadu_si128((const __m128i*)group);
+                return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8(b)));
+            #else
+                uint32_t m = 0;
+                for(int i=0; i<kGroupSize; ++i) m |= ((uint32_t)(b==group[i]))<<i;
+                return m;
+            #endif
+        }
+
+        // Bit i set when slot i of the group is empty or erased
+        static uint32_t matchFree(
+            const int8_t *group
+        )
+        {
+            #if defined(__SSE2__)
+                __m128i g = _mm_loadu_si128((const __m128i*)group);
+                return (uint32_t)_mm_movemask_epi8(_mm_cmplt_epi8(g, _mm_set1_epi8(-1)));
+            #else
+                uint32_t m = 0;
+                for(int i=0; i<kGroupSize; ++i) m |= ((uint32_t)(group[i]<-1))<<i;
+                return m;
+            #endif
+        }
+
+        size_t findIndex(
+            const Key &key,
+            uint64_t  h
+        ) const
+        {
+            if(unlikely(0==nbGroups)) return kNotFound;
+
+            size_t mask = nbGroups - 1;
+            size_t g = (h>>7) & mask;
+            size_t step = 0;
+            int8_t h2 = (int8_t)(h & 0x7F);
+            while(1) {
+                const int8_t *group = ctrl + g*kGroupSize;
+                uint32_t m = match(group, h2);
+                while(m) {
+                    size_t i = g*kGroupSize + __builtin_ctz(m);
+                    if(likely(Equal()(slots[i].first, key))) return i;
+                    m &= m - 1;
+                }
+                if(likely(0!=match(group, kEmpty))) return kNotFound;
+                g = (g + ++step) & mask;
+            }
+        }
+
+        size_t findFree(
+            uint64_t h
+        ) const
+        {
+            size_t mask = nbGroups - 1;
+            size_t g = (h>>7) & mask;
+            size_t step = 0;
+            while(1) {
+                uint32_t m = matchFree(ctrl + g*kGroupSize);
+                if(likely(0!=m)) return g*kGroupSize + __builtin_ctz(m);
+                g = (g + ++step) & mask;
+            }
+        }
+
+        void rehash(
+            size_t newNbGroups
+        )
+        {
+            int8_t *oldCtrl = ctrl;
+            value_type *oldSlots = slots;
+            size_t oldCapacity = capacity();
+
+            size_t newCapacity = newNbGroups*kGroupSize;
+            ctrl = (int8_t*)malloc(newCapacity);
+            slots = (value_type*)malloc(newCapacity*sizeof(value_type));
+            if(!ctrl || !slots) errFatal("failed to allocate hash map with %" PRIu64 " slots", (uint64_t)newCapacity);
+            memset(ctrl, kEmpty, newCapacity);
+
+            nbGroups = newNbGroups;
+            growthLeft = (newCapacity*7)/8 - nbEntries;
+
+            for(size_t i=0; i<oldCapacity; ++i) {
+                if(oldCtrl[i]<0) continue;
+                uint64_t h = hashOf(oldSlots[i].first);
+                size_t j = findFree(h);
+                ctrl[j] = (int8_t)(h & 0x7F);
+                new(slots + j) value_type(oldSlots[i]);
+                oldSlots[i].~value_type();
+            }
+
+            free(oldCtrl);
+            free(oldSlots);
+        }
+
+        int8_t     *ctrl;
+        value_type *slots;
+        size_t     nbGroups;
+        size_t     nbEntries;
+        size_t     growthLeft;
+    };
+
+#endif // __HASHMAP_H__
+
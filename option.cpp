@@ -211,6 +211,11 @@ void OptionParser::handle_short_opt(const string& opt, const string& arg) {
 
 const Option& OptionParser::lookup_long_opt(const string& opt) const {
 
+  // Like Python's optparse: an exact match wins over longer options it abbreviates
+  optMap::const_iterator exact = _optmap_l.find(opt);
+  if (exact != _optmap_l.end())
+    return *exact->second;
+
   list<string> matching;
   for (optMap::const_iterator it = _optmap_l.begin(); it != _optmap_l.end(); ++it) {
     if (it->first.compare(0, opt.length(), opt) == 0)
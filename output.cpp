@@ -0,0 +1,334 @@
+#include <util.h>
+#include <errlog.h>
+#include <output.h>
+
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <condition_variable>
+
+// One background thread does the write() calls for all streams. It is created
+// lazily, and along with its queue never destroyed: callbacks exit() from wrapup
+// while it is still parked on its condition variable.
+struct FlushJob
+{
+    OutputStream *stream;
+    const char   *data;
+    size_t       size;
+};
+
+struct Flusher
+{
+    std::mutex mutex;
+    std::condition_variable work;
+    std::condition_variable done;
+    std::deque<FlushJob> jobs;
+};
+
+static Flusher *gFlusher = 0;
+
+static void writeAll(
+    int        fd,
+    const char *data,
+    size_t     size,
+    const char *name
+)
+{
+    while(0<size) {
+        ssize_t r = write(fd, data, size);
+        if(r<0) {
+            if(EINTR==errno) continue;
+            sysErrFatal("failed to write to %s", name);
+        }
+        data += r;
+        size -= r;
+    }
+}
+
+static void flushLoop()
+{
+    std::unique_lock<std::mutex> lock(gFlusher->mutex);
+    while(1) {
+
+        gFlusher->work.wait(lock, [] { return !gFlusher->jobs.empty(); });
+        FlushJob job = gFlusher->jobs.front();
+        gFlusher->jobs.pop_front();
+
+        lock.unlock();
+            writeAll(job.stream->fd, job.data, job.size, job.stream->name.c_str());
+        lock.lock();
+
+        job.stream->inFlight = false;
+        gFlusher->done.notify_all();
+    }
+}
+
+static Flusher *getFlusher()
+{
+    if(unlikely(0==gFlusher)) {
+        gFlusher = new Flusher;
+        std::thread(flushLoop).detach();
+    }
+    return gFlusher;
+}
+
+OutputStream::OutputStream()
+    :   fd(-1),
+        inFlight(false),
+        cur(0),
+        end(0),
+        current(0),
+        ownsFd(false)
+{
+    buffers[0] = buffers[1] = 0;
+}
+
+void OutputStream::attach(
+    int        _fd,
+    const char *_name
+)
+{
+    // Anything stdio still holds for this fd must go out first
+    fflush(0);
+
+    fd = _fd;
+    name = _name;
+    ownsFd = false;
+    inFlight = false;
+
+    for(int i=0; i<2; ++i) {
+        buffers[i] = (char*)malloc(kBufferSize);
+        if(!buffers[i]) errFatal("failed to allocate output buffer for %s", _name);
+    }
+
+    current = 0;
+    cur = buffers[current];
+    end = cur + kBufferSize;
+    getFlusher();
+}
+
+void OutputStream::open(
+    const char *fileName
+)
+{
+    int f = ::open(fileName, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(f<0) sysErrFatal("couldn't open file %s for writing", fileName);
+    attach(f, fileName);
+    ownsFd = true;
+}
+
+void OutputStream::submit()
+{
+    size_t size = cur - buffers[current];
+    if(0==size) return;
+
+    std::unique_lock<std::mutex> lock(gFlusher->mutex);
+        gFlusher->done.wait(lock, [this] { return !inFlight; });
+        inFlight = true;
+        gFlusher->jobs.push_back(FlushJob{ this, buffers[current], size });
+        gFlusher->work.notify_one();
+    lock.unlock();
+
+    current ^= 1;
+    cur = buffers[current];
+    end = cur + kBufferSize;
+}
+
+void OutputStream::spill()
+{
+    if(unlikely(0==buffers[current])) errFatal("write to an output stream that is not open");
+    submit();
+}
+
+void OutputStream::flush()
+{
+    if(0==buffers[current]) return;
+    submit();
+
+    std::unique_lock<std::mutex> lock(gFlusher->mutex);
+    gFlusher->done.wait(lock, [this] { return !inFlight; });
+}
+
+void OutputStream::close()
+{
+    if(0==buffers[current]) return;
+    flush();
+
+    if(ownsFd && ::close(fd)<0) sysErrFatal("failed to close %s", name.c_str());
+
+    free(buffers[0]);
+    free(buffers[1]);
+    buffers[0] = buffers[1] = 0;
+    cur = end = 0;
+    fd = -1;
+}
+
+void OutputStream::putSlow(
+    const void *data,
+    size_t     size
+)
+{
+    const char *p = (const char*)data;
+    while(0<size) {
+        if(end==cur) spill();
+        size_t n = end - cur;
+        if(size<n) n = size;
+        memcpy(cur, p, n);
+        cur += n;
+        p += n;
+        size -= n;
+    }
+}
+
+static const char digitPairs[] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899"
+;
+
+// Writes v right-aligned so that the last digit lands at e[-1], returns the first digit
+static inline char *formatU64(
+    char     *e,
+    uint64_t v
+)
+{
+    while(100<=v) {
+        uint64_t q = v / 100;
+        const char *d = digitPairs + 2*(v - 100*q);
+        *(--e) = d[1];
+        *(--e) = d[0];
+        v = q;
+    }
+    if(10<=v) {
+        const char *d = digitPairs + 2*v;
+        *(--e) = d[1];
+        *(--e) = d[0];
+    } else {
+        *(--e) = '0' + v;
+    }
+    return e;
+}
+
+static inline void pad(
+    char *&s,
+    char *e,
+    int  width
+)
+{
+    while((e-s)<width) *(--s) = ' ';
+}
+
+void OutputStream::putU64(
+    uint64_t v,
+    int      width
+)
+{
+    char buf[64];
+    char *e = buf + sizeof(buf);
+    char *s = formatU64(e, v);
+    if(unlikely((int)sizeof(buf)<width)) width = sizeof(buf);
+    pad(s, e, width);
+    put(s, e-s);
+}
+
+void OutputStream::putI64(
+    int64_t v,
+    int     width
+)
+{
+    char buf[64];
+    char *e = buf + sizeof(buf);
+    char *s = formatU64(e, v<0 ? -(uint64_t)v : v);
+    if(v<0) *(--s) = '-';
+    if(unlikely((int)sizeof(buf)<width)) width = sizeof(buf);
+    pad(s, e, width);
+    put(s, e-s);
+}
+
+void OutputStream::putAmount(
+    uint64_t satoshis,
+    bool     negative,
+    int      width
+)
+{
+    char buf[64];
+    char *e = buf + sizeof(buf);
+
+    uint64_t coins = satoshis / 100000000;
+    uint64_t frac = satoshis - 100000000*coins;
+
+    char *s = e - 8;
+    char *f = formatU64(e, frac);
+    while(s<f) *(--f) = '0';
+
+    *(--s) = '.';
+    s = formatU64(s, coins);
+    if(negative) *(--s) = '-';
+
+    if(unlikely((int)sizeof(buf)<width)) width = sizeof(buf);
+    pad(s, e, width);
+    put(s, e-s);
+}
+
+void OutputStream::putHex(
+    const uint8_t *src,
+    size_t        size,
+    bool          rev
+)
+{
+    while(0<size) {
+
+        size_t chunk = size;
+        if(kBufferSize/2<chunk) chunk = kBufferSize/2;
+
+        char *dst = reserve(2*chunk);
+        const uint8_t *p = rev ? (src + size - chunk) : src;
+        hexEncode((uint8_t*)dst, p, chunk, rev);
+        commit(dst + 2*chunk);
+
+        if(!rev) src += chunk;
+        size -= chunk;
+    }
+}
+
+void OutputStream::format(
+    const char *fmt,
+    ...
+)
+{
+    va_list vaList;
+    va_start(vaList, fmt);
+
+        va_list retry;
+        va_copy(retry, vaList);
+
+        size_t room = end - cur;
+        int n = vsnprintf(cur, room, fmt, vaList);
+        if(n<0) errFatal("failed to format output for %s", name.c_str());
+
+        if((size_t)n<room) {
+            cur += n;
+        } else {
+            char *tmp = (char*)malloc(n + 1);
+            if(!tmp) errFatal("failed to allocate output buffer for %s", name.c_str());
+            vsnprintf(tmp, n + 1, fmt, retry);
+            put(tmp, n);
+            free(tmp);
+        }
+
+        va_end(retry);
+
+    va_end(vaList);
+}
+
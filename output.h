@@ -0,0 +1,98 @@
+#ifndef __OUTPUT_H__
+    #define __OUTPUT_H__
+
+    #include <string>
+    #include <string.h>
+    #include <common.h>
+    #include <sha256.h>
+
+    // Buffered output stream shared by the dump commands.
+    //
+    // Formatting happens on the caller's thread, straight into a large in-memory
+    // buffer. Full buffers are handed to a background thread that does the write()
+    // calls. Each stream owns two buffers, so the caller only ever waits when it
+    // fills one before the other has made it to disk. There is no stdio involved
+    // and no locking on the put path.
+    //
+    // Streams must be close()d (or at least flush()ed) before the process exits.
+
+    struct OutputStream
+    {
+        enum { kBufferSize = 4 * 1024 * 1024 };
+
+        OutputStream();
+
+        void open(const char *fileName);            // create/truncate fileName
+        void attach(int fd, const char *name);      // write to an already open fd, e.g. stdout
+        void flush();                               // push everything to the fd and wait for it
+        void close();
+
+        void put(char c)
+        {
+            if(unlikely(end==cur)) spill();
+            *(cur++) = c;
+        }
+
+        void put(
+            const void *data,
+            size_t     size
+        )
+        {
+            if(likely(size<=(size_t)(end-cur))) {
+                memcpy(cur, data, size);
+                cur += size;
+            } else {
+                putSlow(data, size);
+            }
+        }
+
+        void put(const char        *s) { put(s, strlen(s));         }
+        void put(const std::string &s) { put(s.data(), s.size());   }
+
+        // Decimal, right-aligned in width columns like printf("%<width>" PRIu64)
+        void putU64(uint64_t v, int width = 0);
+        void putI64(int64_t  v, int width = 0);
+
+        // Fixed point BTC amount, exactly like printf("%<width>.8f", 1e-8*satoshis),
+        // minus the float rounding. negative lets callers reproduce "-0.00000000".
+        void putAmount(uint64_t satoshis, bool negative, int width = 0);
+        void putAmount(int64_t satoshis, int width = 0) { putAmount(satoshis<0 ? -(uint64_t)satoshis : satoshis, satoshis<0, width); }
+
+        // Same output as toHex(), straight into the stream buffer
+        void putHex(
+            const uint8_t *src,
+            size_t        size = kSHA256ByteSize,
+            bool          rev = true
+        );
+
+        // printf-style escape hatch for the odd float/long double column
+        void format(const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+        // Make sure at least size bytes are available at cur; size<=kBufferSize
+        char *reserve(size_t size)
+        {
+            if(unlikely((size_t)(end-cur)<size)) spill();
+            return cur;
+        }
+
+        void commit(char *newCur) { cur = newCur; }
+
+        // Internal, used by the flush thread
+        int fd;
+        bool inFlight;
+        std::string name;
+
+    private:
+        void spill();
+        void submit();
+        void putSlow(const void *data, size_t size);
+
+        char *cur;
+        char *end;
+        char *buffers[2];
+        int current;
+        bool ownsFd;
+    };
+
+#endif // __OUTPUT_H__
+
@@ -2,31 +2,57 @@
 #include <util.h>
 #include <common.h>
 #include <errlog.h>
+#include <archive.h>
 #include <callback.h>
 
+#include <map>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
+#include <errno.h>
 #include <fcntl.h>
+#include <signal.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <algorithm>
+#include <unordered_map>
+#include <condition_variable>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <sys/types.h>
 
 #if !defined(O_DIRECT)
 #   define O_DIRECT 0
 #endif
 
+// A block chain source: a blk file, mapped in place, or a compressed one,
+// which is decompressed on the fly, once per pass (p stays 0)
 struct Map
 {
     int fd;
     uint64_t size;
+    uint64_t mapSize;
+    uint64_t xorKey;                // 0 when the source isn't obfuscated
+    bool compressed;
     const uint8_t *p;
     std::string name;
+
+    Map()
+        :   fd(-1),
+            size(0),
+            mapSize(0),
+            xorKey(0),
+            compressed(false),
+            p(0)
+    {
+    }
 };
 
-typedef GoogMap<Hash256, const uint8_t*, Hash256Hasher, Hash256Equal>::Map TXMap;
-typedef GoogMap<Hash256,         Block*, Hash256Hasher, Hash256Equal>::Map BlockMap;
+typedef Hash256Map<const uint8_t*>::Map TXMap;
+typedef Hash256Map<        Block*>::Map BlockMap;
 
 static bool gNeedTXHash;
 static Callback *gCallback;
@@ -34,10 +60,34 @@ static Callback *gCallback;
 static const Map *gCurMap;
 static std::vector<Map> mapVec;
 
+struct Archive
+{
+    const ArchiveMeta *meta;
+    const uint8_t     *blockData;
+    const uint64_t    *blockOffsets;
+    const uint64_t    *blockFirstTX;
+    const uint64_t    *txOffsets;
+    const uint8_t     *txIds;
+    const uint64_t    *txFirstOutput;
+    const uint64_t    *outputOffsets;
+    const uint64_t    *outputValues;
+    const int8_t      *outputTypes;
+    const uint8_t     *outputHash160;
+    const uint64_t    *inputSpends;
+    uint64_t          txIndex;
+    uint64_t          inputIndex;
+};
+
 static TXMap gTXMap;
-static BlockMap gBlockMap;
+static Archive gArchive;
+static BlockMap gBlockMap(kMapRoleBlock);
 static uint8_t empty[kSHA256ByteSize] = { 0x42 };
 
+static bool gSourcesCopied;                 // some sources are obfuscated or compressed, see BlockCopy
+static std::vector<const Map*> gMappedSources;  // by address, when gSourcesCopied
+static bool gKeepOutputs;                   // the block being parsed comes from a compressed source
+static const uint8_t *gBlockInSource;       // where it is in its source, when obfuscated
+static const uint8_t *gBlockData;
 static Block *gMaxBlock;
 static Block *gNullBlock;
 static uint64_t gChainSize;
@@ -56,6 +106,8 @@ static uint256_t gNullHash;
     static inline void startOutputs(const uint8_t *p)                      { DO(gCallback->startOutputs(p));  }
     static inline void   endOutputs(const uint8_t *p)                      { DO(gCallback->endOutputs(p));    }
     static inline void  startOutput(const uint8_t *p)                      { DO(gCallback->startOutput(p));   }
+    static inline void startWitnesses(const uint8_t *p)                    { DO(gCallback->startWitnesses(p));}
+    static inline void   endWitnesses(const uint8_t *p)                    { DO(gCallback->endWitnesses(p));  }
     static inline void        start(const Block *s, const Block *e)        { DO(gCallback->start(s, e));      }
 #undef DO
 
@@ -83,6 +135,23 @@ static inline void endOutput(
     );
 }
 
+static inline void witnessItem(
+    const uint8_t *txHash,
+    uint64_t      inputIndex,
+    uint64_t      itemIndex,
+    const uint8_t *item,
+    uint64_t      itemSize
+)
+{
+    gCallback->witnessItem(
+        txHash,
+        inputIndex,
+        itemIndex,
+        item,
+        itemSize
+    );
+}
+
 static inline void edge(
     uint64_t      value,
     const uint8_t *upTXHash,
@@ -108,22 +177,549 @@ static inline void edge(
     );
 }
 
-template<
-    bool skip,
-    bool fullContext
->
-static void parseOutput(
-    const uint8_t *&p,
-    const uint8_t *txHash,
-    uint64_t      outputIndex,
+static const uint32_t kBlockMagic =
+    #if defined(LITECOIN)
+        0xdbb6c0fb
+    #else
+        0xd9b4bef9
+    #endif
+;
+
+// dst = src de-obfuscated, src being size bytes found at offset in a source
+// obfuscated with key. dst may be src.
+static void deObfuscate(
+    uint8_t       *dst,
+    const uint8_t *src,
+    size_t        size,
+    uint64_t      offset,
+    uint64_t      key
+)
+{
+    if(likely(0==key)) {
+        if(dst!=src) memcpy(dst, src, size);
+        return;
+    }
+
+    // Byte i of a blk file is xored with byte i%8 of the key : rotate it to line up with src[0]
+    uint32_t shift = 8*(offset & 7);
+    uint64_t k = shift ? ((key>>shift) | (key<<(64 - shift))) : key;
+
+    // Bulk of the work: 64 bit words, simple enough for the compiler to vectorize
+    size_t i = 0;
+    for(; likely(i + 8<=size); i += 8) {
+        uint64_t w;
+        memcpy(&w, src + i, sizeof(w));
+        w ^= k;
+        memcpy(dst + i, &w, sizeof(w));
+    }
+
+    for(; i<size; ++i) dst[i] = src[i] ^ (uint8_t)(k >> (8*(i & 7)));
+}
+
+// Magic, size and header of a block whose bytes can't be used in place,
+// because its source is obfuscated or compressed. Block::data points into
+// the copy, except while the block is being parsed: its bytes are then
+// fetched again, whole and de-obfuscated, into a buffer reused from one
+// block to the next.
+//
+// Inputs find the outputs they spend through gTXMap. For mapped sources,
+// obfuscated or not, it points into the map, and outputs of obfuscated ones
+// get de-obfuscated again into gClearOutputArena when spent. Compressed
+// sources can't be read back: their TXs' outputs are copied into
+// gKeptOutputArena, and recycled once every one of them has been spent.
+struct BlockCopy
+{
+    uint64_t offset;                // of the magic, in the source
+    uint64_t source;                // index in mapVec
+    uint8_t  bytes[8 + 80];
+
+    uint64_t size() const
+    {
+        const uint8_t *p = 4 + bytes;
+        LOAD(uint32_t, size, p);
+        return 8 + size;
+    }
+};
+
+static Arena<BlockCopy> gBlockCopyArena("headers");
+static ByteArena gKeptOutputArena("txOutputs");
+static ByteArena gClearOutputArena("spent", 8 * 1024 * 1024);
+static std::vector<uint8_t*> gSpentCopies;                  // kept outputs to recycle at the end of the block
+static std::vector<uint8_t> gBlockBuffer;
+static std::vector<std::vector<BlockCopy>> gStreamCopies;   // by source, from the first read of compressed ones
+
+// A compressed source, as decompressed by a zstd process, read front to back
+struct ZstdStream
+{
+    enum { kBufferSize = 4 * 1024 * 1024 };
+
+    const Map *map;
+    uint64_t  offset;               // in the decompressed source, of the next byte read
+    int       fd;
+    pid_t     pid;
+    size_t    cur;
+    size_t    end;
+    std::vector<uint8_t> buffer;
+
+    void open(
+        const Map &m
+    )
+    {
+        map = &m;
+        offset = cur = end = 0;
+        buffer.resize(kBufferSize);
+
+        // Close on exec: other threads fork zstd processes too, those must not hold on to this pipe
+        int fds[2];
+        int r = pipe2(fds, O_CLOEXEC);
+        if(r<0) sysErrFatal("failed to create pipe for %s", map->name.c_str());
+
+        pid = fork();
+        if(pid<0) sysErrFatal("failed to fork decompressor for %s", map->name.c_str());
+        if(0==pid) {
+            dup2(fds[1], 1);
+            execlp("zstd", "zstd", "-d", "-c", "-q", "--", map->name.c_str(), (char*)0);
+            _exit(127);
+        }
+
+        ::close(fds[1]);
+        fd = fds[0];
+    }
+
+    bool fill()
+    {
+        while(1) {
+            ssize_t r = ::read(fd, &buffer[0], buffer.size());
+            if(r<0) {
+                if(EINTR==errno) continue;
+                sysErrFatal("failed to read decompressed block chain file %s", map->name.c_str());
+            }
+            cur = 0;
+            end = r;
+            return 0<r;
+        }
+    }
+
+    // Next size bytes, into dst unless it's 0; false when the source ends first
+    bool read(
+        uint8_t  *dst,
+        uint64_t size
+    )
+    {
+        while(0<size) {
+            if(unlikely(cur==end) && !fill()) return false;
+
+            size_t n = std::min(size, (uint64_t)(end - cur));
+            if(dst) {
+                memcpy(dst, &buffer[cur], n);
+                dst += n;
+            }
+            cur += n;
+            offset += n;
+            size -= n;
+        }
+        return true;
+    }
+
+    bool skip(uint64_t size) { return read(0, size); }
+
+    // Either read through to the end and make sure zstd succeeded, or just stop it
+    void close(
+        bool drain
+    )
+    {
+        if(drain) {
+            offset += end - cur;
+            while(fill()) offset += end;
+        }
+
+        ::close(fd);
+        if(!drain) kill(pid, SIGTERM);
+
+        int status;
+        waitpid(pid, &status, 0);
+        if(drain && (!WIFEXITED(status) || 0!=WEXITSTATUS(status)))
+            errFatal("failed to decompress block chain file %s", map->name.c_str());
+    }
+};
+
+// Longest chain blocks of compressed sources, handed over in chain order.
+// Each source is decompressed once more, front to back, by a feeder thread
+// of its own, in the order the chain first needs something from it: the
+// source being parsed, plus the next few ahead of it. Core stores blocks in
+// about the order it downloaded them, so a few come up ahead of their turn :
+// those, and whatever feeders read ahead, wait in memory until then. Feeders
+// stop reading ahead past kMaxParkedBytes, except the one the parser waits on.
+struct ChainStream
+{
+    enum { kMaxParkedBytes = 256 * 1024 * 1024 };
+
+    struct Feed
+    {
+        uint64_t source;
+        std::vector<const BlockCopy*> blocks;               // by offset
+        bool started;
+        std::thread thread;
+    };
+
+    std::vector<Feed> feeds;                                // in the order the chain first needs them
+    std::vector<size_t> feedOf;                             // by source
+    std::unordered_map<const BlockCopy*, uint8_t*> parked;
+    std::mutex mutex;
+    std::condition_variable changed;
+    uint64_t waitingFor;                                    // source the parser waits on, ~0 when none
+    uint64_t parkedBytes;
+    uint64_t maxParkedBytes;
+    size_t nbAhead;
+
+    void start(
+        const Block *first
+    )
+    {
+        feedOf.assign(mapVec.size(), ~(size_t)0);
+        for(const Block *b=first; 0!=b; b=b->next) {
+            const BlockCopy *copy = b->copy;
+            if(0==copy || !mapVec[copy->source].compressed) continue;
+
+            size_t &f = feedOf[copy->source];
+            if(~(size_t)0==f) {
+                f = feeds.size();
+                feeds.push_back(Feed());
+                feeds.back().source = copy->source;
+                feeds.back().started = false;
+            }
+            feeds[f].blocks.push_back(copy);
+        }
+
+        for(auto &feed:feeds) {
+            std::sort(
+                feed.blocks.begin(),
+                feed.blocks.end(),
+                [](const BlockCopy *a, const BlockCopy *b) { return a->offset<b->offset; }
+            );
+        }
+
+        nbAhead = std::thread::hardware_concurrency();
+        if(0==nbAhead) nbAhead = 1;
+
+        waitingFor = ~(uint64_t)0;
+        parkedBytes = maxParkedBytes = 0;
+    }
+
+    // Bytes of copy, valid until release
+    const uint8_t *fetch(
+        const BlockCopy *copy
+    )
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        size_t f = feedOf[copy->source];
+        size_t e = std::min(feeds.size(), f + 1 + nbAhead);
+        for(size_t i=f; i<e; ++i) {
+            Feed &feed = feeds[i];
+            if(feed.started) continue;
+            feed.started = true;
+            feed.thread = std::thread(&ChainStream::feed, this, i);
+        }
+
+        while(1) {
+            auto i = parked.find(copy);
+            if(parked.end()!=i) {
+                waitingFor = ~(uint64_t)0;
+                return i->second;
+            }
+            waitingFor = copy->source;
+            changed.notify_all();
+            changed.wait(lock);
+        }
+    }
+
+    void release(
+        const BlockCopy *copy
+    )
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        auto i = parked.find(copy);
+        if(unlikely(parked.end()==i)) return;
+
+        parkedBytes -= copy->size();
+        free(i->second);
+        parked.erase(i);
+        changed.notify_all();
+    }
+
+    // Feeder thread: the longest chain blocks of one source, in file order
+    void feed(
+        size_t f
+    )
+    {
+        const Feed &feed = feeds[f];
+        const Map &map = mapVec[feed.source];
+
+        ZstdStream stream;
+        stream.open(map);
+        for(const BlockCopy *c:feed.blocks) {
+
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                while(kMaxParkedBytes<=parkedBytes && waitingFor!=feed.source) changed.wait(lock);
+            }
+
+            uint64_t size = c->size();
+            uint8_t *dst = (uint8_t*)malloc(size);
+            if(0==dst) errFatal("failed to allocate %" PRIu64 " bytes for a block", size);
+
+            bool ok = stream.skip(c->offset - stream.offset) && stream.read(dst, size);
+            if(!ok) errFatal("block chain file %s changed while being parsed", map.name.c_str());
+            deObfuscate(dst, dst, size, c->offset, map.xorKey);
+
+            std::unique_lock<std::mutex> lock(mutex);
+            parked[c] = dst;
+            parkedBytes += size;
+            maxParkedBytes = std::max(maxParkedBytes, parkedBytes);
+            changed.notify_all();
+        }
+        stream.close(false);
+    }
+
+    void finish()
+    {
+        if(0==feeds.size()) return;
+        for(auto &feed:feeds) {
+            if(feed.started) feed.thread.join();
+        }
+        info(
+            "%.2f MB of blocks at most were read ahead of their turn in the chain",
+            maxParkedBytes*1e-6
+        );
+    }
+};
+
+static ChainStream gChainStream;
+
+// Bytes of a copied block, valid until releaseBlock
+static const uint8_t *fetchBlock(
+    const BlockCopy *copy
+)
+{
+    const Map &map = mapVec[copy->source];
+    if(map.compressed) return gChainStream.fetch(copy);
+
+    uint64_t size = copy->size();
+    gBlockBuffer.resize(size);
+    deObfuscate(&gBlockBuffer[0], map.p + copy->offset, size, copy->offset, map.xorKey);
+    return &gBlockBuffer[0];
+}
+
+static void releaseBlock(
+    const BlockCopy *copy
+)
+{
+    if(mapVec[copy->source].compressed) gChainStream.release(copy);
+}
+
+struct TXInput
+{
+    const uint8_t *start;
+    const uint8_t *script;
+    uint64_t      scriptSize;
+};
+
+struct TXOutput
+{
+    const uint8_t *start;
+    const uint8_t *script;
+    uint64_t      scriptSize;
+};
+
+struct TXWitnessItem
+{
+    uint64_t      inputIndex;
+    uint64_t      itemIndex;
+    const uint8_t *item;
+    uint64_t      itemSize;
+};
+
+// Where everything of interest lives in a TX. Filled by a single scan, then
+// used by both hashing and callback dispatch. Reused from one TX to the next.
+struct TXLayout
+{
+    const uint8_t *inputs;
+    const uint8_t *outputs;
+    const uint8_t *witnesses;
+    const uint8_t *lockTime;
+    const uint8_t *end;
+    std::vector<TXInput> in;
+    std::vector<TXOutput> out;
+    std::vector<TXWitnessItem> witnessItems;
+};
+
+static TXLayout gTXLayout;
+
+static bool isSegWit(
+    const uint8_t *p    // Points just past the TX version
+)
+{
+    // BIP144 marker (a zero input count) followed by a non-zero flag
+    return (0==p[0] && 0!=p[1]);
+}
+
+static const uint8_t *scanInputs(
+    const uint8_t *p,
+    TXLayout      &tx
+)
+{
+    tx.inputs = p;
+    LOAD_VARINT(nbInputs, p);
+    tx.in.resize(nbInputs);
+    for(uint64_t inputIndex=0; inputIndex<nbInputs; ++inputIndex) {
+        TXInput &input = tx.in[inputIndex];
+        input.start = p;
+        SKIP(uint256_t, upTXHash, p);
+        SKIP(uint32_t, upOutputIndex, p);
+        LOAD_VARINT(inputScriptSize, p);
+        input.script = p;
+        input.scriptSize = inputScriptSize;
+        p += inputScriptSize;
+        SKIP(uint32_t, sequence, p);
+    }
+    return p;
+}
+
+static void scanTail(
+    const uint8_t *p,
+    bool          segWit,
+    TXLayout      &tx
+)
+{
+    tx.witnesses = 0;
+    tx.witnessItems.resize(0);
+    if(unlikely(segWit)) {
+        tx.witnesses = p;
+        uint64_t nbInputs = tx.in.size();
+        for(uint64_t inputIndex=0; inputIndex<nbInputs; ++inputIndex) {
+            LOAD_VARINT(nbItems, p);
+            for(uint64_t itemIndex=0; itemIndex<nbItems; ++itemIndex) {
+                LOAD_VARINT(itemSize, p);
+                TXWitnessItem item;
+                item.inputIndex = inputIndex;
+                item.itemIndex = itemIndex;
+                item.item = p;
+                item.itemSize = itemSize;
+                tx.witnessItems.push_back(item);
+                p += itemSize;
+            }
+        }
+    }
+
+    tx.lockTime = p;
+    SKIP(uint32_t, lockTime, p);
+    tx.end = p;
+}
+
+static void scanTX(
+    const uint8_t *p,
+    TXLayout      &tx
+)
+{
+    SKIP(uint32_t, version, p);
+
+    bool segWit = isSegWit(p);
+    if(unlikely(segWit)) p += 2;
+
+    p = scanInputs(p, tx);
+
+    tx.outputs = p;
+    LOAD_VARINT(nbOutputs, p);
+    tx.out.resize(nbOutputs);
+    for(uint64_t outputIndex=0; outputIndex<nbOutputs; ++outputIndex) {
+        TXOutput &output = tx.out[outputIndex];
+        output.start = p;
+        SKIP(uint64_t, value, p);
+        LOAD_VARINT(outputScriptSize, p);
+        output.script = p;
+        output.scriptSize = outputScriptSize;
+        p += outputScriptSize;
+    }
+
+    scanTail(p, segWit, tx);
+}
+
+// Same as scanTX, for the next TX of an archive: where it starts and where its outputs are
+// come from the archive's columns, only inputs and witnesses are still walked
+static const uint8_t *scanArchiveTX(
+    TXLayout &tx
+)
+{
+    uint64_t txIndex = gArchive.txIndex;
+    const uint8_t *txStart = gArchive.blockData + gArchive.txOffsets[txIndex];
+    const uint8_t *p = txStart;
+    SKIP(uint32_t, version, p);
+
+    bool segWit = isSegWit(p);
+    if(unlikely(segWit)) p += 2;
+
+    tx.outputs = scanInputs(p, tx);
+
+    uint64_t firstOutput = gArchive.txFirstOutput[txIndex];
+    uint64_t nbOutputs = gArchive.txFirstOutput[1 + txIndex] - firstOutput;
+    p = tx.outputs;
+    loadVarInt(p);
+
+    tx.out.resize(nbOutputs);
+    for(uint64_t outputIndex=0; outputIndex<nbOutputs; ++outputIndex) {
+        TXOutput &output = tx.out[outputIndex];
+        p = output.start = gArchive.blockData + gArchive.outputOffsets[firstOutput + outputIndex];
+        SKIP(uint64_t, value, p);
+        LOAD_VARINT(outputScriptSize, p);
+        output.script = p;
+        output.scriptSize = outputScriptSize;
+        p += outputScriptSize;
+    }
+
+    scanTail(p, segWit, tx);
+    return txStart;
+}
+
+static void hashTX(
+    uint8_t        *txHash,
+    const uint8_t  *txStart,
+    const TXLayout &tx
+)
+{
+    if(likely(0==tx.witnesses)) {
+        sha256Twice(txHash, txStart, tx.end - txStart);
+        return;
+    }
+
+    // The txid of a segwit TX leaves out marker, flag and witnesses : stream version, inputs+outputs and lockTime
+    const uint8_t *segments[] = {
+        txStart,
+        tx.inputs,
+        tx.lockTime
+    };
+    const size_t lens[] = {
+        4,
+        (size_t)(tx.witnesses - tx.inputs),
+        4
+    };
+    sha256Segments(txHash, segments, lens, 3);
+    sha256(txHash, txHash, kSHA256ByteSize);
+}
+
+static void parseUpstreamOutputs(
+    const uint8_t *p,
+    const uint8_t *upTXHash,
+    uint64_t      upOutputIndex,
     const uint8_t *downTXHash,
     uint64_t      downInputIndex,
     const uint8_t *downInputScript,
-    uint64_t      downInputScriptSize,
-    bool          found = false
+    uint64_t      downInputScriptSize
 )
 {
-    if(!skip && !fullContext) startOutput(p);
+    LOAD_VARINT(nbOutputs, p);
+    for(uint64_t outputIndex=0; outputIndex<nbOutputs; ++outputIndex) {
 
         LOAD(uint64_t, value, p);
         LOAD_VARINT(outputScriptSize, p);
@@ -131,10 +727,10 @@ static void parseOutput(
         const uint8_t *outputScript = p;
         p += outputScriptSize;
 
-        if(!skip && fullContext && found) {
+        if(upOutputIndex==outputIndex) {
             edge(
                 value,
-                txHash,
+                upTXHash,
                 outputIndex,
                 outputScript,
                 outputScriptSize,
@@ -143,156 +739,321 @@ static void parseOutput(
                 downInputScript,
                 downInputScriptSize
             );
+            break;
         }
-
-    if(!skip && !fullContext) {
-        endOutput(
-            p,
-            value,
-            txHash,
-            outputIndex,
-            outputScript,
-            outputScriptSize
-        );
     }
 }
 
-template<
-    bool skip,
-    bool fullContext
->
-static void parseOutputs(
-    const uint8_t *&p,
-    const uint8_t *txHash,
-    uint64_t      stopAtIndex = -1,
-    const uint8_t *downTXHash = 0,
-    uint64_t      downInputIndex = 0,
-    const uint8_t *downInputScript = 0,
-    uint64_t      downInputScriptSize = 0
+// Mapped source p points into, 0 when it points into a kept copy of outputs
+static const Map *sourceOf(
+    const uint8_t *p
 )
 {
-    if(!skip && !fullContext) startOutputs(p);
+    auto i = std::upper_bound(
+        gMappedSources.begin(),
+        gMappedSources.end(),
+        p,
+        [](const uint8_t *q, const Map *m) { return q<m->p; }
+    );
+    if(gMappedSources.begin()==i) return 0;
 
-        LOAD_VARINT(nbOutputs, p);
-        for(uint64_t outputIndex=0; outputIndex<nbOutputs; ++outputIndex) {
-            bool found = fullContext && !skip && (stopAtIndex==outputIndex);
-            parseOutput<skip, fullContext>(
-                p,
-                txHash,
-                outputIndex,
-                downTXHash,
-                downInputIndex,
-                downInputScript,
-                downInputScriptSize,
-                found
-            );
-            if(found) break;
-        }
+    const Map *map = *(i - 1);
+    return (p<map->p + map->size) ? map : 0;
+}
 
-    if(!skip && !fullContext) endOutputs(p);
+// Outputs of a TX of an obfuscated source, de-obfuscated up to and including
+// output upOutputIndex. On the way there, only varints get de-obfuscated.
+static const uint8_t *clearOutputs(
+    const Map     *map,
+    const uint8_t *p,
+    uint64_t      upOutputIndex
+)
+{
+    uint64_t start = p - map->p;
+    uint64_t offset = start;
+    auto varInt = [&]() {
+        if(unlikely(map->size<=offset)) errFatal("upstream TX runs past the end of %s", map->name.c_str());
+
+        uint8_t buf[9];
+        size_t n = std::min<uint64_t>(sizeof(buf), map->size - offset);
+        deObfuscate(buf, map->p + offset, n, offset, map->xorKey);
+
+        const uint8_t *q = buf;
+        uint64_t v = loadVarInt(q);
+        offset += q - buf;
+        return v;
+    };
+
+    uint64_t nbOutputs = varInt();
+    for(uint64_t outputIndex=0; outputIndex<nbOutputs && outputIndex<=upOutputIndex; ++outputIndex) {
+        offset += sizeof(uint64_t);
+        offset += varInt();
+    }
+
+    size_t size = offset - start;
+    uint8_t *clear = gClearOutputArena.alloc(size);
+    deObfuscate(clear, p, size, start, map->xorKey);
+    return clear;
 }
 
-template<
-    bool skip
->
-static void parseInput(
-    const uint8_t *&p,
-    const uint8_t *txHash,
-    uint64_t      inputIndex
+// Kept outputs are preceded by their size and by how many of them are left to spend
+static void spendKeptOutput(
+    const uint8_t *outputs
 )
 {
-    if(!skip) startInput(p);
+    uint8_t *p = (uint8_t*)outputs - 2*sizeof(uint32_t);
+    uint32_t nbUnspent;
+    memcpy(&nbUnspent, p + sizeof(uint32_t), sizeof(nbUnspent));
+    if(unlikely(0==nbUnspent)) return;
+
+    --nbUnspent;
+    memcpy(p + sizeof(uint32_t), &nbUnspent, sizeof(nbUnspent));
+    if(0==nbUnspent) gSpentCopies.push_back(p);
+}
 
-        const uint8_t *upTXHash = p;
-        const uint8_t *upTXOutputs = 0;
+// Once the block is done with them: callbacks may hold pointers into those until endBlock.
+// gTXMap still points at recycled copies, but nothing can spend from them any more.
+static void recycleSpentOutputs()
+{
+    for(auto p:gSpentCopies) {
+        uint32_t size;
+        memcpy(&size, p, sizeof(size));
+        gKeptOutputArena.recycle(p, 2*sizeof(uint32_t) + size);
+    }
+    gSpentCopies.clear();
+    gClearOutputArena.reset();
+}
+
+static void parseInput(
+    const TXLayout &tx,
+    const uint8_t  *txHash,
+    uint64_t       inputIndex
+)
+{
+    const TXInput &input = tx.in[inputIndex];
+    const uint8_t *p = input.start;
+
+    startInput(p);
+
+        if(gArchive.meta) {
+
+            // Spends were resolved when the archive was built
+            uint64_t spend = gArchive.inputSpends[gArchive.inputIndex++];
+            if(gNeedTXHash && kArchiveNoSpend!=spend) {
+                const uint8_t *upTXHash = p;
+                SKIP(uint256_t, dummyUpTXhash, p);
+                LOAD(uint32_t, upOutputIndex, p);
+
+                const uint8_t *o = gArchive.blockData + gArchive.outputOffsets[spend];
+                SKIP(uint64_t, value, o);
+                LOAD_VARINT(outputScriptSize, o);
+                setSolvedOutput(o, gArchive.outputTypes[spend], gArchive.outputHash160 + kRIPEMD160ByteSize*spend);
+                edge(
+                    gArchive.outputValues[spend],
+                    upTXHash,
+                    upOutputIndex,
+                    o,
+                    outputScriptSize,
+                    txHash,
+                    inputIndex,
+                    input.script,
+                    input.scriptSize
+                );
+            }
 
-        if(gNeedTXHash && !skip) {
+        } else if(gNeedTXHash) {
+            const uint8_t *upTXHash = p;
             bool isGenTX = (0==memcmp(gNullHash.v, upTXHash, sizeof(gNullHash)));
             if(likely(false==isGenTX)) {
                 auto i = gTXMap.find(upTXHash);
                 if(unlikely(gTXMap.end()==i))
                     errFatal("failed to locate upstream TX");
-                upTXOutputs = i->second;
+
+                SKIP(uint256_t, dummyUpTXhash, p);
+                LOAD(uint32_t, upOutputIndex, p);
+
+                const uint8_t *outputs = i->second;
+                bool kept = false;
+                if(unlikely(gSourcesCopied)) {
+                    const Map *map = sourceOf(outputs);
+                    kept = (0==map);
+                    if(map && map->xorKey) outputs = clearOutputs(map, outputs, upOutputIndex);
+                }
+
+                parseUpstreamOutputs(
+                    outputs,
+                    upTXHash,
+                    upOutputIndex,
+                    txHash,
+                    inputIndex,
+                    input.script,
+                    input.scriptSize
+                );
+                if(unlikely(kept)) spendKeptOutput(outputs);
             }
         }
 
-        SKIP(uint256_t, dummyUpTXhash, p);
-        LOAD(uint32_t, upOutputIndex, p);
-        LOAD_VARINT(inputScriptSize, p);
+    endInput(input.script + input.scriptSize + sizeof(uint32_t));
+}
 
-        if(!skip && 0!=upTXOutputs) {
-            const uint8_t *inputScript = p;
-            parseOutputs<false, true>(
-                upTXOutputs,
-                upTXHash,
-                upOutputIndex,
+static void parseInputs(
+    const TXLayout &tx,
+    const uint8_t  *txHash
+)
+{
+    startInputs(tx.inputs);
+
+        uint64_t nbInputs = tx.in.size();
+        for(uint64_t inputIndex=0; inputIndex<nbInputs; ++inputIndex)
+            parseInput(tx, txHash, inputIndex);
+
+    endInputs(tx.outputs);
+}
+
+static void parseOutputs(
+    const TXLayout &tx,
+    const uint8_t  *txHash
+)
+{
+    startOutputs(tx.outputs);
+
+        uint64_t nbOutputs = tx.out.size();
+        uint64_t firstOutput = gArchive.meta ? gArchive.txFirstOutput[gArchive.txIndex - 1] : 0;
+        for(uint64_t outputIndex=0; outputIndex<nbOutputs; ++outputIndex) {
+
+            const TXOutput &output = tx.out[outputIndex];
+            const uint8_t *p = output.start;
+
+            if(gArchive.meta) {
+                uint64_t o = firstOutput + outputIndex;
+                setSolvedOutput(output.script, gArchive.outputTypes[o], gArchive.outputHash160 + kRIPEMD160ByteSize*o);
+            }
+
+            startOutput(p);
+            LOAD(uint64_t, value, p);
+            endOutput(
+                output.script + output.scriptSize,
+                value,
                 txHash,
-                inputIndex,
-                inputScript,
-                inputScriptSize
+                outputIndex,
+                output.script,
+                output.scriptSize
             );
         }
 
-        p += inputScriptSize;
-        SKIP(uint32_t, sequence, p);
-
-    if(!skip) endInput(p);
+    endOutputs(tx.witnesses ? tx.witnesses : tx.lockTime);
 }
 
-template<
-    bool skip
->
-static void parseInputs(
-    const uint8_t *&p,
-    const uint8_t *txHash
+static void parseWitnesses(
+    const TXLayout &tx,
+    const uint8_t  *txHash
 )
 {
-    if(!skip) startInputs(p);
+    if(likely(0==tx.witnesses)) return;
 
-        LOAD_VARINT(nbInputs, p);
-        for(uint64_t inputIndex=0; inputIndex<nbInputs; ++inputIndex)
-            parseInput<skip>(p, txHash, inputIndex);
+    startWitnesses(tx.witnesses);
 
-    if(!skip) endInputs(p);
+        auto e = tx.witnessItems.end();
+        auto i = tx.witnessItems.begin();
+        while(i!=e) {
+            const TXWitnessItem &item = *(i++);
+            witnessItem(
+                txHash,
+                item.inputIndex,
+                item.itemIndex,
+                item.item,
+                item.itemSize
+            );
+        }
+
+    endWitnesses(tx.lockTime);
+}
+
+// Copy of a TX's outputs, for the inputs that spend them to find once its block's bytes are gone,
+// see spendKeptOutput. 0 when none of them can ever be spent.
+static const uint8_t *keepOutputs(
+    const TXLayout &tx
+)
+{
+    uint32_t nbSpendable = 0;
+    for(const auto &output:tx.out) {
+        bool opReturn = (0<output.scriptSize && 0x6a==output.script[0]);
+        if(likely(!opReturn)) ++nbSpendable;
+    }
+    if(unlikely(0==nbSpendable)) return 0;
+
+    const uint8_t *e = tx.witnesses ? tx.witnesses : tx.lockTime;
+    uint32_t size = e - tx.outputs;
+    uint8_t *p = gKeptOutputArena.alloc(2*sizeof(uint32_t) + size);
+    memcpy(p, &size, sizeof(size));
+    memcpy(p + sizeof(uint32_t), &nbSpendable, sizeof(nbSpendable));
+    memcpy(p + 2*sizeof(uint32_t), tx.outputs, size);
+    return p + 2*sizeof(uint32_t);
+}
+
+// Where inputs that spend a TX will find its outputs
+static const uint8_t *upstreamOutputs(
+    const TXLayout &tx
+)
+{
+    if(unlikely(gKeepOutputs)) return keepOutputs(tx);
+    if(unlikely(0!=gBlockInSource)) return gBlockInSource + (tx.outputs - gBlockData);
+    return tx.outputs;
 }
 
-template<
-    bool skip
->
 static void parseTX(
     const uint8_t *&p
 )
 {
-    uint8_t *txHash = 0;
+    TXLayout &tx = gTXLayout;
     const uint8_t *txStart = p;
-
-    if(gNeedTXHash && !skip) {
-        const uint8_t *txEnd = p;
-        parseTX<true>(txEnd);
-        txHash = allocHash256();
-        sha256Twice(txHash, txStart, txEnd - txStart);
+    if(gArchive.meta) txStart = scanArchiveTX(tx);
+    else scanTX(txStart, tx);
+
+    const uint8_t *txHash = 0;
+    bool needTXMap = gNeedTXHash && 0==gArchive.meta;
+    if(gArchive.meta) {
+        txHash = gArchive.txIds + kSHA256ByteSize*(gArchive.txIndex++);
+    } else if(gNeedTXHash) {
+        uint8_t *h = allocHash256();
+        hashTX(h, txStart, tx);
+        txHash = h;
     }
 
-    if(!skip) startTX(p, txHash);
+    startTX(txStart, txHash);
 
-        SKIP(uint32_t, version, p);
+        parseInputs(tx, txHash);
 
-        parseInputs<skip>(p, txHash);
-
-        if(gNeedTXHash && !skip)
-            gTXMap[txHash] = p;
-
-        parseOutputs<skip, false>(p, txHash);
+        if(needTXMap) {
+            const uint8_t *outputs = upstreamOutputs(tx);
+            if(likely(0!=outputs)) gTXMap[txHash] = outputs;
+        }
 
-        SKIP(uint32_t, lockTime, p);
+        parseOutputs(tx, txHash);
+        parseWitnesses(tx, txHash);
 
-    if(!skip) endTX(p);
+    endTX(tx.end);
+    p = tx.end;
 }
 
 static void parseBlock(
-    const Block *block
+    Block *block
 )
 {
+    // Blocks that aren't used in place get their bytes back for as long as they're being parsed
+    const BlockCopy *copy = block->copy;
+    gKeepOutputs = false;
+    gBlockInSource = 0;
+    if(unlikely(0!=copy)) {
+        const Map &map = mapVec[copy->source];
+        block->data = 8 + fetchBlock(copy);
+        gKeepOutputs = map.compressed;
+        if(!map.compressed) {
+            gBlockInSource = map.p + copy->offset + 8;
+            gBlockData = block->data;
+        }
+    }
+
     startBlock(block);
 
         const uint8_t *p = block->data;
@@ -305,10 +1066,37 @@ static void parseBlock(
         SKIP(uint32_t, blkNonce, p);
 
         LOAD_VARINT(nbTX, p);
+        if(gArchive.meta) {
+            uint64_t b = block->height - 1;
+            nbTX = gArchive.blockFirstTX[1 + b] - gArchive.blockFirstTX[b];
+        }
+
         for(uint64_t txIndex=0; likely(txIndex<nbTX); ++txIndex)
-            parseTX<false>(p);
+            parseTX(p);
 
     endBlock(block);
+
+    if(unlikely(0!=copy)) {
+        releaseBlock(copy);
+        block->data = 8 + copy->bytes;
+    }
+    if(unlikely(gSourcesCopied)) recycleSpentOutputs();
+}
+
+// Mapped sources by address, for sourceOf to tell which bytes in gTXMap are
+// obfuscated, and which are kept copies
+static void indexSources()
+{
+    for(const auto &map:mapVec) {
+        if(map.xorKey || map.compressed) gSourcesCopied = true;
+        if(map.p) gMappedSources.push_back(&map);
+    }
+
+    std::sort(
+        gMappedSources.begin(),
+        gMappedSources.end(),
+        [](const Map *a, const Map *b) { return a->p<b->p; }
+    );
 }
 
 static void parseLongestChain()
@@ -316,10 +1104,13 @@ static void parseLongestChain()
     Block *blk = gNullBlock->next;
 
     start(blk, gMaxBlock);
+    indexSources();
+    gChainStream.start(blk);
     while(likely(0!=blk)) {
         parseBlock(blk);
         blk = blk->next;
     }
+    gChainStream.finish();
 }
 
 static void findLongestChain()
@@ -364,8 +1155,301 @@ static void initCallback(
     gNeedTXHash = gCallback->needTXHash();
 }
 
+static uint64_t loadXorKey(
+    const std::string &xorFileName,
+    bool              mustExist
+)
+{
+    int xorFD = open(xorFileName.c_str(), O_RDONLY);
+    if(xorFD<0) {
+        if(mustExist) sysErrFatal("failed to open xor key file %s", xorFileName.c_str());
+        return 0;
+    }
+
+    uint64_t key = 0;
+    ssize_t r = read(xorFD, &key, sizeof(key));
+    if(r!=sizeof(key)) sysErrFatal("failed to read xor key from %s", xorFileName.c_str());
+    close(xorFD);
+    return key;
+}
+
+// Key a source is obfuscated with, 0 if none. BLOCKPARSER_XOR, either the path
+// of an xor.dat or its 16 hex digits, applies to every source. Otherwise the
+// key is read from the xor.dat next to the source, when it has one.
+static uint64_t xorKeyFor(
+    const std::string &name,
+    bool              hasDir
+)
+{
+    static std::map<std::string, uint64_t> keys;   // by where they come from, each one announced once
+
+    std::string from;
+    const char *forced = getenv("BLOCKPARSER_XOR");
+    if(forced) {
+        from = forced;
+    } else if(hasDir) {
+        size_t slash = name.rfind('/');
+        from = (std::string::npos==slash ? std::string(".") : name.substr(0, slash)) + std::string("/xor.dat");
+    } else {
+        return 0;
+    }
+
+    auto i = keys.find(from);
+    if(keys.end()!=i) return i->second;
+
+    uint64_t key = 0;
+    uint8_t *k = (uint8_t*)&key;
+    bool isHex = (forced && 2*sizeof(key)==from.size() && fromHex(k, (const uint8_t*)forced, sizeof(key), false, false));
+    if(!isHex) key = loadXorKey(from, 0!=forced);
+
+    if(0!=key) {
+        uint8_t buf[2*sizeof(key) + 1];
+        toHex(buf, k, sizeof(key), false);
+        info("block chain files are obfuscated, xor key = %s, from %s", buf, isHex ? "BLOCKPARSER_XOR" : from.c_str());
+    }
+
+    keys[from] = key;
+    return key;
+}
+
+// Obfuscated maps are only ever read: blocks get de-obfuscated into copies, see BlockCopy
+static bool mapFile(
+    Map &map
+)
+{
+    int blockMapFD = open(map.name.c_str(), O_DIRECT | O_RDONLY);
+    if(blockMapFD<0) return false;
+
+    struct stat statBuf;
+    int r = fstat(blockMapFD, &statBuf);
+    if(r<0) sysErrFatal( "failed to fstat block chain file %s", map.name.c_str());
+
+    size_t mapSize = statBuf.st_size;
+    void *pMap = 0;
+    if(0<mapSize) pMap = mmap(0, mapSize, PROT_READ, MAP_PRIVATE, blockMapFD, 0);
+    if(((void*)-1)==pMap) {
+        sysErrFatal(
+            "failed to mmap block chain file %s",
+            map.name.c_str()
+        );
+    }
+
+    map.size = mapSize;
+    map.mapSize = mapSize;
+    map.fd = blockMapFD;
+    map.p = (const uint8_t*)pMap;
+    return true;
+}
+
+// Compressed sources are read through the zstd command, check it's there before going any further
+static void requireZstd(
+    const std::string &name
+)
+{
+    static bool found = false;
+    if(found) return;
+
+    const char *path = getenv("PATH");
+    std::string dirs(path ? path : "/usr/bin:/bin");
+    size_t start = 0;
+    while(!found && start<=dirs.size()) {
+        size_t colon = dirs.find(':', start);
+        if(std::string::npos==colon) colon = dirs.size();
+        std::string dir = dirs.substr(start, colon - start);
+        if(0==dir.size()) dir = ".";
+        found = (0==access((dir + std::string("/zstd")).c_str(), X_OK));
+        start = colon + 1;
+    }
+
+    if(!found) errFatal("reading %s needs the zstd command, which isn't in PATH (package zstd)", name.c_str());
+}
+
+// First read of a compressed source: magic, size and header of every block, the rest is skipped
+static void scanStream(
+    size_t source
+)
+{
+    Map &map = mapVec[source];
+    std::vector<BlockCopy> &copies = gStreamCopies[source];
+
+    ZstdStream stream;
+    stream.open(map);
+    while(1) {
+
+        BlockCopy copy;
+        copy.offset = stream.offset;
+        copy.source = source;
+        if(!stream.read(copy.bytes, 8)) break;
+        deObfuscate(copy.bytes, copy.bytes, 8, copy.offset, map.xorKey);
+
+        const uint8_t *p = copy.bytes;
+        LOAD(uint32_t, magic, p);
+        LOAD(uint32_t, size, p);
+        if(kBlockMagic!=magic || size<80) break;
+
+        bool ok = stream.read(8 + copy.bytes, 80) && stream.skip(size - 80);
+        if(!ok) break;
+
+        deObfuscate(8 + copy.bytes, 8 + copy.bytes, 80, 8 + copy.offset, map.xorKey);
+        copies.push_back(copy);
+    }
+
+    stream.close(true);
+    map.size = stream.offset;
+}
+
+static void scanStreams(
+    const std::vector<size_t> &pending
+)
+{
+    gStreamCopies.resize(mapVec.size());
+
+    // One zstd process per file, one reader thread per process, as many at a time as there are cores
+    size_t nbWorkers = std::thread::hardware_concurrency();
+    if(0==nbWorkers) nbWorkers = 1;
+
+    for(size_t i=0; i<pending.size(); i+=nbWorkers) {
+
+        std::vector<std::thread> threads;
+        size_t e = std::min(pending.size(), i + nbWorkers);
+        for(size_t j=i; j<e; ++j) threads.push_back(std::thread(scanStream, pending[j]));
+        for(auto &t:threads) t.join();
+    }
+}
+
+static bool isCompressed(
+    const std::string &name
+)
+{
+    size_t sz = name.size();
+    return 4<sz && 0==name.compare(sz-4, 4, ".zst");
+}
+
+static const void *archiveColumn(
+    int      column,
+    uint64_t nbItems,
+    size_t   itemSize
+)
+{
+    const Map &map = mapVec[column];
+    if(map.size!=nbItems*itemSize) errFatal("archive file %s has the wrong size", map.name.c_str());
+    return map.p;
+}
+
+static void mapArchive(
+    const std::string &dir
+)
+{
+    if(0!=mapVec.size()) errFatal("an archive must be the only block chain source");
+
+    for(int i=0; i<kArchiveNbColumns; ++i) {
+        Map map;
+        map.name = dir + "/" + archiveColumnName(i);
+        if(!mapFile(map)) sysErrFatal("failed to open archive file %s", map.name.c_str());
+        mapVec.push_back(map);
+    }
+
+    const ArchiveMeta *meta = (const ArchiveMeta *)archiveColumn(kArchiveMeta, 1, sizeof(ArchiveMeta));
+    if(kArchiveMagic!=meta->magic) errFatal("%s is not a blockparser archive", dir.c_str());
+    if(kArchiveVersion!=meta->version) errFatal("archive %s has unsupported version %d", dir.c_str(), (int)meta->version);
+
+    gArchive.blockData     =                   mapVec[kArchiveBlockData].p;
+    gArchive.blockOffsets  = (const uint64_t *)archiveColumn(kArchiveBlockOffsets,  meta->nbBlocks,    sizeof(uint64_t));
+    gArchive.blockFirstTX  = (const uint64_t *)archiveColumn(kArchiveBlockFirstTX,  meta->nbBlocks+1,  sizeof(uint64_t));
+    gArchive.txOffsets     = (const uint64_t *)archiveColumn(kArchiveTXOffsets,     meta->nbTX,        sizeof(uint64_t));
+    gArchive.txIds         = (const uint8_t  *)archiveColumn(kArchiveTXIds,         meta->nbTX,        kSHA256ByteSize);
+    gArchive.txFirstOutput = (const uint64_t *)archiveColumn(kArchiveTXFirstOutput, meta->nbTX+1,      sizeof(uint64_t));
+    gArchive.outputOffsets = (const uint64_t *)archiveColumn(kArchiveOutputOffsets, meta->nbOutputs,   sizeof(uint64_t));
+    gArchive.outputValues  = (const uint64_t *)archiveColumn(kArchiveOutputValues,  meta->nbOutputs,   sizeof(uint64_t));
+    gArchive.outputTypes   = (const int8_t   *)archiveColumn(kArchiveOutputTypes,   meta->nbOutputs,   sizeof(int8_t));
+    gArchive.outputHash160 = (const uint8_t  *)archiveColumn(kArchiveOutputHash160, meta->nbOutputs,   kRIPEMD160ByteSize);
+    gArchive.inputSpends   = (const uint64_t *)archiveColumn(kArchiveInputSpends,   meta->nbInputs,    sizeof(uint64_t));
+    gArchive.meta = meta;
+
+    info(
+        "archive holds %" PRIu64 " blocks, %" PRIu64 " transactions",
+        meta->nbBlocks,
+        meta->nbTX
+    );
+}
+
+// Blocks get parsed in chain order, not in the order a stream holds them, and
+// sources are read twice: a stream would have to be saved to disk whole first
+static void noStreams(
+    const char *name
+)
+{
+    errFatal(
+        "can't read the block chain from %s: streams can only be read once, "
+        "list blk files or zstd compressed ones (.dat.zst) in BLOCKPARSER_SOURCE instead",
+        name
+    );
+}
+
+static void addSource(
+    const std::string   &name,
+    std::vector<size_t> &pending
+)
+{
+    if(gArchive.meta) errFatal("an archive must be the only block chain source");
+
+    Map map;
+    map.name = name;
+
+    if(isCompressed(name)) {
+        requireZstd(name);
+        map.compressed = true;
+        map.xorKey = xorKeyFor(name, true);
+        pending.push_back(mapVec.size());
+    } else if("-"==name) {
+        noStreams("stdin");
+    } else {
+        struct stat statBuf;
+        int r = stat(name.c_str(), &statBuf);
+        if(r<0) sysErrFatal("failed to stat block chain source %s", name.c_str());
+
+        if(S_ISDIR(statBuf.st_mode)) {
+            mapArchive(name);
+            return;
+        } else if(S_ISREG(statBuf.st_mode)) {
+            if(!mapFile(map)) sysErrFatal("failed to open block chain file %s", name.c_str());
+            map.xorKey = xorKeyFor(name, true);
+        } else {
+            noStreams(name.c_str());
+        }
+    }
+
+    mapVec.push_back(map);
+}
+
+static void mapBlockChainSources(
+    const char *sources
+)
+{
+    // Colon-separated list of blk files, or of .zst compressed blk files.
+    // Alternatively, the directory of an archive written by exportArchive.
+    std::vector<size_t> pending;
+    const char *s = sources;
+    while(1) {
+        const char *e = strchr(s, ':');
+        std::string name = e ? std::string(s, e-s) : std::string(s);
+        if(0<name.size()) addSource(name, pending);
+        if(0==e) break;
+        s = 1 + e;
+    }
+
+    scanStreams(pending);
+}
+
 static void mapBlockChainFiles()
 {
+    const char *sources = getenv("BLOCKPARSER_SOURCE");
+    if(sources) {
+        info("reading block chain from %s", sources);
+        mapBlockChainSources(sources);
+        return;
+    }
+
     std::string coinName(
         #if defined LITECOIN
             "/.litecoin/"
@@ -387,6 +1471,7 @@ static void mapBlockChainFiles()
     int r = stat(blockDir.c_str(), &statBuf);
     bool oldStyle = (r<0 || !S_ISDIR(statBuf.st_mode));
 
+    std::vector<size_t> pending;
     int blkDatId = oldStyle ? 1 : 0;
     const char *fmt = oldStyle ? "blk%04d.dat" : "blocks/blk%05d.dat";
     while(1) {
@@ -394,47 +1479,46 @@ static void mapBlockChainFiles()
         char buf[64];
         sprintf(buf, fmt, blkDatId++);
 
-        std::string blockMapFileName =
+        Map map;
+        map.name =
             homeDir                             +
             coinName                            +
             std::string(buf)
         ;
 
-        int blockMapFD = open(blockMapFileName.c_str(), O_DIRECT | O_RDONLY);
-        if(blockMapFD<0) {
+        if(!mapFile(map)) {
+
+            // Archived chains may keep their blk files zstd-compressed
+            std::string compressedName = map.name + std::string(".zst");
+            if(0==access(compressedName.c_str(), R_OK)) {
+                requireZstd(compressedName);
+                map.name = compressedName;
+                map.compressed = true;
+                map.xorKey = xorKeyFor(map.name, true);
+                pending.push_back(mapVec.size());
+                mapVec.push_back(map);
+                continue;
+            }
+
             if(1<blkDatId) break;
             sysErrFatal(
                 "failed to open block chain file %s",
-                blockMapFileName.c_str()
+                map.name.c_str()
             );
         }
 
-        struct stat statBuf;
-        int r = fstat(blockMapFD, &statBuf);
-        if(r<0) sysErrFatal( "failed to fstat block chain file %s", blockMapFileName.c_str());
-
-        size_t mapSize = statBuf.st_size;
-        void *pMap = mmap(0, mapSize, PROT_READ, MAP_PRIVATE, blockMapFD, 0);
-        if(((void*)-1)==pMap) {
-            sysErrFatal(
-                "failed to mmap block chain file %s",
-                blockMapFileName.c_str()
-            );
-        }
-
-        Map map;
-        map.size = mapSize;
-        map.fd = blockMapFD;
-        map.name = blockMapFileName;
-        map.p = (const uint8_t*)pMap;
+        map.xorKey = xorKeyFor(map.name, !oldStyle);
         mapVec.push_back(map);
     }
+
+    scanStreams(pending);
 }
 
 static void initHashtables()
 {
     gTXMap.setEmptyKey(empty);
     gBlockMap.setEmptyKey(empty);
+    if(gArchive.meta) return;
 
     auto e = mapVec.end();
     uint64_t totalSize = 0;
@@ -513,27 +1597,19 @@ static bool buildBlock(
     const uint8_t *e
 )
 {
-    static const uint32_t expected =
-    #if defined(LITECOIN)
-        0xdbb6c0fb
-    #else
-        0xd9b4bef9
-    #endif
-    ;
-
     if(unlikely(e<=(8+p))) {
         //printf("end of map, reason : pointer past EOF\n");
         return true;
     }
 
     LOAD(uint32_t, magic, p);
-    if(unlikely(expected!=magic)) {
+    if(unlikely(kBlockMagic!=magic)) {
         //printf("end of map, reason : magic is fucked %d away from EOF\n", (int)(e-p));
         return true;
     }
 
     LOAD(uint32_t, size, p);
-    if(unlikely(e<(p+size))) {
+    if(unlikely(e<(p+size) || size<80)) {
         //printf("end of map, reason : end of block past EOF, %d past EOF\n", (int)((p+size)-e));
         return true;
     }
@@ -543,33 +1619,97 @@ static bool buildBlock(
     block->data = p;
     block->prev = 0;
     block->next = 0;
+    block->copy = 0;
 
-    uint8_t *hash = allocHash256();
-    sha256Twice(hash, p, 80);
-    gBlockMap[hash] = block;
+    uint256_t hash;
+    sha256Twice(hash.v, p, 80);
+    gBlockMap[hash.v] = block;
     p += size;
     return false;
 }
 
+static void addBlockCopy(
+    const BlockCopy &c
+)
+{
+    BlockCopy *copy = gBlockCopyArena.alloc();
+    *copy = c;
+
+    Block *block = allocBlock();
+    block->height = -1;
+    block->data = 8 + copy->bytes;
+    block->prev = 0;
+    block->next = 0;
+    block->copy = copy;
+
+    uint256_t hash;
+    sha256Twice(hash.v, block->data, 80);
+    gBlockMap[hash.v] = block;
+}
+
+// Same as buildBlock, for a mapped source that's obfuscated: the map is left untouched, the header gets copied
+static bool buildCopiedBlock(
+    const Map *map,
+    uint64_t  source,
+    uint64_t  &offset
+)
+{
+    if(unlikely(map->size<=(8+offset))) return true;
+
+    BlockCopy copy;
+    copy.offset = offset;
+    copy.source = source;
+    deObfuscate(copy.bytes, map->p + offset, 8, offset, map->xorKey);
+
+    const uint8_t *p = copy.bytes;
+    LOAD(uint32_t, magic, p);
+    if(unlikely(kBlockMagic!=magic)) return true;
+
+    LOAD(uint32_t, size, p);
+    if(unlikely(map->size<(8+offset+size) || size<80)) return true;
+
+    deObfuscate(8 + copy.bytes, map->p + offset + 8, 80, offset + 8, map->xorKey);
+    addBlockCopy(copy);
+    offset += 8 + size;
+    return false;
+}
+
 static void buildAllBlocks()
 {
-    auto e = mapVec.end();
-    auto i = mapVec.begin();
-    while(i!=e) {
+    for(size_t source=0; source<mapVec.size(); ++source) {
 
-        const Map *map = gCurMap = &(*(i++));
+        const Map *map = gCurMap = &mapVec[source];
         const uint8_t *end = map->size + map->p;
         const uint8_t *p = map->p;
+        size_t nbBlocks = gBlockMap.size();
 
         startMap(p);
 
-            while(1) {
-                if(unlikely(end<=p)) break;
-                bool done = buildBlock(p, end);
-                if(done) break;
+            if(map->compressed) {
+                for(const auto &copy:gStreamCopies[source]) addBlockCopy(copy);
+            } else if(map->xorKey) {
+                uint64_t offset = 0;
+                while(1) {
+                    if(unlikely(map->size<=offset)) break;
+                    bool done = buildCopiedBlock(map, source, offset);
+                    if(done) break;
+                }
+            } else {
+                while(1) {
+                    if(unlikely(end<=p)) break;
+                    bool done = buildBlock(p, end);
+                    if(done) break;
+                }
             }
 
         endMap(p);
+
+        if(0<map->size && nbBlocks==gBlockMap.size()) {
+            warning(
+                "no block found in %s, if it's obfuscated, point BLOCKPARSER_XOR at its xor.dat",
+                map->name.c_str()
+            );
+        }
     }
 }
 
@@ -577,11 +1717,45 @@ static void buildNullBlock()
 {
     gBlockMap[gNullHash.v] = gNullBlock = allocBlock();
     gNullBlock->data = 0;
+    gNullBlock->copy = 0;
+}
+
+static void buildArchiveChain()
+{
+    // Archived blocks are already the longest chain, in order : no hashing, no linking
+    const Map *map = gCurMap = &mapVec[kArchiveBlockData];
+    startMap(map->p);
+
+        Block *prev = gNullBlock;
+        gNullBlock->height = 0;
+        gNullBlock->prev = 0;
+        gNullBlock->next = 0;
+
+        uint64_t nbBlocks = gArchive.meta->nbBlocks;
+        for(uint64_t i=0; i<nbBlocks; ++i) {
+            Block *block = allocBlock();
+            block->data = gArchive.blockData + gArchive.blockOffsets[i];
+            block->height = 1 + i;
+            block->prev = prev;
+            block->next = 0;
+            block->copy = 0;
+            prev = block;
+        }
+
+        gMaxBlock = prev;
+        gMaxHeight = nbBlocks;
+
+    endMap(map->p + map->size);
 }
 
 static void firstPass()
 {
     buildNullBlock();
+    if(gArchive.meta) {
+        buildArchiveChain();
+        return;
+    }
+
     buildAllBlocks();
     linkAllBlocks();
 }
@@ -590,6 +1764,7 @@ static void secondPass()
 {
     findLongestChain();
     parseLongestChain();
+    showArenaStats();
     gCallback->wrapup();
 }
 
@@ -601,9 +1776,11 @@ static void cleanMaps()
 
         const Map &map = *(i++);
 
-        int r = munmap((void*)map.p, map.size);
+        int r = 0;
+        if(map.p) r = munmap((void*)map.p, map.mapSize);
         if(r<0) sysErr("failed to unmap block chain file %s", map.name.c_str());
 
+        if(map.fd<0) continue;
         r = close(map.fd);
         if(r<0) sysErr("failed to unmap block chain file %s", map.name.c_str());
 
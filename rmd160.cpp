@@ -1,6 +1,142 @@
 
+#include <string.h>
 #include <rmd160.h>
-#include "openssl/ripemd.h"
+#include <sha256.h>
+
+// In-tree RIPEMD-160, same rationale as sha256.cpp: no context, no library state.
+// Almost everything hashed here is a 32 byte SHA-256 digest, which fits a single
+// pre-padded block.
+
+static const uint8_t RL[80] = {
+     0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15,
+     7,  4, 13,  1, 10,  6, 15,  3, 12,  0,  9,  5,  2, 14, 11,  8,
+     3, 10, 14,  4,  9, 15,  8,  1,  2,  7,  0,  6, 13, 11,  5, 12,
+     1,  9, 11, 10,  0,  8, 12,  4, 13,  3,  7, 15, 14,  5,  6,  2,
+     4,  0,  5,  9,  7, 12,  2, 10, 14,  1,  3,  8, 11,  6, 15, 13
+};
+
+static const uint8_t RR[80] = {
+     5, 14,  7,  0,  9,  2, 11,  4, 13,  6, 15,  8,  1, 10,  3, 12,
+     6, 11,  3,  7,  0, 13,  5, 10, 14, 15,  8, 12,  4,  9,  1,  2,
+    15,  5,  1,  3,  7, 14,  6,  9, 11,  8, 12,  2, 10,  0,  4, 13,
+     8,  6,  4,  1,  3, 11, 15,  0,  5, 12,  2, 13,  9,  7, 10, 14,
+    12, 15, 10,  4,  1,  5,  8,  7,  6,  2, 13, 14,  0,  3,  9, 11
+};
+
+static const uint8_t SL[80] = {
+    11, 14, 15, 12,  5,  8,  7,  9, 11, 13, 14, 15,  6,  7,  9,  8,
+     7,  6,  8, 13, 11,  9,  7, 15,  7, 12, 15,  9, 11,  7, 13, 12,
+    11, 13,  6,  7, 14,  9, 13, 15, 14,  8, 13,  6,  5, 12,  7,  5,
+    11, 12, 14, 15, 14, 15,  9,  8,  9, 14,  5,  6,  8,  6,  5, 12,
+     9, 15,  5, 11,  6,  8, 13, 12,  5, 12, 13, 14, 11,  8,  5,  6
+};
+
+static const uint8_t SR[80] = {
+     8,  9,  9, 11, 13, 15, 15,  5,  7,  7,  8, 11, 14, 14, 12,  6,
+     9, 13, 15,  7, 12,  8,  9, 11,  7,  7, 12,  7,  6, 15, 13, 11,
+     9,  7, 15, 11,  8,  6,  6, 14, 12, 13,  5, 14, 13, 13,  7,  5,
+    15,  5,  8, 11, 14, 14,  6, 14,  6,  9, 12,  9, 12,  5, 15,  8,
+     8,  5, 12,  9, 12,  5, 14,  6,  8, 13,  6,  5, 15, 13, 11, 11
+};
+
+static const uint32_t KL[5] = { 0x00000000, 0x5a827999, 0x6ed9eba1, 0x8f1bbcdc, 0xa953fd4e };
+static const uint32_t KR[5] = { 0x50a28be6, 0x5c4dd124, 0x6d703ef3, 0x7a6d76e9, 0x00000000 };
+
+static inline uint32_t rol(
+    uint32_t x,
+    int      n
+)
+{
+    return (x<<n) | (x>>(32-n));
+}
+
+static inline uint32_t f(
+    int      round,
+    uint32_t x,
+    uint32_t y,
+    uint32_t z
+)
+{
+    switch(round) {
+        case 0:  return x ^ y ^ z;
+        case 1:  return (x & y) | (~x & z);
+        case 2:  return (x | ~y) ^ z;
+        case 3:  return (x & z) | (y & ~z);
+        default: return x ^ (y | ~z);
+    }
+}
+
+static void transform(
+    uint32_t      *state,
+    const uint8_t *data,
+    size_t        nbBlocks
+)
+{
+    while(nbBlocks--) {
+
+        uint32_t x[16];
+        for(int i=0; i<16; ++i) {
+            const uint8_t *p = data + 4*i;
+            x[i] =
+                (((uint32_t)p[0])<< 0) |
+                (((uint32_t)p[1])<< 8) |
+                (((uint32_t)p[2])<<16) |
+                (((uint32_t)p[3])<<24);
+        }
+
+        uint32_t al = state[0], bl = state[1], cl = state[2], dl = state[3], el = state[4];
+        uint32_t ar = al,       br = bl,       cr = cl,       dr = dl,       er = el;
+
+        // Round is a compile time constant once the loops are unrolled
+        for(int r=0; r<5; ++r) {
+            for(int j=16*r; j<16*(r+1); ++j) {
+                uint32_t t = rol(al + f(r, bl, cl, dl) + x[RL[j]] + KL[r], SL[j]) + el;
+                al = el; el = dl; dl = rol(cl, 10); cl = bl; bl = t;
+
+                t = rol(ar + f(4-r, br, cr, dr) + x[RR[j]] + KR[r], SR[j]) + er;
+                ar = er; er = dr; dr = rol(cr, 10); cr = br; br = t;
+            }
+        }
+
+        uint32_t t = state[1] + cl + dr;
+        state[1] = state[2] + dl + er;
+        state[2] = state[3] + el + ar;
+        state[3] = state[4] + al + br;
+        state[4] = state[0] + bl + cr;
+        state[0] = t;
+        data += 64;
+    }
+}
+
+static inline void storeLE32(
+    uint8_t  *p,
+    uint32_t v
+)
+{
+    p[0] = v>> 0;
+    p[1] = v>> 8;
+    p[2] = v>>16;
+    p[3] = v>>24;
+}
+
+static inline void initState(
+    uint32_t *state
+)
+{
+    state[0] = 0x67452301;
+    state[1] = 0xefcdab89;
+    state[2] = 0x98badcfe;
+    state[3] = 0x10325476;
+    state[4] = 0xc3d2e1f0;
+}
+
+static inline void storeState(
+    uint8_t        *result,
+    const uint32_t *state
+)
+{
+    for(int i=0; i<5; ++i) storeLE32(result + 4*i, state[i]);
+}
 
 void rmd160(
           uint8_t *result,
@@ -8,10 +144,45 @@ void rmd160(
            size_t len
 )
 {
-    RIPEMD160_CTX ctx;
-    RIPEMD160_Init(&ctx);
-    RIPEMD160_Update(&ctx, data, len);
-    RIPEMD160_Final(result, &ctx);
+    uint32_t state[5];
+    initState(state);
+
+    size_t nbBlocks = len/64;
+    transform(state, data, nbBlocks);
+    data += 64*nbBlocks;
+    len -= 64*nbBlocks;
+
+    uint8_t block[128];
+    memcpy(block, data, len);
+    block[len] = 0x80;
+
+    size_t tail = (len<56) ? 64 : 128;
+    memset(block + len + 1, 0, tail - len - 1);
+
+    uint64_t bits = 8*(64*(uint64_t)nbBlocks + len);
+    storeLE32(block + tail - 8, bits);
+    storeLE32(block + tail - 4, bits>>32);
+
+    transform(state, block, tail/64);
+    storeState(result, state);
 }
 
+void hash160(
+          uint8_t *result,
+    const uint8_t *data,
+           size_t len
+)
+{
+    uint8_t block[64];
+    sha256(block, data, len);
+
+    block[32] = 0x80;
+    memset(block + 33, 0, 64 - 33);
+    storeLE32(block + 56, 32*8);
+
+    uint32_t state[5];
+    initState(state);
+    transform(state, block, 1);
+    storeState(result, state);
+}
 
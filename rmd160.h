@@ -10,5 +10,12 @@
                size_t led
     );
 
+    // rmd160(sha256(data)), the hash behind addresses, without the intermediate copy
+    void hash160(
+              uint8_t *result,
+        const uint8_t *data,
+               size_t len
+    );
+
 #endif // __RMD160_H__
 
@@ -0,0 +1,373 @@
+
+#include <string.h>
+#include <secp256k1.h>
+
+// Arithmetic modulo the secp256k1 field prime p = 2^256 - 2^32 - 977.
+//
+// Elements are four little endian 64 bit limbs, always kept fully reduced.
+// Reduction uses 2^256 = 0x1000003D1 (mod p), so a 512 bit product folds
+// back with two multiply-adds by a 33 bit constant.
+
+typedef unsigned __int128 uint128;
+
+enum { kLanes = 8 };
+static const uint64_t kFold = 0x1000003D1ULL;
+
+struct Fe
+{
+    uint64_t v[4];
+};
+
+static inline void feSet(
+    Fe       &r,
+    uint64_t x
+)
+{
+    r.v[0] = x;
+    r.v[1] = r.v[2] = r.v[3] = 0;
+}
+
+// Big endian 32 bytes -> element, false if the value is not below p
+static inline bool feLoad(
+    Fe            &r,
+    const uint8_t *p
+)
+{
+    for(int i=0; i<4; ++i) {
+        const uint8_t *q = p + 8*(3-i);
+        uint64_t x = 0;
+        for(int j=0; j<8; ++j) x = (x<<8) | q[j];
+        r.v[i] = x;
+    }
+
+    // p is 0xFFFF...FFFF FFFFFFFE FFFFFC2F
+    bool top = (~0ULL==r.v[3] && ~0ULL==r.v[2] && ~0ULL==r.v[1]);
+    return !(top && (0xFFFFFFFEFFFFFC2FULL<=r.v[0]));
+}
+
+static inline void feStore(
+    uint8_t  *p,
+    const Fe &a
+)
+{
+    for(int i=0; i<4; ++i) {
+        uint64_t x = a.v[i];
+        uint8_t *q = p + 8*(3-i);
+        for(int j=7; 0<=j; --j) {
+            q[j] = (uint8_t)x;
+            x >>= 8;
+        }
+    }
+}
+
+static inline bool feEqual(
+    const Fe &a,
+    const Fe &b
+)
+{
+    return 0==((a.v[0]^b.v[0]) | (a.v[1]^b.v[1]) | (a.v[2]^b.v[2]) | (a.v[3]^b.v[3]));
+}
+
+// Adds kFold to r mod 2^256 when r is at or above p, i.e. subtracts p
+static inline void feNormalize(
+    Fe       &r,
+    uint64_t carry
+)
+{
+    uint128 c = (uint128)r.v[0] + kFold;
+    uint64_t t0 = (uint64_t)c; c >>= 64;
+    c += r.v[1]; uint64_t t1 = (uint64_t)c; c >>= 64;
+    c += r.v[2]; uint64_t t2 = (uint64_t)c; c >>= 64;
+    c += r.v[3]; uint64_t t3 = (uint64_t)c; c >>= 64;
+    if(carry || c) {
+        r.v[0] = t0; r.v[1] = t1; r.v[2] = t2; r.v[3] = t3;
+    }
+}
+
+static inline void feAdd(
+    Fe       &r,
+    const Fe &a,
+    const Fe &b
+)
+{
+    uint128 c = 0;
+    for(int i=0; i<4; ++i) {
+        c += (uint128)a.v[i] + b.v[i];
+        r.v[i] = (uint64_t)c;
+        c >>= 64;
+    }
+    feNormalize(r, (uint64_t)c);
+}
+
+static inline void feNeg(
+    Fe       &r,
+    const Fe &a
+)
+{
+    // p - a, with p - 0 = 0
+    static const Fe p = {{ 0xFFFFFFFEFFFFFC2FULL, ~0ULL, ~0ULL, ~0ULL }};
+    uint64_t borrow = 0;
+    for(int i=0; i<4; ++i) {
+        uint128 d = (uint128)p.v[i] - a.v[i] - borrow;
+        r.v[i] = (uint64_t)d;
+        borrow = (uint64_t)(d>>64) & 1;
+    }
+    feNormalize(r, 0);
+}
+
+static inline void feReduce(
+    Fe             &r,
+    const uint64_t *t       // 8 limbs
+)
+{
+    uint64_t s[4];
+    uint128 c = 0;
+    for(int i=0; i<4; ++i) {
+        c += (uint128)t[i] + (uint128)t[4+i]*kFold;
+        s[i] = (uint64_t)c;
+        c >>= 64;
+    }
+
+    c = (uint128)s[0] + (uint128)(uint64_t)c*kFold;
+    r.v[0] = (uint64_t)c; c >>= 64;
+    c += s[1]; r.v[1] = (uint64_t)c; c >>= 64;
+    c += s[2]; r.v[2] = (uint64_t)c; c >>= 64;
+    c += s[3]; r.v[3] = (uint64_t)c; c >>= 64;
+
+    // A carry here leaves r tiny, so adding kFold for it cannot carry again
+    if(c) {
+        c = (uint128)r.v[0] + kFold;
+        r.v[0] = (uint64_t)c; c >>= 64;
+        c += r.v[1]; r.v[1] = (uint64_t)c; c >>= 64;
+        c += r.v[2]; r.v[2] = (uint64_t)c; c >>= 64;
+        r.v[3] += (uint64_t)c;
+    }
+    feNormalize(r, 0);
+}
+
+// Column-wise schoolbook: (hi:lo) += x*y, with the carry out collected in top
+#define MUL_ACC(x, y) {                                                 \
+    uint128 m = (uint128)(x)*(y);                                       \
+    uint128 s = (uint128)lo + (uint64_t)m;                              \
+    lo = (uint64_t)s;                                                   \
+    s = (uint128)hi + (uint64_t)(m>>64) + (uint64_t)(s>>64);            \
+    hi = (uint64_t)s;                                                   \
+    top += (uint64_t)(s>>64);                                           \
+}
+
+#define MUL_ACC2(x, y) { MUL_ACC(x, y); MUL_ACC(x, y); }
+
+#define COLUMN_DONE(k) {                                                \
+    t[k] = lo;                                                          \
+    lo = hi;                                                            \
+    hi = top;                                                           \
+    top = 0;                                                            \
+}
+
+static inline void feMul(
+    Fe       &r,
+    const Fe &fa,
+    const Fe &fb
+)
+{
+    const uint64_t *a = fa.v;
+    const uint64_t *b = fb.v;
+    uint64_t t[8];
+    uint64_t lo = 0, hi = 0, top = 0;
+
+    MUL_ACC(a[0], b[0]);                                                COLUMN_DONE(0);
+    MUL_ACC(a[0], b[1]); MUL_ACC(a[1], b[0]);                           COLUMN_DONE(1);
+    MUL_ACC(a[0], b[2]); MUL_ACC(a[1], b[1]); MUL_ACC(a[2], b[0]);      COLUMN_DONE(2);
+    MUL_ACC(a[0], b[3]); MUL_ACC(a[1], b[2]);
+    MUL_ACC(a[2], b[1]); MUL_ACC(a[3], b[0]);                           COLUMN_DONE(3);
+    MUL_ACC(a[1], b[3]); MUL_ACC(a[2], b[2]); MUL_ACC(a[3], b[1]);      COLUMN_DONE(4);
+    MUL_ACC(a[2], b[3]); MUL_ACC(a[3], b[2]);                           COLUMN_DONE(5);
+    MUL_ACC(a[3], b[3]);                                                COLUMN_DONE(6);
+    t[7] = lo;
+
+    feReduce(r, t);
+}
+
+static inline void feSqr(
+    Fe       &r,
+    const Fe &fa
+)
+{
+    const uint64_t *a = fa.v;
+    uint64_t t[8];
+    uint64_t lo = 0, hi = 0, top = 0;
+
+    MUL_ACC(a[0], a[0]);                                                COLUMN_DONE(0);
+    MUL_ACC2(a[0], a[1]);                                               COLUMN_DONE(1);
+    MUL_ACC2(a[0], a[2]); MUL_ACC(a[1], a[1]);                          COLUMN_DONE(2);
+    MUL_ACC2(a[0], a[3]); MUL_ACC2(a[1], a[2]);                         COLUMN_DONE(3);
+    MUL_ACC2(a[1], a[3]); MUL_ACC(a[2], a[2]);                          COLUMN_DONE(4);
+    MUL_ACC2(a[2], a[3]);                                               COLUMN_DONE(5);
+    MUL_ACC(a[3], a[3]);                                                COLUMN_DONE(6);
+    t[7] = lo;
+
+    feReduce(r, t);
+}
+
+#undef MUL_ACC
+#undef MUL_ACC2
+#undef COLUMN_DONE
+
+// Lockstep helpers: the same operation on n independent lanes, so that the
+// multiplies of different lanes can overlap in the pipeline
+static inline void lanesMul(
+    Fe       *r,
+    const Fe *a,
+    const Fe *b,
+    size_t   n
+)
+{
+    for(size_t i=0; i<n; ++i) feMul(r[i], a[i], b[i]);
+}
+
+static inline void lanesSqrN(
+    Fe       *r,
+    const Fe *a,
+    int      k,
+    size_t   n
+)
+{
+    for(size_t i=0; i<n; ++i) r[i] = a[i];
+    while(k--) {
+        for(size_t i=0; i<n; ++i) feSqr(r[i], r[i]);
+    }
+}
+
+// r = a^((p+1)/4), which is a square root of a whenever a has one. Uses the
+// usual addition chain: 253 squarings and 13 multiplications.
+static void lanesSqrt(
+    Fe       *r,
+    const Fe *a,
+    size_t   n
+)
+{
+    Fe x2[kLanes], x3[kLanes], x6[kLanes], x9[kLanes], x11[kLanes], x22[kLanes], x44[kLanes];
+    Fe t[kLanes];
+
+    lanesSqrN(t, a, 1, n);      lanesMul(x2, t, a, n);
+    lanesSqrN(t, x2, 1, n);     lanesMul(x3, t, a, n);
+    lanesSqrN(t, x3, 3, n);     lanesMul(x6, t, x3, n);
+    lanesSqrN(t, x6, 3, n);     lanesMul(x9, t, x3, n);
+    lanesSqrN(t, x9, 2, n);     lanesMul(x11, t, x2, n);
+    lanesSqrN(t, x11, 11, n);   lanesMul(x22, t, x11, n);
+    lanesSqrN(t, x22, 22, n);   lanesMul(x44, t, x22, n);
+
+    Fe acc[kLanes];
+    lanesSqrN(t, x44, 44, n);   lanesMul(acc, t, x44, n);      // x88
+    lanesSqrN(t, acc, 88, n);   lanesMul(acc, t, acc, n);      // x176
+    lanesSqrN(t, acc, 44, n);   lanesMul(acc, t, x44, n);      // x220
+    lanesSqrN(t, acc, 3, n);    lanesMul(acc, t, x3, n);       // x223
+
+    lanesSqrN(t, acc, 23, n);   lanesMul(acc, t, x22, n);
+    lanesSqrN(t, acc, 6, n);    lanesMul(acc, t, x2, n);
+    lanesSqrN(r, acc, 2, n);
+}
+
+// x^3 + 7
+static inline void curveRHS(
+    Fe       &r,
+    const Fe &x
+)
+{
+    Fe seven;
+    feSet(seven, 7);
+    feSqr(r, x);
+    feMul(r, r, x);
+    feAdd(r, r, seven);
+}
+
+size_t decompressPublicKeys(
+          uint8_t *results,
+    const uint8_t *compressedKeys,
+    size_t        nbKeys
+)
+{
+    size_t nbValid = 0;
+    while(0<nbKeys) {
+
+        size_t n = (kLanes<nbKeys) ? (size_t)kLanes : nbKeys;
+
+        Fe x[kLanes], rhs[kLanes], y[kLanes];
+        bool valid[kLanes];
+        for(size_t i=0; i<n; ++i) {
+            const uint8_t *key = compressedKeys + i*kCompressedPubKeySize;
+            valid[i] = (0x02==key[0] || 0x03==key[0]) && feLoad(x[i], 1+key);
+            if(!valid[i]) feSet(x[i], 0);
+            curveRHS(rhs[i], x[i]);
+        }
+
+        lanesSqrt(y, rhs, n);
+
+        for(size_t i=0; i<n; ++i) {
+
+            const uint8_t *key = compressedKeys + i*kCompressedPubKeySize;
+            uint8_t *result = results + i*kUncompressedPubKeySize;
+
+            // x^3 + 7 may not be a square, in which case x is not on the curve
+            Fe check;
+            feSqr(check, y[i]);
+            if(!valid[i] || !feEqual(check, rhs[i])) {
+                memset(result, 0, kUncompressedPubKeySize);
+                continue;
+            }
+
+            if((y[i].v[0] & 1) != (uint64_t)(key[0] & 1)) feNeg(y[i], y[i]);
+
+            result[0] = 0x04;
+            memcpy(1+result, 1+key, 32);
+            feStore(33+result, y[i]);
+            ++nbValid;
+        }
+
+        compressedKeys += n*kCompressedPubKeySize;
+        results += n*kUncompressedPubKeySize;
+        nbKeys -= n;
+    }
+    return nbValid;
+}
+
+size_t compressPublicKeys(
+          uint8_t *results,
+    const uint8_t *uncompressedKeys,
+    size_t        nbKeys
+)
+{
+    size_t nbValid = 0;
+    for(size_t i=0; i<nbKeys; ++i) {
+
+        const uint8_t *key = uncompressedKeys + i*kUncompressedPubKeySize;
+        uint8_t *result = results + i*kCompressedPubKeySize;
+
+        Fe x, y, rhs, check;
+        bool valid =
+            (0x04==key[0] || 0x06==key[0] || 0x07==key[0])  &&
+            feLoad(x, 1+key)                                &&
+            feLoad(y, 33+key)
+        ;
+
+        uint8_t parity = valid ? (uint8_t)(y.v[0] & 1) : 0;
+        if(valid && 0x04!=key[0]) valid = (parity==(key[0] & 1));
+
+        if(valid) {
+            curveRHS(rhs, x);
+            feSqr(check, y);
+            valid = feEqual(check, rhs);
+        }
+
+        if(!valid) {
+            memset(result, 0, kCompressedPubKeySize);
+            continue;
+        }
+
+        result[0] = 0x02 | parity;
+        memcpy(1+result, 1+key, 32);
+        ++nbValid;
+    }
+    return nbValid;
+}
+
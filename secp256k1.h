@@ -0,0 +1,37 @@
+#ifndef __SECP256K1_H__
+    #define __SECP256K1_H__
+
+    #include <stddef.h>
+    #include <inttypes.h>
+
+    enum {
+        kCompressedPubKeySize = 33,
+        kUncompressedPubKeySize = 65
+    };
+
+    // Public key point conversions on secp256k1, without a bignum library.
+    //
+    // Keys are checked the same way o2i_ECPublicKey did: coordinates must be
+    // below the field prime and the point must be on the curve. Uncompressed
+    // input may also use the "hybrid" 0x06/0x07 prefix, as long as it agrees
+    // with the parity of y.
+    //
+    // The batch forms take nbKeys keys back to back and return how many were
+    // valid; results for invalid keys are zero-filled. Decompression is one
+    // square root per key; the batch form runs small groups of them in
+    // lockstep, so their multiplies are independent of each other.
+
+    size_t decompressPublicKeys(
+              uint8_t *results,         // nbKeys * 65 bytes
+        const uint8_t *compressedKeys,  // nbKeys * 33 bytes
+        size_t        nbKeys
+    );
+
+    size_t compressPublicKeys(
+              uint8_t *results,         // nbKeys * 33 bytes
+        const uint8_t *uncompressedKeys,// nbKeys * 65 bytes
+        size_t        nbKeys
+    );
+
+#endif // __SECP256K1_H__
+
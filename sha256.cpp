@@ -1,6 +1,287 @@
-
+#include <string.h>
 #include <sha256.h>
-#include "openssl/sha.h"
+
+// In-tree SHA-256. No library context to set up, no state outside the stack,
+// so it can be called from any thread. On x86-64 the compression function
+// uses the SHA extensions when the CPU has them.
+
+static const uint32_t kInit[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+static const uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static inline uint32_t ror(
+    uint32_t x,
+    int      n
+)
+{
+    return (x>>n) | (x<<(32-n));
+}
+
+static inline uint32_t loadBE32(
+    const uint8_t *p
+)
+{
+    return
+        (((uint32_t)p[0])<<24) |
+        (((uint32_t)p[1])<<16) |
+        (((uint32_t)p[2])<< 8) |
+        (((uint32_t)p[3])<< 0);
+}
+
+static inline void storeBE32(
+    uint8_t  *p,
+    uint32_t v
+)
+{
+    p[0] = v>>24;
+    p[1] = v>>16;
+    p[2] = v>> 8;
+    p[3] = v>> 0;
+}
+
+static void transformGeneric(
+    uint32_t      *state,
+    const uint8_t *data,
+    size_t        nbBlocks
+)
+{
+    while(nbBlocks--) {
+
+        uint32_t w[64];
+        for(int i=0; i<16; ++i) w[i] = loadBE32(data + 4*i);
+        for(int i=16; i<64; ++i) {
+            uint32_t s0 = ror(w[i-15],  7) ^ ror(w[i-15], 18) ^ (w[i-15]>> 3);
+            uint32_t s1 = ror(w[i- 2], 17) ^ ror(w[i- 2], 19) ^ (w[i- 2]>>10);
+            w[i] = w[i-16] + s0 + w[i-7] + s1;
+        }
+
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for(int i=0; i<64; ++i) {
+            uint32_t S1 = ror(e, 6) ^ ror(e, 11) ^ ror(e, 25);
+            uint32_t ch = (e & f) ^ (~e & g);
+            uint32_t t1 = h + S1 + ch + K[i] + w[i];
+            uint32_t S0 = ror(a, 2) ^ ror(a, 13) ^ ror(a, 22);
+            uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+            uint32_t t2 = S0 + maj;
+            h = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+
+        state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+        state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+        data += 64;
+    }
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+
+    #define WANT_SHA_NI
+    #include <cpuid.h>
+    #include <immintrin.h>
+
+    __attribute__((target("sha,sse4.1")))
+    static void transformSHANI(
+        uint32_t      *state,
+        const uint8_t *data,
+        size_t        nbBlocks
+    )
+    {
+        const __m128i byteSwap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+        // The SHA instructions want the state as ABEF/CDGH
+        __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)(state + 0)), 0xB1);
+        __m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)(state + 4)), 0x1B);
+        __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);
+        state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+        while(nbBlocks--) {
+
+            __m128i abef = state0;
+            __m128i cdgh = state1;
+
+            __m128i w[4];
+            for(int i=0; i<4; ++i) w[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 16*i)), byteSwap);
+
+            // 16 groups of 4 rounds. Group i+4 of the schedule is computed while group i is consumed
+            for(int i=0; i<16; ++i) {
+                __m128i msg = _mm_add_epi32(w[i&3], _mm_loadu_si128((const __m128i*)(K + 4*i)));
+                state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+                if(i<12) {
+                    __m128i t = _mm_sha256msg1_epu32(w[i&3], w[(i+1)&3]);
+                    t = _mm_add_epi32(t, _mm_alignr_epi8(w[(i+3)&3], w[(i+2)&3], 4));
+                    w[i&3] = _mm_sha256msg2_epu32(t, w[(i+3)&3]);
+                }
+                state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(msg, 0x0E));
+            }
+
+            state0 = _mm_add_epi32(state0, abef);
+            state1 = _mm_add_epi32(state1, cdgh);
+            data += 64;
+        }
+
+        tmp = _mm_shuffle_epi32(state0, 0x1B);
+        state1 = _mm_shuffle_epi32(state1, 0xB1);
+        _mm_storeu_si128((__m128i*)(state + 0), _mm_blend_epi16(tmp, state1, 0xF0));
+        _mm_storeu_si128((__m128i*)(state + 4), _mm_alignr_epi8(state1, tmp, 8));
+    }
+
+    static bool hasSHANI()
+    {
+        unsigned int a, b, c, d;
+        if(!__get_cpuid(1, &a, &b, &c, &d)) return false;
+        bool sse41 = (0!=(c & bit_SSE4_1));
+        bool ssse3 = (0!=(c & bit_SSSE3));
+        if(!__get_cpuid_count(7, 0, &a, &b, &c, &d)) return false;
+        bool sha = (0!=(b & (1<<29)));
+        return sha && sse41 && ssse3;
+    }
+
+#endif
+
+typedef void (*Transform)(uint32_t *state, const uint8_t *data, size_t nbBlocks);
+
+static Transform pickTransform()
+{
+    #if defined(WANT_SHA_NI)
+        if(hasSHANI()) return transformSHANI;
+    #endif
+    return transformGeneric;
+}
+
+static inline void transform(
+    uint32_t      *state,
+    const uint8_t *data,
+    size_t        nbBlocks
+)
+{
+    static const Transform t = pickTransform();
+    t(state, data, nbBlocks);
+}
+
+static inline void storeState(
+    uint8_t        *result,
+    const uint32_t *state
+)
+{
+    for(int i=0; i<8; ++i) storeBE32(result + 4*i, state[i]);
+}
+
+// Streaming state, for inputs that come in several pieces
+struct SHA256State
+{
+    uint32_t h[8];
+    uint8_t  buf[64];
+    size_t   bufSize;
+    uint64_t total;
+
+    SHA256State()
+        :   bufSize(0),
+            total(0)
+    {
+        memcpy(h, kInit, sizeof(h));
+    }
+
+    void update(
+        const uint8_t *data,
+        size_t        len
+    )
+    {
+        total += len;
+        if(0<bufSize) {
+            size_t n = 64 - bufSize;
+            if(len<n) n = len;
+            memcpy(buf + bufSize, data, n);
+            bufSize += n;
+            data += n;
+            len -= n;
+            if(64==bufSize) {
+                transform(h, buf, 1);
+                bufSize = 0;
+            }
+        }
+
+        size_t nbBlocks = len/64;
+        if(0<nbBlocks) {
+            transform(h, data, nbBlocks);
+            data += 64*nbBlocks;
+            len -= 64*nbBlocks;
+        }
+
+        if(0<len) {
+            memcpy(buf, data, len);
+            bufSize = len;
+        }
+    }
+
+    void final(
+        uint8_t *result
+    )
+    {
+        uint64_t bits = total*8;
+        buf[bufSize++] = 0x80;
+        if(56<bufSize) {
+            memset(buf + bufSize, 0, 64 - bufSize);
+            transform(h, buf, 1);
+            bufSize = 0;
+        }
+        memset(buf + bufSize, 0, 56 - bufSize);
+        storeBE32(buf + 56, bits>>32);
+        storeBE32(buf + 60, bits);
+        transform(h, buf, 1);
+        storeState(result, h);
+    }
+};
+
+// SHA-256 of exactly 32 bytes: a single, pre-padded block
+static inline void sha256Of32(
+    uint8_t       *result,
+    const uint8_t *data
+)
+{
+    uint8_t block[64];
+    memcpy(block, data, 32);
+    block[32] = 0x80;
+    memset(block + 33, 0, 64 - 33 - 2);
+    block[62] = (32*8)>>8;
+    block[63] = (32*8)&0xFF;
+
+    uint32_t h[8];
+    memcpy(h, kInit, sizeof(h));
+    transform(h, block, 1);
+    storeState(result, h);
+}
+
+// SHA-256 of exactly 80 bytes (a block header): one full block plus a pre-padded one
+static inline void sha256Of80(
+    uint8_t       *result,
+    const uint8_t *data
+)
+{
+    uint8_t block[64];
+    memcpy(block, data + 64, 16);
+    block[16] = 0x80;
+    memset(block + 17, 0, 64 - 17 - 2);
+    block[62] = (80*8)>>8;
+    block[63] = (80*8)&0xFF;
+
+    uint32_t h[8];
+    memcpy(h, kInit, sizeof(h));
+    transform(h, data, 1);
+    transform(h, block, 1);
+    storeState(result, h);
+}
 
 void sha256(
     uint8_t       *result,
@@ -8,9 +289,38 @@ void sha256(
     size_t        len
 )
 {
-    SHA256_CTX sha256;
-    SHA256_Init(&sha256);
-    SHA256_Update(&sha256, data, len);
-    SHA256_Final(result, &sha256);
+    if(32==len) {
+        sha256Of32(result, data);
+        return;
+    }
+
+    SHA256State state;
+    state.update(data, len);
+    state.final(result);
+}
+
+void sha256Twice(
+    uint8_t       *result,
+    const uint8_t *data,
+    size_t        len
+)
+{
+    uint8_t first[kSHA256ByteSize];
+    if(80==len) sha256Of80(first, data);
+    else        sha256(first, data, len);
+    sha256Of32(result, first);
+}
+
+void sha256Segments(
+    uint8_t       *result,
+    const uint8_t *const *segments,
+    const size_t  *lens,
+    size_t        nbSegments
+)
+{
+    SHA256State state;
+    for(size_t i=0; i<nbSegments; ++i)
+        state.update(segments[i], lens[i]);
+    state.final(result);
 }
 
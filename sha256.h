@@ -10,5 +10,20 @@
         size_t        len
     );
 
+    // sha256(sha256(data)), with fast paths for 80 byte block headers and the 32 byte second pass
+    void sha256Twice(
+        uint8_t       *result,
+        const uint8_t *data,
+        size_t        len
+    );
+
+    // Same as sha256, but hashes the concatenation of several non-contiguous segments without copying them
+    void sha256Segments(
+        uint8_t       *result,
+        const uint8_t *const *segments,
+        const size_t  *lens,
+        size_t        nbSegments
+    );
+
 #endif // __SHA256_H__
 
@@ -6,26 +6,25 @@
 #include <rmd160.h>
 #include <sha256.h>
 #include <opcodes.h>
+#include <secp256k1.h>
 
 #include <string>
+#include <thread>
+#include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/time.h>
-#include <openssl/bn.h>
-#include <openssl/ecdsa.h>
-#include <openssl/obj_mac.h>
 
 const uint8_t hexDigits[] = "0123456789abcdef";
 const uint8_t b58Digits[] = "123456789ABCDEFGHJKLMNPQRSTUVWXYZabcdefghijkmnopqrstuvwxyz";
 
-template<> Block *PagedAllocator<Block>::pool = 0;
-template<> Block *PagedAllocator<Block>::poolEnd = 0;
-
-template<> uint256_t *PagedAllocator<uint256_t>::pool = 0;
-template<> uint256_t *PagedAllocator<uint256_t>::poolEnd = 0;
-
-template<> uint160_t *PagedAllocator<uint160_t>::pool = 0;
-template<> uint160_t *PagedAllocator<uint160_t>::poolEnd = 0;
+Arena<Block>     gBlockArena("blocks");
+Arena<uint256_t> gHash256Arena("hash256");
+Arena<uint160_t> gHash160Arena("hash160");
 
 double usecs()
 {
@@ -34,13 +33,167 @@ double usecs()
     return t.tv_usec + 1000000*((uint64_t)t.tv_sec);
 }
 
-void toHex(
-          uint8_t *dst,     // 2*size +1
+// Hex kernels. x86-64 always has SSE2, which is used as the baseline; AVX2 is
+// picked at runtime when the CPU has it. Anything else falls back to scalar code.
+#if defined(__x86_64__) && defined(__GNUC__)
+    #define WANT_SIMD_HEX
+    #include <immintrin.h>
+#endif
+
+#if defined(WANT_SIMD_HEX)
+
+    // Reverse the 16 bytes of x
+    static inline __m128i reverse16(
+        __m128i x
+    )
+    {
+        x = _mm_shuffle_epi32(x, _MM_SHUFFLE(0, 1, 2, 3));
+        x = _mm_shufflelo_epi16(x, _MM_SHUFFLE(2, 3, 0, 1));
+        x = _mm_shufflehi_epi16(x, _MM_SHUFFLE(2, 3, 0, 1));
+        return _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+    }
+
+    // Nibbles (0..15 per byte) to lowercase hex digits
+    static inline __m128i nibblesToHex(
+        __m128i n
+    )
+    {
+        __m128i letter = _mm_and_si128(_mm_cmpgt_epi8(n, _mm_set1_epi8(9)), _mm_set1_epi8('a' - '0' - 10));
+        return _mm_add_epi8(_mm_add_epi8(n, _mm_set1_epi8('0')), letter);
+    }
+
+    // 16 bytes to 32 hex digits
+    static inline void hexEncode16(
+              uint8_t *dst,
+        __m128i       x
+    )
+    {
+        __m128i mask = _mm_set1_epi8(0x0F);
+        __m128i hi = _mm_and_si128(_mm_srli_epi16(x, 4), mask);
+        __m128i lo = _mm_and_si128(x, mask);
+        _mm_storeu_si128((__m128i*)(dst +  0), nibblesToHex(_mm_unpacklo_epi8(hi, lo)));
+        _mm_storeu_si128((__m128i*)(dst + 16), nibblesToHex(_mm_unpackhi_epi8(hi, lo)));
+    }
+
+    static void hexEncodeSSE2(
+              uint8_t *&dst,
+        const uint8_t *&src,
+        size_t        &size,
+        bool          rev
+    )
+    {
+        while(16<=size) {
+            size -= 16;
+            if(rev) {
+                hexEncode16(dst, reverse16(_mm_loadu_si128((const __m128i*)(src + size))));
+            } else {
+                hexEncode16(dst, _mm_loadu_si128((const __m128i*)src));
+                src += 16;
+            }
+            dst += 32;
+        }
+    }
+
+    __attribute__((target("avx2")))
+    static void hexEncodeAVX2(
+              uint8_t *&dst,
+        const uint8_t *&src,
+        size_t        &size,
+        bool          rev
+    )
+    {
+        const __m256i mask = _mm256_set1_epi8(0x0F);
+        const __m256i digits = _mm256_setr_epi8(
+            '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'a', 'b', 'c', 'd', 'e', 'f',
+            '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'a', 'b', 'c', 'd', 'e', 'f'
+        );
+        const __m256i reverse = _mm256_setr_epi8(
+            15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0,
+            15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0
+        );
+
+        while(32<=size) {
+
+            __m256i x;
+            size -= 32;
+            if(rev) {
+                x = _mm256_loadu_si256((const __m256i*)(src + size));
+                x = _mm256_shuffle_epi8(x, reverse);
+                x = _mm256_permute2x128_si256(x, x, 0x01);
+            } else {
+                x = _mm256_loadu_si256((const __m256i*)src);
+                src += 32;
+            }
+
+            __m256i hi = _mm256_shuffle_epi8(digits, _mm256_and_si256(_mm256_srli_epi16(x, 4), mask));
+            __m256i lo = _mm256_shuffle_epi8(digits, _mm256_and_si256(x, mask));
+
+            // unpack works per 128 bit lane: a = bytes 0..7 | 16..23, b = bytes 8..15 | 24..31
+            __m256i a = _mm256_unpacklo_epi8(hi, lo);
+            __m256i b = _mm256_unpackhi_epi8(hi, lo);
+            _mm256_storeu_si256((__m256i*)(dst +  0), _mm256_permute2x128_si256(a, b, 0x20));
+            _mm256_storeu_si256((__m256i*)(dst + 32), _mm256_permute2x128_si256(a, b, 0x31));
+            dst += 64;
+        }
+    }
+
+    static bool hasAVX2()
+    {
+        static const bool avx2 = __builtin_cpu_supports("avx2");
+        return avx2;
+    }
+
+    // Decode 32 hex digits into 16 bytes, false if any of them isn't a hex digit
+    static inline bool hexDecode16(
+              uint8_t *dst,
+        const uint8_t *src,
+        bool          rev
+    )
+    {
+        __m128i v[2] = {
+            _mm_loadu_si128((const __m128i*)(src +  0)),
+            _mm_loadu_si128((const __m128i*)(src + 16))
+        };
+
+        __m128i valid = _mm_set1_epi8(-1);
+        for(int i=0; i<2; ++i) {
+            __m128i c = v[i];
+            __m128i l = _mm_or_si128(c, _mm_set1_epi8(0x20));
+            __m128i isDigit = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('0' - 1)), _mm_cmplt_epi8(c, _mm_set1_epi8('9' + 1)));
+            __m128i isAlpha = _mm_and_si128(_mm_cmpgt_epi8(l, _mm_set1_epi8('a' - 1)), _mm_cmplt_epi8(l, _mm_set1_epi8('f' + 1)));
+            __m128i digit = _mm_and_si128(isDigit, _mm_sub_epi8(c, _mm_set1_epi8('0')));
+            __m128i alpha = _mm_and_si128(isAlpha, _mm_sub_epi8(l, _mm_set1_epi8('a' - 10)));
+            valid = _mm_and_si128(valid, _mm_or_si128(isDigit, isAlpha));
+
+            // Each 16 bit word holds (high nibble, low nibble) -> one byte
+            __m128i n = _mm_or_si128(digit, alpha);
+            v[i] = _mm_or_si128(
+                _mm_slli_epi16(_mm_and_si128(n, _mm_set1_epi16(0x00FF)), 4),
+                _mm_srli_epi16(n, 8)
+            );
+        }
+        if(0xFFFF!=_mm_movemask_epi8(valid)) return false;
+
+        __m128i bytes = _mm_packus_epi16(v[0], v[1]);
+        if(rev) bytes = reverse16(bytes);
+        _mm_storeu_si128((__m128i*)dst, bytes);
+        return true;
+    }
+
+#endif
+
+void hexEncode(
+          uint8_t *dst,     // 2*size
     const uint8_t *src,     // size
     size_t        size,
     bool          rev
 )
 {
+    #if defined(WANT_SIMD_HEX)
+        if(hasAVX2()) hexEncodeAVX2(dst, src, size, rev);
+        hexEncodeSSE2(dst, src, size, rev);
+    #endif
+
     int incr = 1;
     const uint8_t *p = src;
     const uint8_t *e = size + src;
@@ -50,7 +203,7 @@ void toHex(
         e = src-1;
         incr = -1;
     }
-    
+
     while(likely(p!=e))
     {
         uint8_t c = p[0];
@@ -59,7 +212,17 @@ void toHex(
         p += incr;
         dst += 2;
     }
-    dst[0] = 0;
+}
+
+void toHex(
+          uint8_t *dst,     // 2*size +1
+    const uint8_t *src,     // size
+    size_t        size,
+    bool          rev
+)
+{
+    hexEncode(dst, src, size, rev);
+    dst[2*size] = 0;
 }
 
 void showHex(
@@ -68,9 +231,13 @@ void showHex(
     bool          rev
 )
 {
-    uint8_t* buf = (uint8_t*)alloca(2*size + 1);
-    toHex(buf, p, size, rev);
-    printf("%s", buf);
+    uint8_t stackBuf[512];
+    uint8_t *buf = (2*size<=sizeof(stackBuf)) ? stackBuf : (uint8_t*)malloc(2*size);
+    if(unlikely(!buf)) errFatal("failed to allocate %d bytes", (int)(2*size));
+
+    hexEncode(buf, p, size, rev);
+    fwrite(buf, 1, 2*size, stdout);
+    if(buf!=stackBuf) free(buf);
 }
 
 uint8_t fromHexDigit(
@@ -93,6 +260,20 @@ bool fromHex(
     bool          abortOnErr
 )
 {
+    #if defined(WANT_SIMD_HEX)
+        // Whole 16 byte blocks first. A block with a bad digit is left to the
+        // scalar loop below, which reports it exactly as it always did.
+        while(16<=dstSize) {
+            uint8_t *blockDst = rev ? (dst + dstSize - 16) : dst;
+            if(!hexDecode16(blockDst, src, rev)) break;
+            if(!rev) dst += 16;
+            dstSize -= 16;
+            src += 32;
+        }
+    #endif
+
+    if(0==dstSize) return true;
+
     int incr = 2;
     uint8_t *end = dstSize + dst;
     if(rev)
@@ -163,59 +344,249 @@ bool compressPublicKey(
     const uint8_t *decompressedKey  // 65 bytes
 )
 {
-    EC_KEY *key = EC_KEY_new_by_curve_name(NID_secp256k1);
-    if(!key) {
-        errFatal("EC_KEY_new_by_curve_name failed");
-        return false;
+    return 1==compressPublicKeys(result, decompressedKey, 1);
+}
+
+bool decompressPublicKey(
+          uint8_t *result,          // 65 bytes
+    const uint8_t *compressedKey    // 33 bytes
+)
+{
+    return 1==decompressPublicKeys(result, compressedKey, 1);
+}
+
+const char *outputScriptTypeName(
+    int type
+)
+{
+    switch(type) {
+        #define SCRIPT_TYPE(x, code, name) case kScript##x: return name;
+            OUTPUT_SCRIPT_TYPES
+        #undef SCRIPT_TYPE
     }
+    return "couldn't parse script";
+}
 
-    EC_KEY *r = o2i_ECPublicKey(&key, &decompressedKey, 65);
-    if(!r) {
-        //warning("o2i_ECPublicKey failed");
-        EC_KEY_free(key);
-        return false;
+const char *outputScriptTypeTag(
+    int type
+)
+{
+    switch(type) {
+        #define SCRIPT_TYPE(x, code, name) case kScript##x: return #x;
+            OUTPUT_SCRIPT_TYPES
+        #undef SCRIPT_TYPE
     }
+    return "Unknown";
+}
 
-    EC_KEY_set_conv_form(key, POINT_CONVERSION_COMPRESSED);
-    size_t size = i2o_ECPublicKey(key, &result);
-    EC_KEY_free(key);
+// OP_m <pubKey>*n OP_n OP_CHECKMULTISIG, with compressed or uncompressed keys
+static bool isMultiSig(
+    ScriptDescriptor &desc,
+    const uint8_t    *script,
+    uint64_t         scriptSize
+)
+{
+    const uint8_t *p = script;
+    const uint8_t *e = script + scriptSize;
+    if(scriptSize<37 || 0xAE!=e[-1]) return false;   // OP_CHECKMULTISIG
+
+    uint8_t m = *(p++) - 0x50;
+    uint8_t n = 0;
+    while(p<e-2) {
+        uint8_t size = *(p++);
+        if(33!=size && 65!=size) return false;
+        p += size;
+        ++n;
+    }
+    if(p!=e-2) return false;
+    if(0x50+n!=p[0] || m<1 || n<m) return false;
+
+    desc.type = kScriptMultiSig;
+    desc.hashing = kScriptHashing160;
+    desc.m = m;
+    desc.n = n;
+    desc.program = script;
+    desc.programSize = scriptSize;
+    return true;
+}
 
-    if(33!=size) {
-        errFatal("i2o_ECPublicKey failed");
-        return false;
+int classifyOutputScript(
+    ScriptDescriptor &desc,
+    const uint8_t    *script,
+    uint64_t         scriptSize
+)
+{
+    desc.type = kScriptUnknown;
+    desc.hashing = kScriptHashingNone;
+    desc.m = desc.n = 0;
+    desc.program = 0;
+    desc.programSize = 0;
+    if(unlikely(0==scriptSize)) return desc.type;
+
+    #define MATCH(_type, _hashing, _offset, _size) { \
+        desc.type = _type;                             \
+        desc.hashing = _hashing;                       \
+        desc.program = _offset + script;               \
+        desc.programSize = _size;                      \
+        return desc.type;                              \
     }
 
-    return true;
+    // Dispatch on the first opcode, then check length and the fixed bytes
+    const uint8_t *e = script + scriptSize;
+    switch(script[0]) {
+
+        // OP_DUP OP_HASH160 OP_PUSHDATA(20) <hash> OP_EQUALVERIFY OP_CHECKSIG
+        case 0x76: {
+            if(likely(25==scriptSize && 0xA9==script[1] && 20==script[2] && 0x88==e[-2] && 0xAC==e[-1]))
+                MATCH(kScriptP2PKH, kScriptHashingNone, 3, kRIPEMD160ByteSize);
+            break;
+        }
+
+        // OP_HASH160 OP_PUSHDATA(20) <hash> OP_EQUAL
+        case 0xA9: {
+            if(likely(23==scriptSize && 20==script[1] && 0x87==e[-1]))
+                MATCH(kScriptP2SH, kScriptHashingNone, 2, kRIPEMD160ByteSize);
+            break;
+        }
+
+        // OP_PUSHDATA(65) <pubKey> OP_CHECKSIG
+        case 65: {
+            if(likely(67==scriptSize && 0xAC==e[-1]))
+                MATCH(kScriptP2PK, kScriptHashing160, 1, 65);
+            break;
+        }
+
+        // OP_PUSHDATA(33) <compressed pubKey> OP_CHECKSIG
+        case 33: {
+            if(likely(35==scriptSize && 0xAC==e[-1]))
+                MATCH(kScriptP2PKCompressed, kScriptHashing160, 1, 33);
+            break;
+        }
+
+        // OP_0 OP_PUSHDATA(20|32) <witness program>
+        case 0x00: {
+            if(22==scriptSize && 20==script[1]) MATCH(kScriptP2WPKH, kScriptHashing160,  2, kRIPEMD160ByteSize);
+            if(34==scriptSize && 32==script[1]) MATCH(kScriptP2WSH,  kScriptHashing160,  2, kSHA256ByteSize);
+            break;
+        }
+
+        // OP_1 OP_PUSHDATA(32) <taproot key>, or a 1-of-n bare multisig
+        case 0x51: {
+            if(34==scriptSize && 32==script[1]) MATCH(kScriptP2TR, kScriptHashing160, 2, kSHA256ByteSize);
+            isMultiSig(desc, script, scriptSize);
+            break;
+        }
+
+        // OP_2 .. OP_16: m-of-n bare multisig
+        case 0x52: case 0x53: case 0x54: case 0x55: case 0x56: case 0x57: case 0x58: case 0x59:
+        case 0x5A: case 0x5B: case 0x5C: case 0x5D: case 0x5E: case 0x5F: case 0x60: {
+            isMultiSig(desc, script, scriptSize);
+            break;
+        }
+
+        // Broken output scripts that were created by p2pool for a while -- very likely lost coins
+        // OP_IFDUP OP_IF OP_2SWAP OP_VERIFY OP_2OVER OP_DEPTH
+        case 0x73: {
+            if(6<=scriptSize && 0x63==script[1] && 0x72==script[2] && 0x69==script[3] && 0x70==script[4] && 0x74==script[5])
+                desc.type = kScriptBroken;
+            break;
+        }
+    }
+
+    #undef MATCH
+    return desc.type;
 }
 
-bool decompressPublicKey(
-          uint8_t *result,          // 65 bytes
-    const uint8_t *compressedKey    // 33 bytes
+void classifyOutputScripts(
+          ScriptDescriptor *descs,
+    const uint8_t          *const *scripts,
+    const uint64_t         *scriptSizes,
+    size_t                 n
 )
 {
-    EC_KEY *key = EC_KEY_new_by_curve_name(NID_secp256k1);
-    if(!key) {
-        errFatal("EC_KEY_new_by_curve_name failed");
-        return false;
+    for(size_t i=0; i<n; ++i) {
+        classifyOutputScript(descs[i], scripts[i], scriptSizes[i]);
     }
+}
 
-    EC_KEY *r = o2i_ECPublicKey(&key, &compressedKey, 33);
-    if(!r) {
-        //warning("o2i_ECPublicKey failed");
-        EC_KEY_free(key);
-        return false;
+// Direct-mapped pubKey -> hash160 cache. Early miners reused the same keys for
+// thousands of coinbases, and every P2PK output gets hashed again when it is
+// spent. One table per thread, so no locking is needed and callers can be anywhere.
+struct PubKeyCacheEntry
+{
+    uint8_t size;
+    uint8_t pubKey[65];
+    uint8_t hash160[kRIPEMD160ByteSize];
+};
+
+enum { kPubKeyCacheSize = 64 * 1024 };
+static thread_local PubKeyCacheEntry *tPubKeyCache = 0;
+
+static void pubKeyToHash160(
+          uint8_t *hash160,
+    const uint8_t *pubKey,
+    size_t        size
+)
+{
+    if(unlikely(0==tPubKeyCache)) {
+        tPubKeyCache = (PubKeyCacheEntry*)calloc(kPubKeyCacheSize, sizeof(PubKeyCacheEntry));
+        if(!tPubKeyCache) errFatal("failed to allocate pubKey cache");
     }
 
-    EC_KEY_set_conv_form(key, POINT_CONVERSION_UNCOMPRESSED);
-    size_t size = i2o_ECPublicKey(key, &result);
-    EC_KEY_free(key);
+    // Bytes 1..8 are the start of the x coordinate, as good as random
+    uint64_t x;
+    memcpy(&x, 1+pubKey, sizeof(x));
+    x ^= (x>>29) ^ (x>>47) ^ size;
 
-    if(65!=size) {
-        errFatal("i2o_ECPublicKey failed");
-        return false;
+    PubKeyCacheEntry &entry = tPubKeyCache[x & (kPubKeyCacheSize-1)];
+    if(likely(size==entry.size && 0==memcmp(entry.pubKey, pubKey, size))) {
+        memcpy(hash160, entry.hash160, kRIPEMD160ByteSize);
+        return;
     }
 
-    return true;
+    ::hash160(entry.hash160, pubKey, size);
+    memcpy(entry.pubKey, pubKey, size);
+    entry.size = size;
+    memcpy(hash160, entry.hash160, kRIPEMD160ByteSize);
+}
+
+void scriptKey(
+          uint8_t          *pubKeyHash,
+    const ScriptDescriptor &desc
+)
+{
+    if(kScriptHashingNone==desc.hashing) {
+        memcpy(pubKeyHash, desc.program, kRIPEMD160ByteSize);
+        return;
+    }
+
+    if(kScriptP2PK==desc.type || kScriptP2PKCompressed==desc.type) {
+        pubKeyToHash160(pubKeyHash, desc.program, desc.programSize);
+        return;
+    }
+
+    hash160(pubKeyHash, desc.program, desc.programSize);
+}
+
+// Per thread: the parser sets it, callbacks that solve scripts on worker threads just don't get to use it
+struct SolvedOutput
+{
+    const uint8_t *script;
+    const uint8_t *pubKeyHash;
+    int           type;
+};
+
+static thread_local SolvedOutput tSolvedOutput = { 0, 0, 0 };
+
+void setSolvedOutput(
+    const uint8_t *script,
+    int           type,
+    const uint8_t *pubKeyHash
+)
+{
+    tSolvedOutput.script = script;
+    tSolvedOutput.pubKeyHash = pubKeyHash;
+    tSolvedOutput.type = type;
 }
 
 int solveOutputScript(
@@ -225,97 +596,31 @@ int solveOutputScript(
     uint8_t       *type
 )
 {
+    ScriptDescriptor desc;
     type[0] = 0;
 
-    // The most common output script type, pays to hash160(pubKey)
-    if(
-        likely(
-            0x76==script[0]              &&  // OP_DUP
-            0xA9==script[1]              &&  // OP_HASH160
-              20==script[2]              &&  // OP_PUSHDATA(20)
-            0x88==script[scriptSize-2]   &&  // OP_EQUALVERIFY
-            0xAC==script[scriptSize-1]   &&  // OP_CHECKSIG
-              25==scriptSize
-        )
-    )
-    {
-        memcpy(pubKeyHash, 3+script, kRIPEMD160ByteSize);
-        return 0;
+    // Same bytes, same answer
+    if(script==tSolvedOutput.script && 0!=script) {
+        int r = tSolvedOutput.type;
+        if(unlikely(r<0)) return r;
+        if(kScriptP2SH==r) {
+            type[0] = 'S';
+            type[1] = 0;
+        }
+        memcpy(pubKeyHash, tSolvedOutput.pubKeyHash, kRIPEMD160ByteSize);
+        return r;
     }
 
-    // Output script commonly found in block reward TX, pays to explicit pubKey
-    if(
-        likely(
-              65==script[0]             &&  // OP_PUSHDATA(65)
-            0xAC==script[scriptSize-1]  &&  // OP_CHECKSIG
-              67==scriptSize
-        )
-    )
-    {
-        uint256_t sha;
-        sha256(sha.v, 1+script, 65);
-        rmd160(pubKeyHash, sha.v, kSHA256ByteSize);
-        return 1;
-    }
-
-    // Unusual output script, pays to explicit compressed pubKeys
-    if(
-        likely(
-              33==script[0]            &&  // OP_PUSHDATA(33)
-            0xAC==script[scriptSize-1] &&  // OP_CHECKSIG
-              35==scriptSize
-        )
-    )
-    {
-        //uint8_t pubKey[65];
-        //bool ok = decompressPublicKey(pubKey, 1+script);
-        //if(!ok) return -3;
-
-        uint256_t sha;
-        sha256(sha.v, 1+script, 33);
-        rmd160(pubKeyHash, sha.v, kSHA256ByteSize);
-        return 2;
-    }
-
-    // Recent output script type, pays to hash160(script)
-    if(
-        likely(
-            0xA9==script[0]             &&  // OP_HASH160
-              20==script[1]             &&  // OP_PUSHDATA(20)
-            0x87==script[scriptSize-1]  &&  // OP_EQUAL
-              23==scriptSize
-        )
-    )
-    {
-        memcpy(pubKeyHash, 2+script, kRIPEMD160ByteSize);
+    int r = classifyOutputScript(desc, script, scriptSize);
+    if(unlikely(r<0)) return r;
+
+    if(kScriptP2SH==r) {
         type[0] = 'S';
         type[1] = 0;
-        return 3;
     }
 
-    // Broken output scripts that were created by p2pool for a while -- very likely lost coins
-    if(
-        0x73==script[0] && // OP_IFDUP
-        0x63==script[1] && // OP_IF
-        0x72==script[2] && // OP_2SWAP
-        0x69==script[3] && // OP_VERIFY
-        0x70==script[4] && // OP_2OVER
-        0x74==script[5]    // OP_DEPTH
-    )
-        return -2;
-
-#if 0
-
-    // TODO : some scripts are solved by satoshi's client and not by the above. track them
-
-    // Unknown output script type -- very likely lost coins, but hit the satoshi script solver to make sure
-    int result = extractAddress(pubKeyHash, script, scriptSize);
-    if(result) return -1;
-    return 5;
-    printf("EXOTIC OUTPUT SCRIPT:\n");
-    showScript(script, scriptSize);
-#endif
-    return -1;
+    scriptKey(pubKeyHash, desc);
+    return r;
 }
 
 const uint8_t *loadKeyHash(
@@ -356,197 +661,484 @@ uint8_t fromB58Digit(
     return 0xff;
 }
 
-bool addrToHash160(
-          uint8_t *hash160,
-    const uint8_t *addr,
-             bool checkHash,
-             bool verbose
+// Reverse lookup tables for hex and base58 digits, 0xff marks an invalid character
+struct DigitValues
+{
+    uint8_t hex[256];
+    uint8_t b58[256];
+
+    DigitValues()
+    {
+        memset(hex, 0xff, sizeof(hex));
+        memset(b58, 0xff, sizeof(b58));
+        for(int i=0; i<16; ++i) hex[hexDigits[i]] = i;
+        for(int i=0; i<10; ++i) hex['A'+i] = 10 + i;
+        for(int i=0; i<58; ++i) b58[b58Digits[i]] = i;
+    }
+};
+
+static const DigitValues &digitValues()
+{
+    static const DigitValues values;
+    return values;
+}
+
+// Decode size base58 digits into a 25 byte big-endian payload (version + hash160 + checksum).
+// Digits are folded in 5 at a time (58^5 < 2^32) into 32-bit limbs, no BIGNUMs involved.
+static bool base58Decode25(
+          uint8_t *payload,
+    const uint8_t *p,
+    size_t        size
 )
 {
-    static BIGNUM *sum = 0;
-    static BN_CTX *ctx = 0;
-    if(unlikely(!ctx)) {
-        ctx = BN_CTX_new();
-        BN_CTX_init(ctx);
-        sum = BN_new();
+    enum { kNbLimbs = 7 };
+    uint32_t limbs[kNbLimbs] = { 0 };
+    const uint8_t *b58 = digitValues().b58;
+
+    const uint8_t *e = size + p;
+    while(likely(p<e)) {
+
+        uint64_t v = 0;
+        uint64_t m = 1;
+        for(int i=0; i<5 && p<e; ++i) {
+            uint8_t dg = b58[*(p++)];
+            if(unlikely(0xff==dg)) return false;
+            v = 58*v + dg;
+            m *= 58;
+        }
+
+        for(int i=0; i<kNbLimbs; ++i) {
+            uint64_t t = limbs[i]*m + v;
+            limbs[i] = (uint32_t)t;
+            v = t>>32;
+        }
+        if(unlikely(0!=v)) return false;
     }
 
-    BN_zero(sum);
-    while(1) {
-        uint8_t c = *(addr++);
-        if(unlikely(0==c)) break;
+    // 28 bytes of limbs, the top 3 must be empty
+    if(unlikely(0!=(limbs[kNbLimbs-1]>>8))) return false;
 
-        uint8_t dg = fromB58Digit(c);
-        BN_mul_word(sum, 58);
-        BN_add_word(sum, dg);
+    *(payload++) = limbs[kNbLimbs-1];
+    for(int i=kNbLimbs-2; 0<=i; --i) {
+        uint32_t limb = limbs[i];
+        *(payload++) = limb>>24;
+        *(payload++) = limb>>16;
+        *(payload++) = limb>> 8;
+        *(payload++) = limb>> 0;
     }
+    return true;
+}
 
-    uint8_t buf[4 + 2 + kRIPEMD160ByteSize + 4];
-    size_t size = BN_bn2mpi(sum, 0);
-    if(sizeof(buf)<size) {
-        warning(
-            "BN_bn2mpi returned weird buffer size %d, expected %d\n",
-            (int)size,
-            (int)sizeof(buf)
-        );
+static bool decodeAddr(
+          uint8_t *hash160,
+    const uint8_t *addr,
+    size_t        size,
+             bool checkHash,
+             bool verbose
+)
+{
+    uint8_t payload[25];
+    if(unlikely(!base58Decode25(payload, addr, size))) {
+        if(verbose) warning("%.*s is not a valid base58 address", (int)size, addr);
         return false;
     }
 
-    BN_bn2mpi(sum, buf);
+    memcpy(hash160, 1+payload, kRIPEMD160ByteSize);
+    if(!checkHash) return true;
+
+    uint8_t sha[kSHA256ByteSize];
+    const uint8_t *checkSum = 21 + payload;
+    sha256Twice(sha, payload, 21);
 
-    uint32_t recordedSize = 
-        (buf[0]<<24)    |
-        (buf[1]<<16)    |
-        (buf[2]<< 8)    |
-        (buf[3]<< 0);
-    if(size!=(4+recordedSize)) {
+    bool hashOK = (0==memcmp(sha, checkSum, 4));
+    if(!hashOK && verbose) {
         warning(
-            "BN_bn2mpi returned bignum size %d, expected %d\n",
-            (int)recordedSize,
-            (int)size-4
+            "checksum of address %.*s failed. Expected 0x%x%x%x%x, got 0x%x%x%x%x.",
+            (int)size, addr,
+            checkSum[0], checkSum[1], checkSum[2], checkSum[3],
+            sha[0],      sha[1],      sha[2],      sha[3]
         );
-        return false;
     }
+    return hashOK;
+}
 
-    uint8_t *bigNumEnd;
-    uint8_t *dataEnd = size + buf;
-    uint8_t *bigNumStart = 4 + buf;
-    uint8_t *checkSumStart = bigNumEnd = (-4 + dataEnd);
-    while(0==bigNumStart[0] && bigNumStart<checkSumStart) ++bigNumStart;
+bool addrToHash160(
+          uint8_t *hash160,
+    const uint8_t *addr,
+             bool checkHash,
+             bool verbose
+)
+{
+    return decodeAddr(hash160, addr, strlen((const char*)addr), checkHash, verbose);
+}
 
-    ptrdiff_t bigNumSize = bigNumEnd - bigNumStart;
-    ptrdiff_t padSize = kRIPEMD160ByteSize - bigNumSize;
-    if(0<padSize) {
-        if(0<bigNumSize) memcpy(padSize + hash160, bigNumStart, bigNumSize);
-        memset(hash160, 0, padSize);
-    } else {
-        memcpy(hash160, bigNumStart - padSize, kRIPEMD160ByteSize);
-    }
+// 58^5, the largest power of 58 for which limb*2^32 + carry still fits in 64 bits
+static const uint64_t kB58LimbBase = 58ULL*58ULL*58ULL*58ULL*58ULL;
 
-    bool hashOK = true;
-    if(checkHash) {
+void base58Encode25(
+          uint8_t *addr,
+    const uint8_t *payload
+)
+{
+    // 25 bytes = 200 bits < 58^35, i.e. 7 limbs of 5 base58 digits each,
+    // least significant limb first
+    enum { kNbLimbs = 7 };
+    uint64_t limbs[kNbLimbs] = { payload[0] };
+    int nbLimbs = 1;
+
+    const uint8_t *p = 1 + payload;
+    const uint8_t *e = 25 + payload;
+    while(likely(p<e)) {
 
-        uint8_t data[1+kRIPEMD160ByteSize];
-        memcpy(1+data, hash160, kRIPEMD160ByteSize);
-        #if defined(LITECOIN)
-            data[0] = 48;
-        #else
-            data[0] = 0;
-        #endif
+        uint64_t carry =
+            (((uint64_t)p[0])<<24) |
+            (((uint64_t)p[1])<<16) |
+            (((uint64_t)p[2])<< 8) |
+            (((uint64_t)p[3])<< 0);
+        p += 4;
+
+        for(int i=0; i<nbLimbs; ++i) {
+            uint64_t t = (limbs[i]<<32) + carry;
+            carry = t / kB58LimbBase;
+            limbs[i] = t - carry*kB58LimbBase;
+        }
+        while(carry) {
+            uint64_t q = carry / kB58LimbBase;
+            limbs[nbLimbs++] = carry - q*kB58LimbBase;
+            carry = q;
+        }
+    }
 
-        uint8_t sha[kSHA256ByteSize];
-        sha256Twice(sha, data, 1+kRIPEMD160ByteSize);
-
-        hashOK =
-            sha[0]==checkSumStart[0]  &&
-            sha[1]==checkSumStart[1]  &&
-            sha[2]==checkSumStart[2]  &&
-            sha[3]==checkSumStart[3];
-
-        if(!hashOK) {
-            warning(
-                "checksum of address %s failed. Expected 0x%x%x%x%x, got 0x%x%x%x%x.",
-                addr,
-                checkSumStart[0], checkSumStart[1], checkSumStart[2], checkSumStart[3],
-                sha[0],           sha[1],           sha[2],           sha[3]
-            );
+    uint8_t digits[5*kNbLimbs];
+    uint8_t *d = digits + sizeof(digits);
+    for(int i=0; i<nbLimbs; ++i) {
+        uint64_t limb = limbs[i];
+        for(int j=0; j<5; ++j) {
+            uint64_t q = limb / 58;
+            *(--d) = limb - 58*q;
+            limb = q;
         }
     }
 
-    return hashOK;
+    // Each leading zero byte is encoded as a '1', the number itself has no leading zeros
+    uint8_t *o = addr;
+    const uint8_t *z = payload;
+    while(z<e && 0==z[0]) {
+        *(o++) = b58Digits[0];
+        ++z;
+    }
+
+    const uint8_t *de = digits + sizeof(digits);
+    while(d<de && 0==d[0]) ++d;
+    while(d<de) *(o++) = b58Digits[*(d++)];
+    *o = 0;
+}
+
+void base58CheckEncode(
+          uint8_t *addr,
+    const uint8_t *payload
+)
+{
+    uint8_t buf[25 + kSHA256ByteSize - 4];
+    memcpy(buf, payload, 21);
+    sha256Twice(21 + buf, buf, 21);
+    base58Encode25(addr, buf);
 }
 
 void hash160ToAddr(
-          uint8_t *addr,    // 32 bytes is safe
+          uint8_t *addr,    // kBase58AddrSize bytes is safe
     const uint8_t *hash160,
           uint8_t type
 )
 {
-    uint8_t buf[4 + 2 + kRIPEMD160ByteSize + kSHA256ByteSize];
-    const uint32_t size = 4 + 2 + kRIPEMD160ByteSize;
-    buf[ 0] = (size>>24) & 0xff;
-    buf[ 1] = (size>>16) & 0xff;
-    buf[ 2] = (size>> 8) & 0xff;
-    buf[ 3] = (size>> 0) & 0xff;
-    buf[ 4] = 0;
-    buf[ 5] = type;
-    memcpy(4 + 2 + buf, hash160, kRIPEMD160ByteSize);
-    sha256Twice(
-        4 + 2 + kRIPEMD160ByteSize + buf,
-        4 + 1 + buf,
-        1 + kRIPEMD160ByteSize
-    );
+    uint8_t payload[1 + kRIPEMD160ByteSize];
+    payload[0] = type;
+    memcpy(1 + payload, hash160, kRIPEMD160ByteSize);
+    base58CheckEncode(addr, payload);
+}
 
-    static BIGNUM *b58 = 0;
-    static BIGNUM *num = 0;
-    static BIGNUM *div = 0;
-    static BIGNUM *rem = 0;
-    static BN_CTX *ctx = 0;
+// Segwit addresses, BIP173 (bech32, witness v0) and BIP350 (bech32m, v1 and up)
+static const char kBech32Digits[] = "qpzry9x8gf2tvdw0s3jn54khce6mua7l";
+static const char *kBech32Prefix =
+    #if defined(LITECOIN)
+        "ltc"
+    #else
+        "bc"
+    #endif
+;
+
+static uint32_t bech32PolyMod(
+    const uint8_t *v,
+    size_t        size
+)
+{
+    static const uint32_t generator[] = { 0x3b6a57b2, 0x26508e6d, 0x1ea119fa, 0x3d4233dd, 0x2a1462b3 };
+
+    uint32_t chk = 1;
+    for(size_t i=0; i<size; ++i) {
+        uint32_t top = chk>>25;
+        chk = ((chk & 0x1ffffff)<<5) ^ v[i];
+        for(int j=0; j<5; ++j) {
+            if((top>>j) & 1) chk ^= generator[j];
+        }
+    }
+    return chk;
+}
 
-    if(!ctx)
-    {
-        ctx = BN_CTX_new();
-        BN_CTX_init(ctx);
+static uint32_t bech32Constant(
+    int version
+)
+{
+    return (0==version) ? 1 : 0x2bc830a3;
+}
+
+// Prefix, expanded as the checksum wants it, then the 5 bit groups of the data
+static size_t bech32Expand(
+          uint8_t *dst,
+    const uint8_t *data,
+    size_t        dataSize
+)
+{
+    size_t n = 0;
+    size_t prefixSize = strlen(kBech32Prefix);
+    for(size_t i=0; i<prefixSize; ++i) dst[n++] = kBech32Prefix[i]>>5;
+    dst[n++] = 0;
+    for(size_t i=0; i<prefixSize; ++i) dst[n++] = kBech32Prefix[i] & 31;
+    memcpy(dst + n, data, dataSize);
+    return n + dataSize;
+}
 
-        b58 = BN_new();
-        num = BN_new();
-        div = BN_new();
-        rem = BN_new();
-        BN_set_word(b58, 58);
+static size_t segwitToAddr(
+          uint8_t        *addr,
+    int                  version,
+    const WitnessProgram &program
+)
+{
+    // Witness version, then the program regrouped from 8 to 5 bits, then room for the checksum
+    uint8_t data[1 + 52 + 6];
+    size_t n = 0;
+    data[n++] = version;
+
+    uint32_t acc = 0;
+    int bits = 0;
+    for(size_t i=0; i<program.size; ++i) {
+        acc = (acc<<8) | program.v[i];
+        bits += 8;
+        while(5<=bits) {
+            bits -= 5;
+            data[n++] = (acc>>bits) & 31;
+        }
     }
+    if(0<bits) data[n++] = (acc<<(5 - bits)) & 31;
+
+    uint8_t buf[16 + sizeof(data)];
+    memset(data + n, 0, 6);
+    size_t size = bech32Expand(buf, data, n + 6);
+    uint32_t chk = bech32PolyMod(buf, size) ^ bech32Constant(version);
+    for(int i=0; i<6; ++i) data[n + i] = (chk>>(5*(5 - i))) & 31;
+
+    uint8_t *o = addr;
+    for(const char *h=kBech32Prefix; *h; ++h) *(o++) = *h;
+    *(o++) = '1';
+    for(size_t i=0; i<n + 6; ++i) *(o++) = kBech32Digits[data[i]];
+    *o = 0;
+    return o - addr;
+}
 
-    BN_mpi2bn(buf, 4+size, num);
+// Witness program of a segwit address, false if it isn't one of ours
+static bool addrToSegwit(
+    int            &version,
+    WitnessProgram &program,
+    const uint8_t  *addr,
+    size_t         size
+)
+{
+    size_t prefixSize = strlen(kBech32Prefix);
+    if(size<prefixSize + 8 || 90<size) return false;
+
+    bool lower = false;
+    bool upper = false;
+    uint8_t data[90];
+    size_t n = 0;
+    for(size_t i=0; i<size; ++i) {
+        uint8_t c = addr[i];
+        lower |= ('a'<=c && c<='z');
+        upper |= ('A'<=c && c<='Z');
+        if('A'<=c && c<='Z') c += 'a' - 'A';
+
+        if(i<prefixSize) {
+            if(c!=(uint8_t)kBech32Prefix[i]) return false;
+        } else if(i==prefixSize) {
+            if('1'!=c) return false;
+        } else {
+            const char *d = (const char*)memchr(kBech32Digits, c, 32);
+            if(0==d) return false;
+            data[n++] = d - kBech32Digits;
+        }
+    }
+    if(lower && upper) return false;
+
+    version = data[0];
+    uint8_t buf[16 + sizeof(data)];
+    size_t bufSize = bech32Expand(buf, data, n);
+    if(16<version || bech32Constant(version)!=bech32PolyMod(buf, bufSize)) return false;
+
+    // Program: the 5 bit groups between version and checksum, back to bytes
+    uint32_t acc = 0;
+    int bits = 0;
+    program.size = 0;
+    for(size_t i=1; i<n - 6; ++i) {
+        acc = (acc<<5) | data[i];
+        bits += 5;
+        if(8<=bits) {
+            bits -= 8;
+            if(sizeof(program.v)<=program.size) return false;
+            program.v[program.size++] = (acc>>bits) & 0xff;
+        }
+    }
+    if(5<=bits || 0!=(acc & ((1<<bits) - 1))) return false;
 
-    uint8_t *p = addr;
-    while(!BN_is_zero(num))
-    {
-        int r = BN_div(div, rem, num, b58, ctx);
-        if(!r) errFatal("BN_div failed");
-        BN_copy(num, div);
+    if(0==version) return (kRIPEMD160ByteSize==program.size || kSHA256ByteSize==program.size);
+    return (1==version && kSHA256ByteSize==program.size);
+}
 
-        uint32_t digit = BN_get_word(rem);
-        *(p++) = b58Digits[digit];
-    }
+void witnessProgram(
+    WitnessProgram &program,
+    int            type,
+    const uint8_t  *script,
+    uint64_t       scriptSize
+)
+{
+    program.size = 0;
+    if(!isSegwitType(type)) return;
 
-    const uint8_t *a =                          (5+buf);
-    const uint8_t *e = 1 + kRIPEMD160ByteSize + (5+buf);
-    while(a<e && 0==a[0])
-    {
-        *(p++) = b58Digits[0];
-        ++a;
+    // OP_n OP_PUSHDATA(size) <program>
+    program.size = scriptSize - 2;
+    memcpy(program.v, 2 + script, program.size);
+}
+
+size_t keyToAddr(
+          uint8_t        *addr,
+    int                  type,
+    const uint8_t        *key,
+    const WitnessProgram *program
+)
+{
+    switch(type) {
+
+        case kScriptP2WPKH:
+        case kScriptP2WSH:
+        case kScriptP2TR: {
+            if(unlikely(0==program || 0==program->size)) errFatal("segwit address shown without its witness program");
+            return segwitToAddr(addr, (kScriptP2TR==type) ? 1 : 0, *program);
+        }
+
+        case kScriptMultiSig: {
+            static const char tag[] = "multisig:";
+            memcpy(addr, tag, sizeof(tag) - 1);
+            toHex(addr + sizeof(tag) - 1, key, kRIPEMD160ByteSize, false);
+            addr[sizeof(tag) - 1 + 2*kRIPEMD160ByteSize] = 0;
+            return sizeof(tag) - 1 + 2*kRIPEMD160ByteSize;
+        }
+
+        case kScriptP2SH: {
+            hash160ToAddr(addr, key, 5);
+            return strlen((const char*)addr);
+        }
     }
-    *(p--) = 0;
 
-    while(addr<p)
-    {
-        uint8_t a = *addr;
-        uint8_t b = *p;
-        *(addr++) = b;
-        *(p--) = a;
+    hash160ToAddr(addr, key);
+    return strlen((const char*)addr);
+}
+
+int scriptToAddr(
+          uint8_t *addr,
+    const uint8_t *script,
+    uint64_t      scriptSize
+)
+{
+    uint8_t addrType[3];
+    uint160_t key;
+    addr[0] = 0;
+    int type = solveOutputScript(key.v, script, scriptSize, addrType);
+    if(unlikely(type<0)) return type;
+
+    WitnessProgram program;
+    witnessProgram(program, type, script, scriptSize);
+    keyToAddr(addr, type, key.v, &program);
+    return type;
+}
+
+void hash160ToAddrs(
+          uint8_t *addrs,
+    const uint8_t *hash160s,
+    size_t        n,
+    uint8_t       type
+)
+{
+    uint8_t buf[25 + kSHA256ByteSize - 4];
+    buf[0] = type;
+
+    const uint8_t *e = n*kRIPEMD160ByteSize + hash160s;
+    while(likely(hash160s<e)) {
+        memcpy(1 + buf, hash160s, kRIPEMD160ByteSize);
+        sha256Twice(21 + buf, buf, 21);
+        base58Encode25(addrs, buf);
+        hash160s += kRIPEMD160ByteSize;
+        addrs += kBase58AddrSize;
     }
 }
 
-bool guessHash160(
+// A line is either 40 hex digits, a base58 address, a segwit one, or a multisig: key
+static bool guessHash160(
           uint8_t *hash160,
     const uint8_t *addr,
+    size_t        size,
              bool verbose
 )
 {
-    const uint8_t *p = addr;
-    while(1) {
-        uint8_t c = *p;
-        uint8_t h = fromHexDigit(c, false);
-        if(0xff==h) break;
-        ++p;
+    // As keyToAddr shows bare multisig keys
+    static const char multiSigTag[] = "multisig:";
+    size_t tagSize = sizeof(multiSigTag) - 1;
+    if(tagSize<size && 0==memcmp(addr, multiSigTag, tagSize)) {
+        addr += tagSize;
+        size -= tagSize;
     }
 
-    ptrdiff_t size = p - addr;
+    const uint8_t *hex = digitValues().hex;
     if(2*kRIPEMD160ByteSize==size) {
-        fromHex(hash160, addr, kRIPEMD160ByteSize, false);
+
+        uint8_t *dst = hash160;
+        const uint8_t *p = addr;
+        const uint8_t *e = size + addr;
+        while(p<e) {
+            uint8_t hi = hex[p[0]];
+            uint8_t lo = hex[p[1]];
+            if(0xff==(hi|lo)) break;
+            *(dst++) = (hi<<4) | lo;
+            p += 2;
+        }
+        if(p==e) return true;
+    }
+
+    // Segwit addresses stand for the hash160 of their witness program, the key of their outputs
+    int version;
+    WitnessProgram program;
+    if(addrToSegwit(version, program, addr, size)) {
+        ::hash160(hash160, program.v, program.size);
         return true;
     }
 
-    return addrToHash160(hash160, addr, true, verbose);
+    return decodeAddr(hash160, addr, size, true, verbose);
+}
+
+bool guessHash160(
+          uint8_t *hash160,
+    const uint8_t *addr,
+             bool verbose
+)
+{
+    return guessHash160(hash160, addr, strlen((const char*)addr), verbose);
 }
 
 static bool addAddr(
@@ -561,6 +1153,58 @@ static bool addAddr(
     return ok;
 }
 
+// One slice of a key file, decoded by its own thread
+struct KeySlice
+{
+    const uint8_t *start;
+    const uint8_t *end;
+    size_t nbLines;
+    std::vector<uint160_t> keys;
+    std::vector<std::pair<size_t, std::string> > badLines;
+
+    void decode()
+    {
+        nbLines = 0;
+        const uint8_t *p = start;
+        while(p<end) {
+
+            const uint8_t *eol = (const uint8_t*)memchr(p, '\n', end - p);
+            if(0==eol) eol = end;
+            ++nbLines;
+
+            const uint8_t *e = eol;
+            while(p<e && (' '==e[-1] || '\t'==e[-1] || '\r'==e[-1])) --e;
+
+            if(p<e) {
+                uint160_t h160;
+                bool ok = guessHash160(h160.v, p, e - p, false);
+                if(likely(ok)) keys.push_back(h160);
+                else           badLines.push_back(std::make_pair(nbLines, std::string((const char*)p, e - p)));
+            }
+            p = 1 + eol;
+        }
+    }
+};
+
+struct Hash160Less
+{
+    bool operator()(
+        const uint160_t &a,
+        const uint160_t &b
+    ) const
+    {
+        return memcmp(a.v, b.v, kRIPEMD160ByteSize)<0;
+    }
+};
+
+static bool hash160Same(
+    const uint160_t &a,
+    const uint160_t &b
+)
+{
+    return 0==memcmp(a.v, b.v, kRIPEMD160ByteSize);
+}
+
 void loadKeyList(
     std::vector<uint160_t> &result,
     const char *str,
@@ -581,48 +1225,100 @@ void loadKeyList(
 
     const char *fileName = 5+str;
     bool isStdIn = ('-'==fileName[0] && 0==fileName[1]);
-    FILE *f = isStdIn ? stdin : fopen(fileName, "r");
-    if(!f) {
+    int fd = isStdIn ? 0 : open(fileName, O_RDONLY);
+    if(fd<0) {
         warning("couldn't open %s for reading\n", fileName);
         return;
     }
 
-    size_t found = 0;
-    size_t lineCount = 0;
     double start = usecs();
-    while(1) {
 
-        char buf[1024];
-        char *r = fgets(buf, sizeof(buf), f);
-        if(r==0) break;
-        ++lineCount;
+    // mmap regular files, slurp pipes and stdin
+    struct stat st;
+    size_t size = 0;
+    void *mapped = 0;
+    std::string slurped;
+    if(0==fstat(fd, &st) && S_ISREG(st.st_mode)) {
+        size = st.st_size;
+        if(0<size) {
+            mapped = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if(MAP_FAILED==mapped) sysErrFatal("failed to mmap key file %s", fileName);
+            madvise(mapped, size, MADV_SEQUENTIAL);
+        }
+    } else {
+        while(1) {
+            char buf[64 * 1024];
+            ssize_t r = read(fd, buf, sizeof(buf));
+            if(r<0 && EINTR==errno) continue;
+            if(r<0) sysErrFatal("failed to read key file %s", fileName);
+            if(0==r) break;
+            slurped.append(buf, r);
+        }
+        size = slurped.size();
+    }
+    const uint8_t *data = mapped ? (const uint8_t*)mapped : (const uint8_t*)slurped.data();
+
+    // Split on line boundaries, about 1MB per thread at least
+    size_t nbSlices = 1 + (size>>20);
+    size_t nbCores = std::thread::hardware_concurrency();
+    if(0==nbCores) nbCores = 1;
+    if(nbCores<nbSlices) nbSlices = nbCores;
+
+    std::vector<KeySlice> slices(nbSlices);
+    const uint8_t *end = size + data;
+    const uint8_t *p = data;
+    for(size_t i=0; i<nbSlices; ++i) {
+        const uint8_t *e = data + (size*(i+1))/nbSlices;
+        while(e<end && '\n'!=e[-1]) ++e;
+        if(e<p) e = p;
+        slices[i].start = p;
+        slices[i].end = e;
+        p = e;
+    }
 
-        size_t sz = strlen(buf);
-        if('\n'==buf[sz-1]) buf[sz-1] = 0;
+    std::vector<std::thread> threads;
+    for(size_t i=1; i<nbSlices; ++i) threads.push_back(std::thread(&KeySlice::decode, &slices[i]));
+    slices[0].decode();
+    for(auto &t:threads) t.join();
 
-        uint160_t h160;
-        bool ok = addAddr(result, (uint8_t*)buf, verbose);
-        if(ok) {
-            ++found;
-        } else {
-            if(verbose) {
+    size_t found = 0;
+    size_t lineCount = 0;
+    for(auto &slice:slices) {
+        if(verbose) {
+            for(auto &bad:slice.badLines) {
                 warning(
                     "in file %s, line %d, %s is not an address\n",
                     fileName,
-                    lineCount,
-                    buf
+                    (int)(lineCount + bad.first),
+                    bad.second.c_str()
                 );
             }
         }
+        lineCount += slice.nbLines;
+        found += slice.keys.size();
+    }
+
+    std::vector<uint160_t> keys;
+    keys.reserve(found);
+    for(auto &slice:slices) {
+        keys.insert(keys.end(), slice.keys.begin(), slice.keys.end());
+        std::vector<uint160_t>().swap(slice.keys);
     }
-    fclose(f);
+
+    std::sort(keys.begin(), keys.end(), Hash160Less());
+    keys.erase(std::unique(keys.begin(), keys.end(), hash160Same), keys.end());
+    result.insert(result.end(), keys.begin(), keys.end());
+
+    if(mapped) munmap(mapped, size);
+    if(!isStdIn) close(fd);
 
     double elapsed = (usecs() - start)*1e-6;
     info(
-        "file %s loaded in %.2f secs, found %d addresses",
+        "file %s loaded in %.2f secs, found %d addresses (%d distinct)",
         fileName,
         elapsed,
-        (int)found
+        (int)found,
+        (int)keys.size()
     );
 }
 
@@ -708,13 +1404,15 @@ std::string pr128(
 }
 
 void showFullAddr(
-    const Hash160 &addr,
-    bool both
+    const Hash160        &addr,
+    bool                 both,
+    int                  type,
+    const WitnessProgram *program
 )
 {
-    uint8_t b58[128];
+    uint8_t b58[kAddrSize];
     if(both) showHex(addr, sizeof(uint160_t), false);
-    hash160ToAddr(b58, addr);
+    keyToAddr(b58, type, addr, program);
     printf(
         "%s%s",
         both ? " " : "", b58
@@ -752,3 +1450,112 @@ double difficulty(unsigned int bits)
     return dDiff;
 }
 
+
+const char *mapBackendName(
+    int backend
+)
+{
+    static const char *names[] = {
+        #define MAP_BACKEND(x, name, desc) #name,
+            MAP_BACKENDS
+        #undef MAP_BACKEND
+    };
+    if(backend<0 || kNbMapBackends<=backend) return "unknown";
+    return names[backend];
+}
+
+static int parseMapBackend(
+    const char *s,
+    size_t     size
+)
+{
+    for(int i=0; i<kNbMapBackends; ++i) {
+        const char *name = mapBackendName(i);
+        if(size==strlen(name) && 0==strncmp(s, name, size)) return i;
+    }
+    errFatal(
+        "BLOCKPARSER_MAPS: unknown map backend \"%.*s\", expected one of:"
+        #define MAP_BACKEND(x, name, desc) " " #name
+            MAP_BACKENDS
+        #undef MAP_BACKEND
+        ,
+        (int)size,
+        s
+    );
+    return -1;
+}
+
+static int parseMapRole(
+    const char *s,
+    size_t     size
+)
+{
+    static const char *names[] = {
+        #define MAP_ROLE(x, name, desc) #name,
+            MAP_ROLES
+        #undef MAP_ROLE
+    };
+    for(int i=0; i<kNbMapRoles; ++i) {
+        if(size==strlen(names[i]) && 0==strncmp(s, names[i], size)) return i;
+    }
+    errFatal(
+        "BLOCKPARSER_MAPS: unknown map role \"%.*s\", expected one of:"
+        #define MAP_ROLE(x, name, desc) " " #name
+            MAP_ROLES
+        #undef MAP_ROLE
+        ,
+        (int)size,
+        s
+    );
+    return -1;
+}
+
+struct MapBackends
+{
+    int backends[kNbMapRoles];
+
+    MapBackends()
+    {
+        #if defined(WANT_DENSE)
+            int fallback = kMapDense;
+        #else
+            int fallback = kMapSparse;
+        #endif
+        for(int i=0; i<kNbMapRoles; ++i) backends[i] = fallback;
+
+        // Comma separated list of "backend" (all roles) or "role=backend"
+        const char *s = getenv("BLOCKPARSER_MAPS");
+        if(0==s) return;
+        while(1) {
+            const char *e = strchr(s, ',');
+            size_t size = e ? (size_t)(e-s) : strlen(s);
+            const char *eq = (const char*)memchr(s, '=', size);
+            if(0==eq) {
+                int backend = parseMapBackend(s, size);
+                for(int i=0; i<kNbMapRoles; ++i) backends[i] = backend;
+            } else {
+                int role = parseMapRole(s, eq-s);
+                backends[role] = parseMapBackend(1+eq, size - (1+eq-s));
+            }
+            if(0==e) break;
+            s = 1 + e;
+        }
+
+        info(
+            "hash maps: tx=%s block=%s addr=%s",
+            mapBackendName(backends[kMapRoleTX]),
+            mapBackendName(backends[kMapRoleBlock]),
+            mapBackendName(backends[kMapRoleAddr])
+        );
+    }
+};
+
+int mapBackend(
+    int role
+)
+{
+    // Maps are built during static init, so this can't be a plain global
+    static const MapBackends backends;
+    return backends.backends[role];
+}
+
@@ -3,9 +3,14 @@
 
     #include <string>
     #include <vector>
+    #include <algorithm>
     #include <common.h>
     #include <rmd160.h>
     #include <sha256.h>
+    #include <arena.h>
+    #include <hashmap.h>
+    #include <google/dense_hash_map>
+    #include <google/sparse_hash_map>
 
     typedef const uint8_t *Hash160;
     typedef const uint8_t *Hash256;
@@ -60,106 +65,269 @@
         }
     };
 
+    struct BlockCopy;
+
     struct Block
     {
-        const uint8_t *data;
-        int64_t       height;
-        Block         *prev;
-        Block         *next;
+        const uint8_t   *data;
+        int64_t         height;
+        Block           *prev;
+        Block           *next;
+        const BlockCopy *copy;      // parser internal: set when data points to a copy of the header, see parser.cpp
     };
 
+    extern Arena<Block>     gBlockArena;
+    extern Arena<uint256_t> gHash256Arena;
+    extern Arena<uint160_t> gHash160Arena;
+
+    static inline Block   *allocBlock()   { return gBlockArena.alloc();                                 }
+    static inline uint8_t *allocHash256() { return reinterpret_cast<uint8_t*>(gHash256Arena.alloc());   }
+    static inline uint8_t *allocHash160() { return reinterpret_cast<uint8_t*>(gHash160Arena.alloc());   }
+
+    // Hand back a hash that is no longer referenced, the next alloc reuses it
+    static inline void recycleHash256(uint8_t *h) { gHash256Arena.recycle(reinterpret_cast<uint256_t*>(h)); }
+    static inline void recycleHash160(uint8_t *h) { gHash160Arena.recycle(reinterpret_cast<uint160_t*>(h)); }
+
+    // Role a map plays when none is given, from what it hashes
+    static inline int defaultMapRole(const Hash160Hasher &) { return kMapRoleAddr; }
+    static inline int defaultMapRole(const Hash256Hasher &) { return kMapRoleTX;   }
+
+    // Hash map used throughout. The backend (see hashmap.h) is picked at
+    // runtime, per map role, so speed can be traded against RAM without a
+    // rebuild. All three are compiled in; a map only ever fills one of them.
     template<
-        typename T,
-        size_t   kPageSize = 16384
+        typename Key,
+        typename Value,
+        typename Hasher,
+        typename Equal
     >
-    struct PagedAllocator
+    struct GoogMap
     {
-        static T *pool;
-        static T *poolEnd;
-        enum { kPageByteSize = sizeof(T)*kPageSize };
+        typedef google::sparse_hash_map<Key, Value, Hasher, Equal> SparseMap;
+        typedef google::dense_hash_map< Key, Value, Hasher, Equal> DenseMap;
+        typedef SwissMap<               Key, Value, Hasher, Equal> SwissTable;
 
-        static T *alloc()
+        struct Map
         {
-            if(unlikely(poolEnd<=pool)) {
-                pool = static_cast<T*>(malloc(kPageByteSize));
-                poolEnd = kPageByteSize + pool;
-            }
+            typedef std::pair<const Key, Value> value_type;
 
-            T *result = pool;
-            pool += sizeof(T);
-            return result;
-        }
-    };
+            struct iterator
+            {
+                int backend;
+                typename SparseMap::iterator sparse;
+                typename DenseMap::iterator dense;
+                typename SwissTable::iterator swiss;
 
-    static inline Block   *allocBlock()   { return static_cast<Block*>(PagedAllocator<    Block>::alloc()); }
-    static inline uint8_t *allocHash256() { return         reinterpret_cast<uint8_t*>(PagedAllocator<uint256_t>::alloc()); }
-    static inline uint8_t *allocHash160() { return         reinterpret_cast<uint8_t*>(PagedAllocator<uint160_t>::alloc()); }
+                value_type &operator*() const
+                {
+                    switch(backend) {
+                        case kMapSwiss: return *swiss;
+                        case kMapDense: return *dense;
+                        default:        return *sparse;
+                    }
+                }
 
-    //#define WANT_DENSE
-    #if defined(WANT_DENSE)
+                value_type *operator->() const
+                {
+                    return &(**this);
+                }
 
-        // Faster, uses more RAM
+                iterator &operator++()
+                {
+                    switch(backend) {
+                        case kMapSwiss: ++swiss;  break;
+                        case kMapDense: ++dense;  break;
+                        default:        ++sparse; break;
+                    }
+                    return *this;
+                }
 
-        #include <google/dense_hash_map>
+                iterator operator++(int)
+                {
+                    iterator old = *this;
+                    ++(*this);
+                    return old;
+                }
 
-        template<
-            typename Key,
-            typename Value,
-            typename Hasher,
-            typename Equal
-        >
-        struct GoogMap
-        {
-            typedef google::dense_hash_map<
-                Key,
-                Value,
-                Hasher,
-                Equal
-            > MapBase;
-
-            struct Map:public MapBase
-            {
-                void setEmptyKey(
-                    const Key &empty
-                )
+                bool operator==(const iterator &o) const
                 {
-                    this->set_empty_key(empty);
+                    switch(backend) {
+                        case kMapSwiss: return swiss==o.swiss;
+                        case kMapDense: return dense==o.dense;
+                        default:        return sparse==o.sparse;
+                    }
+                }
+
+                bool operator!=(const iterator &o) const
+                {
+                    return !(*this==o);
                 }
             };
-        };
 
-    #else
+            explicit Map(
+                int role = defaultMapRole(Hasher())
+            )
+                :   backend(mapBackend(role))
+            {
+            }
 
-        // Slower, uses less RAM
+            void setEmptyKey(
+                const Key &empty
+            )
+            {
+                if(kMapDense==backend) dense.set_empty_key(empty);
+            }
 
-        #include <google/sparse_hash_map>
+            // Needed by the google maps before anything can be erased
+            void setDeletedKey(
+                const Key &deleted
+            )
+            {
+                switch(backend) {
+                    case kMapSwiss:                                 break;
+                    case kMapDense: dense.set_deleted_key(deleted);  break;
+                    default:        sparse.set_deleted_key(deleted); break;
+                }
+            }
 
-        template<
-            typename Key,
-            typename Value,
-            typename Hasher,
-            typename Equal
-        >
-        struct GoogMap
-        {
-            typedef google::sparse_hash_map<
-                Key,
-                Value,
-                Hasher,
-                Equal
-            > MapBase;
-
-            struct Map:public MapBase
+            void resize(
+                size_t n
+            )
             {
-                void setEmptyKey(
-                    const Key &empty
-                )
-                {
+                switch(backend) {
+                    case kMapSwiss: swiss.resize(n);  break;
+                    case kMapDense: dense.resize(n);  break;
+                    default:        sparse.resize(n); break;
                 }
-            };
+            }
+
+            size_t size() const
+            {
+                switch(backend) {
+                    case kMapSwiss: return swiss.size();
+                    case kMapDense: return dense.size();
+                    default:        return sparse.size();
+                }
+            }
+
+            Value &operator[](
+                const Key &key
+            )
+            {
+                switch(backend) {
+                    case kMapSwiss: return swiss[key];
+                    case kMapDense: return dense[key];
+                    default:        return sparse[key];
+                }
+            }
+
+            iterator find(
+                const Key &key
+            )
+            {
+                iterator i;
+                i.backend = backend;
+                switch(backend) {
+                    case kMapSwiss: i.swiss  = swiss.find(key);  break;
+                    case kMapDense: i.dense  = dense.find(key);  break;
+                    default:        i.sparse = sparse.find(key); break;
+                }
+                return i;
+            }
+
+            void erase(
+                iterator i
+            )
+            {
+                switch(backend) {
+                    case kMapSwiss: swiss.erase(i.swiss);   break;
+                    case kMapDense: dense.erase(i.dense);   break;
+                    default:        sparse.erase(i.sparse); break;
+                }
+            }
+
+            iterator begin()
+            {
+                iterator i;
+                i.backend = backend;
+                switch(backend) {
+                    case kMapSwiss: i.swiss  = swiss.begin();  break;
+                    case kMapDense: i.dense  = dense.begin();  break;
+                    default:        i.sparse = sparse.begin(); break;
+                }
+                return i;
+            }
+
+            iterator end()
+            {
+                iterator i;
+                i.backend = backend;
+                switch(backend) {
+                    case kMapSwiss: i.swiss  = swiss.end();  break;
+                    case kMapDense: i.dense  = dense.end();  break;
+                    default:        i.sparse = sparse.end(); break;
+                }
+                return i;
+            }
+
+        private:
+            Map(const Map &);
+            Map &operator=(const Map &);
+
+            int backend;
+            SparseMap sparse;
+            DenseMap dense;
+            SwissTable swiss;
         };
+    };
+
+    // Hashers for maps that store the hash bytes themselves as keys
+    struct Hash160KeyHasher { uint64_t operator()(const uint160_t &k) const { return Hash160Hasher()(k.v); } };
+    struct Hash256KeyHasher { uint64_t operator()(const uint256_t &k) const { return Hash256Hasher()(k.v); } };
+    struct Hash160KeyEqual  { bool operator()(const uint160_t &a, const uint160_t &b) const { return Hash160Equal()(a.v, b.v); } };
+    struct Hash256KeyEqual  { bool operator()(const uint256_t &a, const uint256_t &b) const { return Hash256Equal()(a.v, b.v); } };
+
+    static inline int defaultMapRole(const Hash160KeyHasher &) { return kMapRoleAddr; }
+    static inline int defaultMapRole(const Hash256KeyHasher &) { return kMapRoleTX;   }
+
+    // GoogMap with the 20/32 byte hashes stored inline in the table rather than
+    // pointed to, so a probe compares against the slot instead of chasing a
+    // pointer. It takes the same plain hash pointers as a Hash160/Hash256 keyed
+    // GoogMap; inserts copy the bytes, so any temporary (a stack buffer, a
+    // solved script) can be used as a key. iterator->first is the key struct.
+    template<
+        typename KeyStruct,
+        typename Value,
+        typename Hasher,
+        typename Equal
+    >
+    struct InlineKeyMap:public GoogMap<KeyStruct, Value, Hasher, Equal>::Map
+    {
+        typedef typename GoogMap<KeyStruct, Value, Hasher, Equal>::Map Base;
+
+        explicit InlineKeyMap(
+            int role = defaultMapRole(Hasher())
+        )
+            :   Base(role)
+        {
+        }
+
+        static KeyStruct key(
+            const uint8_t *hash
+        )
+        {
+            KeyStruct k;
+            memcpy(k.v, hash, sizeof(k.v));
+            return k;
+        }
 
-    #endif
+        void setEmptyKey(const uint8_t *empty) { Base::setEmptyKey(key(empty));       }
+        Value &operator[](const uint8_t *hash) { return Base::operator[](key(hash));    }
+        typename Base::iterator find(const uint8_t *hash) { return Base::find(key(hash)); }
+    };
+
+    template<typename Value> struct Hash160Map { typedef InlineKeyMap<uint160_t, Value, Hash160KeyHasher, Hash160KeyEqual> Map; };
+    template<typename Value> struct Hash256Map { typedef InlineKeyMap<uint256_t, Value, Hash256KeyHasher, Hash256KeyEqual> Map; };
 
     #define SKIP(type, var, p)       \
         p += sizeof(type)            \
@@ -184,6 +352,14 @@
 
     double usecs();
 
+    // Like toHex, but without the terminating 0: writes exactly 2*size bytes
+    void hexEncode(
+              uint8_t *dst,
+        const uint8_t *src,
+        size_t        size = kSHA256ByteSize,
+        bool          rev = true
+    );
+
     void toHex(
               uint8_t *dst,
         const uint8_t *src,
@@ -202,6 +378,7 @@
         bool abortOnErr = true
     );
 
+    // src must hold at least 2*dstSize characters
     bool fromHex(
               uint8_t *dst,
         const uint8_t *src,
@@ -227,6 +404,66 @@
         const uint8_t *compressedKey
     );
 
+    // Standard output script types. Codes are what solveOutputScript returns, and end up in archives.
+    #define OUTPUT_SCRIPT_TYPES                                                                 \
+        SCRIPT_TYPE(Broken,          -2, "broken script generated by p2pool - coins lost"  ) \
+        SCRIPT_TYPE(Unknown,         -1, "couldn't parse script"                           ) \
+        SCRIPT_TYPE(P2PKH,            0, "pays to hash160(pubKey)"                         ) \
+        SCRIPT_TYPE(P2PK,             1, "pays to explicit uncompressed pubKey"            ) \
+        SCRIPT_TYPE(P2PKCompressed,   2, "pays to explicit compressed pubKey"              ) \
+        SCRIPT_TYPE(P2SH,             3, "pays to hash160(script)"                         ) \
+        SCRIPT_TYPE(P2WPKH,           4, "pays to segwit v0 hash160(pubKey)"               ) \
+        SCRIPT_TYPE(P2WSH,            5, "pays to segwit v0 sha256(script)"                ) \
+        SCRIPT_TYPE(P2TR,             6, "pays to taproot output key"                      ) \
+        SCRIPT_TYPE(MultiSig,         7, "pays to bare m-of-n multisig"                    ) \
+
+    enum OutputScriptType
+    {
+        #define SCRIPT_TYPE(x, code, name) kScript##x = code,
+            OUTPUT_SCRIPT_TYPES
+        #undef SCRIPT_TYPE
+    };
+
+    // What it takes to turn a descriptor's program into the 20 byte key used by all commands
+    enum ScriptHashing
+    {
+        kScriptHashingNone = 0,     // program is already a hash160
+        kScriptHashing160  = 1,     // key is hash160(program): pubKeys, witness programs, bare multisig scripts
+    };
+
+    struct ScriptDescriptor
+    {
+        int8_t        type;         // OutputScriptType
+        uint8_t       hashing;      // ScriptHashing
+        uint8_t       m;            // multisig only: required signatures
+        uint8_t       n;            // multisig only: number of keys
+        uint32_t      programSize;
+        const uint8_t *program;     // view into the script: hash, pubKey, witness program, or the whole script
+    };
+
+    const char *outputScriptTypeName(
+        int type
+    );
+
+    int classifyOutputScript(
+        ScriptDescriptor &desc,
+        const uint8_t    *script,
+        uint64_t         scriptSize
+    );
+
+    void classifyOutputScripts(
+              ScriptDescriptor *descs,
+        const uint8_t          *const *scripts,
+        const uint64_t         *scriptSizes,
+        size_t                 n
+    );
+
+    // The 20 byte key of a classified script (type must be >= 0)
+    void scriptKey(
+              uint8_t          *pubKeyHash,
+        const ScriptDescriptor &desc
+    );
+
     int solveOutputScript(
               uint8_t *pubKeyHash,
         const uint8_t *script,
@@ -234,14 +471,94 @@
         uint8_t       *type
     );
 
-    static inline void sha256Twice(
-              uint8_t *sha,
-        const uint8_t *buf,
-        size_t      size
+    // Tell solveOutputScript how script, an output about to be handed to the callbacks, was
+    // already classified (archives do that once, at export): it then answers without solving it again
+    void setSolvedOutput(
+        const uint8_t *script,
+        int           type,
+        const uint8_t *pubKeyHash
+    );
+
+    // Witness program of a segwit output. Its key is a hash of it, so showing its address takes the program.
+    struct WitnessProgram
+    {
+        uint8_t size;                   // 0 for outputs of any other type
+        uint8_t v[kSHA256ByteSize];
+    };
+
+    void witnessProgram(
+        WitnessProgram &program,
+        int            type,            // as returned by solveOutputScript for script
+        const uint8_t  *script,
+        uint64_t       scriptSize
+    );
+
+    // Witness programs of the segwit rows of a table of keys, for tables that grow
+    // by appending rows: row ids come in increasing order, lookups are a binary search
+    struct WitnessPrograms
+    {
+        std::vector<uint32_t> rows;
+        std::vector<WitnessProgram> programs;
+
+        void add(
+            uint32_t             row,
+            const WitnessProgram &program
+        )
+        {
+            if(0==program.size) return;
+            rows.push_back(row);
+            programs.push_back(program);
+        }
+
+        const WitnessProgram *find(
+            uint32_t row
+        ) const
+        {
+            auto i = std::lower_bound(rows.begin(), rows.end(), row);
+            if(rows.end()==i || row!=*i) return 0;
+            return &programs[i - rows.begin()];
+        }
+    };
+
+    // Longest text keyToAddr writes, plus the terminating 0
+    enum { kAddrSize = 72 };
+
+    // Address of a key, given the type of the outputs it comes from: base58 for P2PKH,
+    // P2PK and P2SH, bech32 for segwit v0, bech32m for taproot. Bare multisig has no
+    // address: it shows as "multisig:" and the key in hex. Returns the size of the text.
+    size_t keyToAddr(
+              uint8_t        *addr,
+        int                  type,
+        const uint8_t        *key,
+        const WitnessProgram *program = 0   // required for segwit types
+    );
+
+    // Same, straight from an output script. Returns its type; < 0, with an empty string, when it pays to no key
+    int scriptToAddr(
+              uint8_t *addr,
+        const uint8_t *script,
+        uint64_t      scriptSize
+    );
+
+    // Short name of a type, shown next to addresses: P2PKH, P2SH, P2WPKH, P2TR, MultiSig, ...
+    const char *outputScriptTypeTag(
+        int type
+    );
+
+    // Segwit types: their keys are hashes of a witness program
+    static inline bool isSegwitType(
+        int type
     )
     {
-        sha256(sha, buf, size);
-        sha256(sha, sha, kSHA256ByteSize);
+        return kScriptP2WPKH==type || kScriptP2WSH==type || kScriptP2TR==type;
+    }
+
+    // The type an address shows as, the same for all the types that share a key: P2PK outputs show as P2PKH
+    static inline int addressType(
+        int type
+    )
+    {
+        return (kScriptP2PK==type || kScriptP2PKCompressed==type) ? kScriptP2PKH : type;
     }
 
     extern const uint8_t hexDigits[];
@@ -252,6 +569,21 @@
         bool abortOnErr = true
     );
 
+    // Longest base58 encoding of a 25 byte payload, plus the terminating 0
+    enum { kBase58AddrSize = 36 };
+
+    // Base58 of a 25 byte payload (version + hash160 + checksum), no BIGNUMs, thread-safe
+    void base58Encode25(
+              uint8_t *addr,
+        const uint8_t *payload
+    );
+
+    // Base58check of a 21 byte payload (version + hash160)
+    void base58CheckEncode(
+              uint8_t *addr,
+        const uint8_t *payload
+    );
+
     void hash160ToAddr(
               uint8_t *addr,
         const uint8_t *hash160,
@@ -262,6 +594,19 @@
         #endif
     );
 
+    // Batch form of hash160ToAddr: hash160s holds n packed hashes, address i
+    // is written 0-terminated at addrs + i*kBase58AddrSize
+    void hash160ToAddrs(
+              uint8_t *addrs,
+        const uint8_t *hash160s,
+        size_t        n,
+        #if defined(LITECOIN)
+              uint8_t type = 48
+        #else
+              uint8_t type = 0
+        #endif
+    );
+
     bool addrToHash160(
               uint8_t *hash160,
         const uint8_t *addr,
@@ -296,8 +641,10 @@
     );
 
     void showFullAddr(
-        const Hash160 &addr,
-        bool both = false
+        const Hash160        &addr,
+        bool                 both = false,
+        int                  type = kScriptP2PKH,   // see keyToAddr
+        const WitnessProgram *program = 0
     );
 
     uint64_t getBaseReward(